@@ -94,6 +94,9 @@ WITH_EPOLL:=yes
 # Build with bundled uthash.h
 WITH_BUNDLED_DEPS:=yes
 
+# Build with zlib support for compressed bridges. Requires zlib.
+WITH_ZLIB:=yes
+
 # Build with coverage options
 WITH_COVERAGE:=no
 
@@ -267,6 +270,11 @@ ifeq ($(WITH_ADNS),yes)
 	BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -DWITH_ADNS
 endif
 
+ifeq ($(WITH_ZLIB),yes)
+	BROKER_LDADD:=$(BROKER_LDADD) -lz
+	BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -DWITH_ZLIB
+endif
+
 MAKE_ALL:=mosquitto
 ifeq ($(WITH_DOCS),yes)
 	MAKE_ALL:=$(MAKE_ALL) docs
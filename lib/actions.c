@@ -110,7 +110,7 @@ int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, const char *topic, in
     
 	if(qos == 0){
 #ifdef WITH_BROKER
-        return send__publish(NULL, mosq, local_mid, topic, payloadlen, payload, qos, retain, false, outgoing_properties, NULL, 0, NULL);
+        return send__publish(NULL, mosq, local_mid, topic, payloadlen, payload, qos, retain, false, outgoing_properties, NULL, 0, NULL, NULL);
 #else
         return send__publish(mosq, local_mid, topic, payloadlen, payload, qos, retain, false, outgoing_properties, NULL, 0, NULL);
 #endif
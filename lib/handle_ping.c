@@ -33,6 +33,7 @@ Contributors:
 #include "packet_mosq.h"
 #include "read_handle.h"
 #include "send_mosq.h"
+#include "time_mosq.h"
 #include "util_mosq.h"
 #include "util_list.h"
 
@@ -62,6 +63,10 @@ int handle__pingresp(struct mosquitto *mosq)
 
 	mosq->ping_t = 0; /* No longer waiting for a PINGRESP. */
 #ifdef WITH_BROKER
+	if(mosq->bridge && !mosq->bridge_main && mosq->bridge->ping_sent_ms){
+		stp__rtt_sample(mosq->bridge, mosquitto_time_ms() - mosq->bridge->ping_sent_ms);
+		mosq->bridge->ping_sent_ms = 0;
+	}
 	log__printf(NULL, MOSQ_LOG_NOTICE, "Received PINGRESP from %s", mosq->id);
 #else
 	log__printf(mosq, MOSQ_LOG_NOTICE, "Client %s received PINGRESP", mosq->id);
@@ -79,7 +84,7 @@ int handle__pingreqcomp(struct mosquitto_db *db, struct mosquitto *mosq)
     int slen;
     uint16_t slen16;
     uint16_t keepalive = 0;
-    struct mosquitto__bpdu__packet *recv_packet;
+    struct mosquitto__bpdu__packet recv_packet;
     
     assert(mosq);
     
@@ -87,9 +92,6 @@ int handle__pingreqcomp(struct mosquitto_db *db, struct mosquitto *mosq)
         return MOSQ_ERR_PROTOCOL;
     }
     
-    recv_packet = mosquitto__calloc(1, sizeof(struct mosquitto__bpdu__packet));
-    if(!recv_packet) return MOSQ_ERR_NOMEM;
-    
     if(packet__read_uint16(&mosq->in_packet, &slen16)){
         rc = 1;
     }
@@ -150,47 +152,22 @@ int handle__pingreqcomp(struct mosquitto_db *db, struct mosquitto *mosq)
         }
     }
     
-    /* Source properties */
-    if(packet__read_string(&mosq->in_packet, &recv_packet->origin_address, &slen)){
-        rc = 1;
-        goto handle_connect_error;
-    }
-    if(packet__read_string(&mosq->in_packet, &recv_packet->origin_port, &slen)){
-        rc = 1;
-        goto handle_connect_error;
-    }
-    
-    /* Root properties */
-    if(packet__read_string(&mosq->in_packet, &recv_packet->root_address, &slen)){
-        rc = 1;
-        goto handle_connect_error;
-    }
-    if(packet__read_string(&mosq->in_packet, &recv_packet->root_port, &slen)){
-        rc = 1;
-        goto handle_connect_error;
-    }
-    
-    /* Other */
-    if(packet__read_string(&mosq->in_packet, &recv_packet->distance, &slen)){
-        rc = 1;
-        goto handle_connect_error;
-    }
-    if(packet__read_string(&mosq->in_packet, &recv_packet->origin_pid, &slen)){
-        rc = 1;
-        goto handle_connect_error;
-    }
-    if(packet__read_string(&mosq->in_packet, &recv_packet->root_pid, &slen)){
-        rc = 1;
+    if(packet__read_bpdu(&mosq->in_packet, &recv_packet)){
+        rc = MOSQ_ERR_PROTOCOL;
         goto handle_connect_error;
     }
     
-    //log__printf(NULL, MOSQ_LOG_DEBUG, "[PING] [r(%s, %s), d(%s), o(%s, %s)]", recv_packet->root_port, recv_packet->root_pid, recv_packet->distance, recv_packet->origin_port, recv_packet->origin_pid);    
-
      /* Store packet fields */
 #ifdef WITH_BROKER
-    log__printf(NULL, MOSQ_LOG_DEBUG, "[BPDU] [r(%s:%s, %s), d(%s), o(%s:%s, %s)]", recv_packet->root_address, recv_packet->root_port, recv_packet->root_pid, recv_packet->distance, recv_packet->root_address, recv_packet->root_port, recv_packet->origin_pid);
+    log__printf(NULL, MOSQ_LOG_DEBUG, "[BPDU] [r(%s:%d, %d), d(%d), o(%s:%d, %d)]", recv_packet.root_address, recv_packet.root_port, recv_packet.root_id, recv_packet.distance, recv_packet.origin_address, recv_packet.origin_port, recv_packet.origin_id);
     
-    if(update__stp_properties(db, db->stp, db->config->bridges, recv_packet)){
+    if(!mosq->stp_port){
+        mosq->stp_port = stp__port_find(db, &recv_packet);
+    }
+    if(recv_packet.stamped){
+        mosq->stp_stamped = true;
+    }
+    if(update__stp_properties(db, db->stp, mosq->stp_port, &recv_packet)){
         log__printf(NULL, MOSQ_LOG_ERR, "Impossible to update STP fields.");
     }
 #endif
@@ -148,9 +148,23 @@ struct session_expiry_list {
 	struct session_expiry_list *next;
 };
 
+/* Size at which a bridge spool starts a new segment file. */
+#define BRIDGE_SPOOL_SEGMENT_SIZE (16*1024*1024)
+/* Default for bridge_spool_memory. */
+#define BRIDGE_SPOOL_MEMORY_DEFAULT 1000
+
+/* A context with write_batch set holds back PUBLISHes until that many bytes
+ * are queued or the main loop flushes it, then hands up to WRITE_BATCH_IOV
+ * packets to a single writev(). */
+#define WRITE_BATCH_IOV 64
+#define WRITE_BATCH_BYTES_MAX 1048576
+
 /* add RAM, CPU, etc... */
 struct broker__resources{
     int pid;
+    int priority;
+    int cpu_load; /* Percent of one core used by the broker */
+    int queued_kb; /* Size of the message store */
 };
 
 /* Static information about a broker */
@@ -160,28 +174,153 @@ struct broker__info{
     struct broker__resources *res;
 };
 
+/* Longest textual address carried in a BPDU (INET6_ADDRSTRLEN). */
+#define STP_ADDRESS_LEN 46
+
+/* First byte of a binary BPDU. A legacy BPDU starts with the high byte of the
+ * origin address length, which is always 0 for addresses that fit above. */
+#define STP_BPDU_BINARY 0xB1
+
+/* Set in the binary BPDU marker by a bridge that stamps its PUBLISHes. It
+ * is only sent once the peer has set CONNACK_STP_STAMP, and always before
+ * the first stamped PUBLISH. */
+#define STP_BPDU_STAMPED 0x02
+
+/* CONNACK acknowledge flag set by brokers that accept binary BPDUs. */
+#define CONNACK_STP_BINARY 0x02
+/* CONNACK acknowledge flag set by brokers that accept stamped PUBLISHes. */
+#define CONNACK_STP_STAMP 0x04
+/* CONNACK acknowledge flag set by brokers that accept interest updates. */
+#define CONNACK_STP_INTEREST 0x08
+/* CONNACK acknowledge flag set by brokers that accept compressed batches. */
+#define CONNACK_STP_COMPRESS 0x10
+
+/* A bridge with compression on sends runs of queued PUBLISHes as one QoS 0
+ * PUBLISH on this topic. The payload is the length of the run as a uint32
+ * followed by the run compressed with zlib. */
+#define STP_COMPRESS_TOPIC "$STP/deflate"
+/* Runs shorter than this are sent as they are. */
+#define STP_COMPRESS_MIN 256
+/* Longest run in one batch. */
+#define STP_COMPRESS_MAX 1048576
+/* Batch a compressing bridge holds back when write_batch_bytes is smaller. */
+#define STP_COMPRESS_BATCH 16384
+#define STP_COMPRESS_LEVEL_DEFAULT 1
+
+/* Interest updates are QoS 0 PUBLISHes on this topic from a bridge to the
+ * broker it connects to. The payload is a list of records, each an op byte
+ * followed by a length prefixed subscription filter. */
+#define STP_INTEREST_TOPIC "$STP/interest"
+#define STP_INTEREST_ADD 1
+#define STP_INTEREST_REMOVE 2
+/* Least time between two rounds of interest updates, in ms. */
+#define STP_INTEREST_HOLD_MS 100
+
+/* A stamped PUBLISH carries the id of the broker where the message entered
+ * the mesh and a sequence number from that broker, between the variable
+ * header and the payload. A zero origin means no stamp. */
+struct mosquitto__stp_stamp{
+    uint64_t origin;
+    uint64_t seq;
+};
+#define STP_STAMP_LEN 16
+
+/* Duplicate filter: a sliding window of the last STP_DEDUP_WINDOW sequence
+ * numbers for each of at most STP_DEDUP_ORIGINS_MAX origins. The origin
+ * splits its topics into STP_DEDUP_SHARDS by stp__topic_shard() and numbers
+ * each shard on its own, with the shard in the top bits of the sequence
+ * number so that every broker on the way sees the same one whatever the
+ * topic is remapped to. Each shard has its own window, and a bundled bridge
+ * sends a shard over a single link, so messages of a shard never overtake
+ * each other on the way. */
+#define STP_DEDUP_WINDOW 64
+#define STP_DEDUP_ORIGINS_MAX 4096
+#define STP_DEDUP_SHARDS 16
+#define STP_SEQ_SHARD_SHIFT 60
+#define STP_SEQ_SHARD(seq) ((int)((seq) >> STP_SEQ_SHARD_SHIFT) % STP_DEDUP_SHARDS)
+
+/* In BPDUs a broker is identified by its priority and PID packed into one
+ * integer, priority in the high bits, so both BPDU formats carry it and the
+ * lowest id wins the root election. PIDs never need more than 22 bits. */
+#define STP_PID_BITS 22
+#define STP_PID_MASK ((1<<STP_PID_BITS)-1)
+#define STP_PRIORITY_MAX 511
+#define STP_PRIORITY_DEFAULT 256
+
+/* Default cost added to the root distance for each bridge hop. */
+#define STP_PATH_COST_DEFAULT 1
+
+/* On top of the configured path cost, a bridge costs 1 for every
+ * STP_RTT_COST_MS of smoothed PINGREQ round trip, and the peer's advertised
+ * load adds 1 for every STP_CPU_COST percent of CPU and STP_QUEUE_COST_KB
+ * of queued messages. */
+#define STP_RTT_COST_MS 10
+#define STP_CPU_COST 10
+#define STP_QUEUE_COST_KB 1024
+
+/* A cheaper root port only replaces the current one when its cost plus
+ * 1/STP_COST_HYSTERESIS of it is still below the current cost, so that
+ * measurement noise can't flap the tree between two similar paths. */
+#define STP_COST_HYSTERESIS 8
+
+/* Root or distance changes are sent to the designated ports straight away,
+ * but no more than once per STP_BPDU_HOLD_MS on each bridge. */
+#define STP_BPDU_HOLD_MS 200
+
 struct mosquitto__stp{
     struct broker__info *my;
     struct broker__info *my_root;
     int distance;
+    char root_address[STP_ADDRESS_LEN];
 };
 
+/* A decoded BPDU. Fixed size so that it can be read straight off the wire
+ * into a stack variable or into a bridge's last_bpdu. */
 struct mosquitto__bpdu__packet{
-    char *origin_address;
-    char *origin_port;
-    char *origin_pid;
-
-    char *root_address;
-    char *root_port;
-    char *root_pid;
-    
-    char *distance;
-   
+    char origin_address[STP_ADDRESS_LEN];
+    int origin_port;
+    int origin_id;
+
+    char root_address[STP_ADDRESS_LEN];
+    int root_port;
+    int root_id;
+
+    int distance;
+
+    /* Origin stamps its PUBLISHes, only carried by binary BPDUs. */
+    bool stamped;
+
+    /* Load of the origin broker, only carried by binary BPDUs. */
+    int origin_cpu_load;
+    int origin_queued_kb;
+};
+
+#ifdef WITH_BROKER
+/* Reference counted bytes shared by several packets. Either a PUBLISH
+ * encoded once for each subscriber, see send__publish_store(), where a
+ * packet with a packet identifier has its own copy of the first head_length
+ * bytes, which end with it. Or a received packet whose payload a stored
+ * message has kept, see zero_copy_bytes. */
+struct mosquitto__frame{
+	struct mosquitto__frame *next;
+	uint8_t *data;
+	uint32_t length;
+	uint32_t remaining_length;
+	uint32_t head_length;
+	int ref_count;
+	uint8_t variant;
 };
+#endif
 
 struct mosquitto__packet{
 	uint8_t *payload;
 	struct mosquitto__packet *next;
+#ifdef WITH_BROKER
+	struct mosquitto__frame *frame; /* Sent from head_length on, instead of payload */
+	struct mosquitto__frame *tail; /* Holds tail_data, sent after frame */
+	uint8_t *tail_data;
+	uint32_t head_length;
+#endif
 	uint32_t remaining_mult;
 	uint32_t remaining_length;
 	uint32_t packet_length;
@@ -190,7 +329,6 @@ struct mosquitto__packet{
 	uint16_t mid;
 	uint8_t command;
 	int8_t remaining_count;
-    struct mosquitto__bpdu__packet *bpdu;
 };
 
 struct mosquitto_message_all{
@@ -308,6 +446,18 @@ struct mosquitto {
 	bool is_dropping;
 	bool is_bridge;
 	struct mosquitto__bridge *bridge;
+	struct mosquitto *bridge_main; /* Set on the extra links of a bundled bridge, the bridge's own context */
+	struct mosquitto__bridge *stp_port; /* Local bridge towards the broker on the far end of an incoming bridge */
+	bool stp_stamped; /* PUBLISHes from this client carry a struct mosquitto__stp_stamp */
+	bool stp_peer; /* Its CONNECT carried a BPDU, the client is an MQTT-ST broker */
+	bool stp_compress; /* Bridge connection whose peer accepted compressed batches in its CONNACK */
+	int write_batch; /* write_batch_bytes, 0 to write every packet as it is queued */
+	int write_batch_pending; /* Bytes of PUBLISHes queued since the last packet__write() */
+	struct mosquitto__packet *compress_from; /* First packet queued since bridge__compress_queue() last ran */
+	struct mosquitto__packet *compress_prev; /* The queued packet before compress_from, NULL if none */
+	struct mosquitto *pending_prev; /* In db->loop_pending */
+	struct mosquitto *pending_next;
+	bool pending;
 	struct mosquitto_msg_data msgs_in;
 	struct mosquitto_msg_data msgs_out;
 	struct mosquitto__acl_user *acl_list;
@@ -934,6 +934,18 @@ ssize_t net__write(struct mosquitto *mosq, void *buf, size_t count)
 }
 
 
+#ifndef WIN32
+/* Plain sockets only, TLS connections go through net__write(). */
+ssize_t net__writev(struct mosquitto *mosq, const struct iovec *iov, int iovcnt)
+{
+	assert(mosq);
+
+	errno = 0;
+	return writev(mosq->sock, iov, iovcnt);
+}
+#endif
+
+
 int net__socket_nonblock(mosq_sock_t *sock)
 {
 #ifndef WIN32
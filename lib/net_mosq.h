@@ -17,6 +17,7 @@ Contributors:
 #define NET_MOSQ_H
 
 #ifndef WIN32
+#include <sys/uio.h>
 #include <unistd.h>
 #else
 #include <winsock2.h>
@@ -67,6 +68,9 @@ int net__socketpair(mosq_sock_t *sp1, mosq_sock_t *sp2);
 
 ssize_t net__read(struct mosquitto *mosq, void *buf, size_t count);
 ssize_t net__write(struct mosquitto *mosq, void *buf, size_t count);
+#ifndef WIN32
+ssize_t net__writev(struct mosquitto *mosq, const struct iovec *iov, int iovcnt);
+#endif
 
 #ifdef WITH_TLS
 int net__socket_apply_tls(struct mosquitto *mosq);
@@ -199,6 +199,32 @@ void packet__write_uint32(struct mosquitto__packet *packet, uint32_t word)
 }
 
 
+int packet__read_uint64(struct mosquitto__packet *packet, uint64_t *word)
+{
+	uint64_t val = 0;
+	int i;
+
+	assert(packet);
+	if(packet->pos+8 > packet->remaining_length) return MOSQ_ERR_PROTOCOL;
+
+	for(i=0; i<8; i++){
+		val = (val << 8) + packet->payload[packet->pos];
+		packet->pos++;
+	}
+
+	*word = val;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void packet__write_uint64(struct mosquitto__packet *packet, uint64_t word)
+{
+	packet__write_uint32(packet, (uint32_t)(word >> 32));
+	packet__write_uint32(packet, (uint32_t)(word & 0xFFFFFFFF));
+}
+
+
 int packet__read_varint(struct mosquitto__packet *packet, int32_t *word, int8_t *bytes)
 {
 	int i;
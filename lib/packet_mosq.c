@@ -18,6 +18,8 @@ Contributors:
 
 #include <assert.h>
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef WITH_BROKER
@@ -34,6 +36,7 @@ Contributors:
 #include "net_mosq.h"
 #include "packet_mosq.h"
 #include "read_handle.h"
+#include "stp_mosq.h"
 #include "util_string.h"
 #ifdef WITH_BROKER
 #  include "sys_tree.h"
@@ -45,93 +48,154 @@ Contributors:
 #  define G_PUB_MSGS_SENT_INC(A)
 #endif
 
-int set__payloadlen(struct mosquitto__packet *packet)
+/* Legacy BPDUs carry every field as a decimal string. */
+static int bpdu__legacy_int_len(int value)
 {
-    int length = 0;
-    
-    /* Source */
-    if(packet->bpdu->origin_address){
-        length = 2+strlen(packet->bpdu->origin_address);
-    }else{
-        length = 2;
-    }
-    
-    if(packet->bpdu->origin_port){
-        length += 2+strlen(packet->bpdu->origin_port);
-    }else{
-        length += 2;
-    }
-    
-    /* Root */
-    if(packet->bpdu->root_address){
-        length += 2+strlen(packet->bpdu->root_address);
-    }else{
-        length += 2;
-    }
-    
-    if(packet->bpdu->root_port){
-        length += 2+strlen(packet->bpdu->root_port);
-    }else{
-        length += 2;
-    }
-    
-    if(packet->bpdu->distance){
-        length += 2+strlen(packet->bpdu->distance);
-    }else{
-        length += 2;
-    }
-    
-    if(packet->bpdu->origin_pid){
-        length += 2+strlen(packet->bpdu->origin_pid);
-    }else{
-        length += 2;
-    }
-    
-    if(packet->bpdu->root_pid){
-        length += 2+strlen(packet->bpdu->root_pid);
+    char buf[12];
+
+    return 2+snprintf(buf, sizeof(buf), "%d", value);
+}
+
+static void bpdu__legacy_write_int(struct mosquitto__packet *packet, int value)
+{
+    char buf[12];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "%d", value);
+    packet__write_string(packet, buf, len);
+}
+
+static int bpdu__read_address(struct mosquitto__packet *packet, char *address)
+{
+    uint16_t slen;
+    int rc;
+
+    rc = packet__read_uint16(packet, &slen);
+    if(rc) return rc;
+    if(slen >= STP_ADDRESS_LEN) return MOSQ_ERR_PROTOCOL;
+
+    rc = packet__read_bytes(packet, address, slen);
+    if(rc) return rc;
+    address[slen] = '\0';
+    return MOSQ_ERR_SUCCESS;
+}
+
+static int bpdu__legacy_read_int(struct mosquitto__packet *packet, int *value)
+{
+    char buf[12];
+    uint16_t slen;
+    int rc;
+
+    rc = packet__read_uint16(packet, &slen);
+    if(rc) return rc;
+    if(slen >= sizeof(buf)) return MOSQ_ERR_PROTOCOL;
+
+    rc = packet__read_bytes(packet, buf, slen);
+    if(rc) return rc;
+    buf[slen] = '\0';
+    *value = atoi(buf);
+    return MOSQ_ERR_SUCCESS;
+}
+
+int packet__bpdu_len(struct mosquitto__stp *stp, bool binary)
+{
+    int length;
+
+    length = 2+strlen(stp->my->address) + 2+strlen(stp->my_root->address);
+    if(binary){
+        /* marker + ports + ids + distance + cpu load + queued kB */
+        length += 1 + 2+4 + 2+4 + 4 + 1+4;
     }else{
-        length += 2;
+        length += bpdu__legacy_int_len(stp->my->port);
+        length += bpdu__legacy_int_len(stp->my_root->port);
+        length += bpdu__legacy_int_len(stp->distance);
+        length += bpdu__legacy_int_len(stp__bridge_id(stp->my->res));
+        length += bpdu__legacy_int_len(stp__bridge_id(stp->my_root->res));
     }
-    
     return length;
 }
 
-struct mosquitto__bpdu__packet *packet__write_bpdu(struct mosquitto__stp *stp)
+void packet__write_bpdu(struct mosquitto__packet *packet, struct mosquitto__stp *stp, bool binary, bool stamped)
 {
-    struct mosquitto__bpdu__packet *bpdu_pkt = NULL;
-    
-    bpdu_pkt = mosquitto__calloc(1, sizeof(struct mosquitto__bpdu__packet));
-    if(!bpdu_pkt) return NULL;
-    
-    /* Source values */
-    if(stp->my->port){
-        bpdu_pkt->origin_port = convert_integer(stp->my->port);
-    }
-    if(stp->my->address){
-        bpdu_pkt->origin_address = stp->my->address;
-    }
-    
-    /* Root values */
-    if(stp->my_root->port){
-        bpdu_pkt->root_port = convert_integer(stp->my_root->port);
-    }
-    if(stp->my_root->address){
-        bpdu_pkt->root_address = stp->my_root->address;
-    }
-    
-    /* Resources values */
-    if(stp->my->res->pid){
-        bpdu_pkt->origin_pid = convert_integer(stp->my->res->pid);
-    }
-    if(stp->my_root->res->pid){
-        bpdu_pkt->root_pid = convert_integer(stp->my_root->res->pid);
+    if(binary){
+        packet__write_byte(packet, stamped ? STP_BPDU_BINARY|STP_BPDU_STAMPED : STP_BPDU_BINARY);
+        packet__write_uint16(packet, stp->my->port);
+        packet__write_uint32(packet, stp__bridge_id(stp->my->res));
+        packet__write_uint16(packet, stp->my_root->port);
+        packet__write_uint32(packet, stp__bridge_id(stp->my_root->res));
+        packet__write_uint32(packet, stp->distance);
+        packet__write_byte(packet, stp->my->res->cpu_load > UINT8_MAX ? UINT8_MAX : stp->my->res->cpu_load);
+        packet__write_uint32(packet, stp->my->res->queued_kb);
+        packet__write_string(packet, stp->my->address, strlen(stp->my->address));
+        packet__write_string(packet, stp->my_root->address, strlen(stp->my_root->address));
+    }else{
+        packet__write_string(packet, stp->my->address, strlen(stp->my->address));
+        bpdu__legacy_write_int(packet, stp->my->port);
+        packet__write_string(packet, stp->my_root->address, strlen(stp->my_root->address));
+        bpdu__legacy_write_int(packet, stp->my_root->port);
+        bpdu__legacy_write_int(packet, stp->distance);
+        bpdu__legacy_write_int(packet, stp__bridge_id(stp->my->res));
+        bpdu__legacy_write_int(packet, stp__bridge_id(stp->my_root->res));
     }
-    
-    if(stp->distance >= 0){
-        bpdu_pkt->distance = convert_integer(stp->distance);
+}
+
+/* Decode a BPDU of either format into bpdu, without allocating. */
+int packet__read_bpdu(struct mosquitto__packet *packet, struct mosquitto__bpdu__packet *bpdu)
+{
+    uint8_t byte;
+    uint16_t word16;
+    uint32_t word32;
+    int rc;
+
+    if(packet->pos >= packet->remaining_length) return MOSQ_ERR_PROTOCOL;
+
+    bpdu->origin_cpu_load = 0;
+    bpdu->origin_queued_kb = 0;
+    bpdu->stamped = false;
+
+    if((packet->payload[packet->pos] & ~STP_BPDU_STAMPED) == STP_BPDU_BINARY){
+        bpdu->stamped = packet->payload[packet->pos] & STP_BPDU_STAMPED;
+        packet->pos++;
+        rc = packet__read_uint16(packet, &word16);
+        if(rc) return rc;
+        bpdu->origin_port = word16;
+        rc = packet__read_uint32(packet, &word32);
+        if(rc) return rc;
+        bpdu->origin_id = word32;
+        rc = packet__read_uint16(packet, &word16);
+        if(rc) return rc;
+        bpdu->root_port = word16;
+        rc = packet__read_uint32(packet, &word32);
+        if(rc) return rc;
+        bpdu->root_id = word32;
+        rc = packet__read_uint32(packet, &word32);
+        if(rc) return rc;
+        bpdu->distance = word32;
+        rc = packet__read_byte(packet, &byte);
+        if(rc) return rc;
+        bpdu->origin_cpu_load = byte;
+        rc = packet__read_uint32(packet, &word32);
+        if(rc) return rc;
+        bpdu->origin_queued_kb = word32;
+        rc = bpdu__read_address(packet, bpdu->origin_address);
+        if(rc) return rc;
+        return bpdu__read_address(packet, bpdu->root_address);
     }
-    
-    return bpdu_pkt;
+
+    /* Legacy string format */
+    rc = bpdu__read_address(packet, bpdu->origin_address);
+    if(rc) return rc;
+    rc = bpdu__legacy_read_int(packet, &bpdu->origin_port);
+    if(rc) return rc;
+    rc = bpdu__read_address(packet, bpdu->root_address);
+    if(rc) return rc;
+    rc = bpdu__legacy_read_int(packet, &bpdu->root_port);
+    if(rc) return rc;
+    rc = bpdu__legacy_read_int(packet, &bpdu->distance);
+    if(rc) return rc;
+    rc = bpdu__legacy_read_int(packet, &bpdu->origin_id);
+    if(rc) return rc;
+    return bpdu__legacy_read_int(packet, &bpdu->root_id);
 }
 
 int packet__alloc(struct mosquitto__packet *packet)
@@ -184,10 +248,49 @@ void packet__cleanup(struct mosquitto__packet *packet)
 	packet->remaining_length = 0;
 	mosquitto__free(packet->payload);
 	packet->payload = NULL;
+#ifdef WITH_BROKER
+	packet__frame_deref(&packet->frame);
+	packet__frame_deref(&packet->tail);
+	packet->tail_data = NULL;
+	packet->head_length = 0;
+#endif
 	packet->to_process = 0;
 	packet->pos = 0;
 }
 
+#ifdef WITH_BROKER
+/* Take over the buffer a packet was read into. */
+struct mosquitto__frame *packet__frame_adopt(struct mosquitto__packet *packet)
+{
+	struct mosquitto__frame *frame;
+
+	frame = mosquitto__calloc(1, sizeof(struct mosquitto__frame));
+	if(!frame) return NULL;
+
+	frame->data = packet->payload;
+	frame->length = packet->remaining_length;
+	frame->remaining_length = packet->remaining_length;
+	frame->ref_count = 1;
+	packet->payload = NULL;
+
+	return frame;
+}
+
+void packet__frame_deref(struct mosquitto__frame **frame)
+{
+	if(!*frame) return;
+
+	(*frame)->ref_count--;
+	if((*frame)->ref_count == 0){
+		if((*frame)->data != (uint8_t *)&(*frame)[1]){
+			mosquitto__free((*frame)->data);
+		}
+		mosquitto__free(*frame);
+	}
+	*frame = NULL;
+}
+#endif
+
 int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
 {
 #ifndef WITH_BROKER
@@ -201,6 +304,12 @@ int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
 
 	packet->next = NULL;
 	pthread_mutex_lock(&mosq->out_packet_mutex);
+#if defined(WITH_BROKER) && defined(WITH_BRIDGE) && defined(WITH_ZLIB)
+	if(mosq->stp_compress && !mosq->compress_from){
+		mosq->compress_from = packet;
+		mosq->compress_prev = mosq->out_packet ? mosq->out_packet_last : NULL;
+	}
+#endif
 	if(mosq->out_packet){
 		mosq->out_packet_last->next = packet;
 	}else{
@@ -209,6 +318,18 @@ int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
 	mosq->out_packet_last = packet;
 	pthread_mutex_unlock(&mosq->out_packet_mutex);
 #ifdef WITH_BROKER
+	if(mosq->write_batch && ((packet->command)&0xF0) == CMD_PUBLISH
+#  ifdef WITH_WEBSOCKETS
+			&& !mosq->wsi
+#  endif
+			){
+
+		/* Leave it to a later packet or the main loop to write. */
+		mosq->write_batch_pending += packet->packet_length;
+		if(mosq->write_batch_pending < mosq->write_batch){
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
 #  ifdef WITH_WEBSOCKETS
 	if(mosq->wsi){
 		libwebsocket_callback_on_writable(mosq->ws_context, mosq->wsi);
@@ -256,16 +377,160 @@ int packet__check_oversize(struct mosquitto *mosq, uint32_t remaining_length)
 }
 
 
+static int packet__write_error(void)
+{
+#ifdef WIN32
+	errno = WSAGetLastError();
+#endif
+	if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
+		return MOSQ_ERR_SUCCESS;
+	}
+	switch(errno){
+		case COMPAT_ECONNRESET:
+			return MOSQ_ERR_CONN_LOST;
+		default:
+			return MOSQ_ERR_ERRNO;
+	}
+}
+
+
+/* The bytes of a packet from pos on that follow each other in memory: its
+ * own, then the rest of the frame it shares with others, then the payload
+ * it shares with them. */
+static uint8_t *packet__out_span(struct mosquitto__packet *packet, uint32_t pos, uint32_t *len)
+{
+	uint32_t end = packet->pos + packet->to_process;
+
+#ifdef WITH_BROKER
+	if(packet->frame){
+		if(pos < packet->head_length){
+			*len = packet->head_length - pos;
+			return &(packet->payload[pos]);
+		}else if(pos < packet->frame->length){
+			*len = packet->frame->length - pos;
+			return &(packet->frame->data[pos]);
+		}
+		*len = end - pos;
+		return &(packet->tail_data[pos - packet->frame->length]);
+	}
+#endif
+	*len = end - pos;
+	return &(packet->payload[pos]);
+}
+
+
+/* Write as much of one packet as the socket takes. */
+static ssize_t packet__write_spans(struct mosquitto *mosq, struct mosquitto__packet *packet)
+{
+	uint8_t *span;
+	uint32_t len;
+#if defined(WITH_BROKER) && !defined(WIN32)
+	struct iovec iov[3];
+	uint32_t pos, end;
+	int iovcnt = 0;
+
+	if(packet->frame
+#  ifdef WITH_TLS
+			&& !mosq->ssl
+#  endif
+			){
+
+		end = packet->pos + packet->to_process;
+		for(pos = packet->pos; pos < end && iovcnt < 3; pos += len){
+			iov[iovcnt].iov_base = packet__out_span(packet, pos, &len);
+			iov[iovcnt].iov_len = len;
+			iovcnt++;
+		}
+		return net__writev(mosq, iov, iovcnt);
+	}
+#endif
+	span = packet__out_span(packet, packet->pos, &len);
+	return net__write(mosq, span, len);
+}
+
+
+#if defined(WITH_BROKER) && !defined(WIN32)
+/* Write the current packet and as many of the queued ones as fit in the
+ * batch with a single writev(), then drop the packets that went out. */
+static ssize_t packet__write_batch(struct mosquitto *mosq)
+{
+	struct iovec iov[WRITE_BATCH_IOV];
+	struct mosquitto__packet *packet;
+	ssize_t write_length, remaining;
+	uint32_t pos, end, len;
+	int iovcnt = 0;
+	int bytes = 0;
+
+	/* A packet sharing a frame or payload takes up to three entries, the
+	 * last packet may not get them all. */
+	for(packet = mosq->current_out_packet; packet && iovcnt < WRITE_BATCH_IOV && bytes < mosq->write_batch;
+			packet = (packet == mosq->current_out_packet)?mosq->out_packet:packet->next){
+
+		end = packet->pos + packet->to_process;
+		for(pos = packet->pos; pos < end && iovcnt < WRITE_BATCH_IOV; pos += len){
+			iov[iovcnt].iov_base = packet__out_span(packet, pos, &len);
+			iov[iovcnt].iov_len = len;
+			iovcnt++;
+		}
+		bytes += pos - packet->pos;
+	}
+
+	write_length = net__writev(mosq, iov, iovcnt);
+	if(write_length <= 0){
+		return write_length;
+	}
+	G_BYTES_SENT_INC(write_length);
+
+	remaining = write_length;
+	while(remaining > 0 && mosq->current_out_packet){
+		packet = mosq->current_out_packet;
+		if(remaining < packet->to_process){
+			packet->to_process -= remaining;
+			packet->pos += remaining;
+			break;
+		}
+		remaining -= packet->to_process;
+
+		G_MSGS_SENT_INC(1);
+		if(((packet->command)&0xF6) == CMD_PUBLISH){
+			G_PUB_MSGS_SENT_INC(1);
+		}
+		mosq->current_out_packet = mosq->out_packet;
+		if(mosq->out_packet){
+			mosq->out_packet = mosq->out_packet->next;
+			if(!mosq->out_packet){
+				mosq->out_packet_last = NULL;
+			}
+		}
+		packet__cleanup(packet);
+		mosquitto__free(packet);
+	}
+	mosq->next_msg_out = mosquitto_time() + mosq->keepalive;
+
+	return write_length;
+}
+#endif
+
+
 int packet__write(struct mosquitto *mosq)
 {
 	ssize_t write_length;
 	struct mosquitto__packet *packet;
+	int rc;
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+#ifdef WITH_BROKER
+	mosq->write_batch_pending = 0;
+#endif
 
 	pthread_mutex_lock(&mosq->current_out_packet_mutex);
 	pthread_mutex_lock(&mosq->out_packet_mutex);
+#if defined(WITH_BROKER) && defined(WITH_BRIDGE) && defined(WITH_ZLIB)
+	if(mosq->compress_from){
+		bridge__compress_queue(mosq);
+	}
+#endif
 	if(mosq->out_packet && !mosq->current_out_packet){
 		mosq->current_out_packet = mosq->out_packet;
 		mosq->out_packet = mosq->out_packet->next;
@@ -287,28 +552,31 @@ int packet__write(struct mosquitto *mosq)
 	while(mosq->current_out_packet){
 		packet = mosq->current_out_packet;
 
+#if defined(WITH_BROKER) && !defined(WIN32)
+		if(mosq->write_batch && mosq->out_packet
+#  ifdef WITH_TLS
+				&& !mosq->ssl
+#  endif
+				){
+
+			if(packet__write_batch(mosq) <= 0){
+				rc = packet__write_error();
+				pthread_mutex_unlock(&mosq->current_out_packet_mutex);
+				return rc;
+			}
+			continue;
+		}
+#endif
 		while(packet->to_process > 0){
-			write_length = net__write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+			write_length = packet__write_spans(mosq, packet);
 			if(write_length > 0){
 				G_BYTES_SENT_INC(write_length);
 				packet->to_process -= write_length;
 				packet->pos += write_length;
 			}else{
-#ifdef WIN32
-				errno = WSAGetLastError();
-#endif
-				if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
-					pthread_mutex_unlock(&mosq->current_out_packet_mutex);
-					return MOSQ_ERR_SUCCESS;
-				}else{
-					pthread_mutex_unlock(&mosq->current_out_packet_mutex);
-					switch(errno){
-						case COMPAT_ECONNRESET:
-							return MOSQ_ERR_CONN_LOST;
-						default:
-							return MOSQ_ERR_ERRNO;
-					}
-				}
+				rc = packet__write_error();
+				pthread_mutex_unlock(&mosq->current_out_packet_mutex);
+				return rc;
 			}
 		}
 
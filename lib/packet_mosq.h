@@ -23,12 +23,17 @@ Contributors:
 struct mosquitto_db;
 #endif
 
-struct mosquitto__bpdu__packet *packet__write_bpdu(struct mosquitto__stp *stp);
-int set__payloadlen(struct mosquitto__packet *packet);
+int packet__bpdu_len(struct mosquitto__stp *stp, bool binary);
+void packet__write_bpdu(struct mosquitto__packet *packet, struct mosquitto__stp *stp, bool binary, bool stamped);
+int packet__read_bpdu(struct mosquitto__packet *packet, struct mosquitto__bpdu__packet *bpdu);
 
 int packet__alloc(struct mosquitto__packet *packet);
 void packet__cleanup(struct mosquitto__packet *packet);
 int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet);
+#ifdef WITH_BROKER
+struct mosquitto__frame *packet__frame_adopt(struct mosquitto__packet *packet);
+void packet__frame_deref(struct mosquitto__frame **frame);
+#endif
 
 int packet__check_oversize(struct mosquitto *mosq, uint32_t remaining_length);
 
@@ -38,6 +43,7 @@ int packet__read_binary(struct mosquitto__packet *packet, uint8_t **data, int *l
 int packet__read_string(struct mosquitto__packet *packet, char **str, int *length);
 int packet__read_uint16(struct mosquitto__packet *packet, uint16_t *word);
 int packet__read_uint32(struct mosquitto__packet *packet, uint32_t *word);
+int packet__read_uint64(struct mosquitto__packet *packet, uint64_t *word);
 int packet__read_varint(struct mosquitto__packet *packet, int32_t *word, int8_t *bytes);
 
 void packet__write_byte(struct mosquitto__packet *packet, uint8_t byte);
@@ -45,6 +51,7 @@ void packet__write_bytes(struct mosquitto__packet *packet, const void *bytes, ui
 void packet__write_string(struct mosquitto__packet *packet, const char *str, uint16_t length);
 void packet__write_uint16(struct mosquitto__packet *packet, uint16_t word);
 void packet__write_uint32(struct mosquitto__packet *packet, uint32_t word);
+void packet__write_uint64(struct mosquitto__packet *packet, uint64_t word);
 int packet__write_varint(struct mosquitto__packet *packet, int32_t word);
 
 int packet__varint_bytes(int32_t word);
@@ -52,7 +52,8 @@ int send__connect(struct mosquitto__stp *stp, struct mosquitto *mosq, uint16_t k
 #if defined(WITH_BROKER) && defined(WITH_BRIDGE)
 	if(mosq->bridge){
 		//add my msg
-		clientid = mosq->bridge->remote_clientid;
+		/* The extra links of a bundle connect with their own id. */
+		clientid = mosq->bridge_main?mosq->id:mosq->bridge->remote_clientid;
 		username = mosq->bridge->remote_username;
 		password = mosq->bridge->remote_password;
 	}else{
@@ -115,11 +116,8 @@ int send__connect(struct mosquitto__stp *stp, struct mosquitto *mosq, uint16_t k
 	}
     
     if(stp){
-        packet->bpdu = packet__write_bpdu(stp);
-        if(!packet->bpdu) return MOSQ_ERR_NOMEM;
-        
-        /* Add to the current length the fields of the STP */
-        payloadlen += set__payloadlen(packet);
+        /* The peer hasn't told us yet whether it accepts binary BPDUs. */
+        payloadlen += packet__bpdu_len(stp, false);
     }
 
 
@@ -209,48 +207,7 @@ int send__connect(struct mosquitto__stp *stp, struct mosquitto *mosq, uint16_t k
 
     /* Pimped payload */
     if(stp){
-        /* Source */
-        if(packet->bpdu->origin_address){
-            packet__write_string(packet, packet->bpdu->origin_address, strlen(packet->bpdu->origin_address));
-        }else{
-            packet__write_uint16(packet, 0);
-        }
-        if(packet->bpdu->origin_port){
-            packet__write_string(packet, packet->bpdu->origin_port, strlen(packet->bpdu->origin_port));
-        }else{
-            packet__write_uint16(packet, 0);
-        }
-        
-        /* Root */
-        if(packet->bpdu->root_address){
-            packet__write_string(packet, packet->bpdu->root_address, strlen(packet->bpdu->root_address));
-        }else{
-            packet__write_uint16(packet, 0);
-        }
-        if(packet->bpdu->root_port){
-            packet__write_string(packet, packet->bpdu->root_port, strlen(packet->bpdu->root_port));
-        }else{
-            packet__write_uint16(packet, 0);
-        }
-        
-        /* Distance */
-        if(packet->bpdu->distance){
-            packet__write_string(packet, packet->bpdu->distance, strlen(packet->bpdu->distance));
-        }else{
-            packet__write_uint16(packet, 100);
-        }
-        
-        /* Resources */
-        if(packet->bpdu->origin_pid){
-            packet__write_string(packet, packet->bpdu->origin_pid, strlen(packet->bpdu->origin_pid));
-        }else{
-            packet__write_uint16(packet, 0);
-        }
-        if(packet->bpdu->root_pid){
-            packet__write_string(packet, packet->bpdu->root_pid, strlen(packet->bpdu->root_pid));
-        }else{
-            packet__write_uint16(packet, 0);
-        }
+        packet__write_bpdu(packet, stp, false, false);
     }
 
 	mosq->keepalive = keepalive;
@@ -63,6 +63,7 @@ int send__pingreq(struct mosquitto *mosq)
     
     if(!send_simple){
         log__printf(NULL, MOSQ_LOG_NOTICE, "Sending PINGREQ COMP to %s", mosq->id);
+        stp__resources_update(db);
         rc = send__pingreqcomp(db->stp, mosq, CMD_PINGREQ);
     }else{
         log__printf(NULL, MOSQ_LOG_NOTICE, "Sending PINGREQ SIMPLE to %s", mosq->id);
@@ -74,6 +75,13 @@ int send__pingreq(struct mosquitto *mosq)
 #endif
 	if(rc == MOSQ_ERR_SUCCESS){
 		mosq->ping_t = mosquitto_time();
+#ifdef WITH_BROKER
+		if(mosq->bridge && !mosq->bridge_main){
+			mosq->bridge->ping_sent_ms = mosquitto_time_ms();
+			mosq->bridge->bpdu_sent_ms = mosq->bridge->ping_sent_ms;
+			mosq->bridge->bpdu_pending = false;
+		}
+#endif
 	}
 	return rc;
 }
@@ -223,6 +231,7 @@ int send__pingreqcomp(struct mosquitto__stp *stp, struct mosquitto *mosq, uint8_
     int rc;
     uint8_t byte;
     uint8_t version;
+    bool binary;
     
     mosquitto_property *local_props = NULL;
     uint16_t receive_maximum;
@@ -259,11 +268,11 @@ int send__pingreqcomp(struct mosquitto__stp *stp, struct mosquitto *mosq, uint8_
     packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
     if(!packet) return MOSQ_ERR_NOMEM;
     
-    packet->bpdu = packet__write_bpdu(stp);
-    if(!packet->bpdu) return MOSQ_ERR_NOMEM;
-    
+    /* Binary BPDUs only once the peer has accepted them in its CONNACK. */
+    binary = mosq->bridge && mosq->bridge->bpdu_binary;
+
     /* Set payload length */
-    payloadlen = set__payloadlen(packet);
+    payloadlen = packet__bpdu_len(stp, binary);
     //log__printf(NULL, MOSQ_LOG_DEBUG, "PINGREQCOMP payload length: %d", payloadlen);
     
     packet->command = command;
@@ -298,49 +307,7 @@ int send__pingreqcomp(struct mosquitto__stp *stp, struct mosquitto *mosq, uint8_
     }
     
     /* Payload */
-    /* Source */
-    if(packet->bpdu->origin_address){
-        packet__write_string(packet, packet->bpdu->origin_address, strlen(packet->bpdu->origin_address));
-    }else{
-        packet__write_uint16(packet, 0);
-    }
-    if(packet->bpdu->origin_port){
-        packet__write_string(packet, packet->bpdu->origin_port, strlen(packet->bpdu->origin_port));
-    }else{
-        packet__write_uint16(packet, 0);
-    }
-
-    /* Root */
-    if(packet->bpdu->root_address){
-        packet__write_string(packet, packet->bpdu->root_address, strlen(packet->bpdu->root_address));
-    }else{
-        packet__write_uint16(packet, 0);
-    }
-    if(packet->bpdu->root_port){
-        packet__write_string(packet, packet->bpdu->root_port, strlen(packet->bpdu->root_port));
-    }else{
-        packet__write_uint16(packet, 0);
-    }
-
-    /* Distance */
-    if(packet->bpdu->distance){
-        packet__write_string(packet, packet->bpdu->distance, strlen(packet->bpdu->distance));
-    }else{
-        packet__write_uint16(packet, 100);
-        //TODO fix root distance lower limit
-    }
-
-    /* Resources */
-    if(packet->bpdu->origin_pid){
-        packet__write_string(packet, packet->bpdu->origin_pid, strlen(packet->bpdu->origin_pid));
-    }else{
-        packet__write_uint16(packet, 0);
-    }
-    if(packet->bpdu->root_pid){
-        packet__write_string(packet, packet->bpdu->root_pid, strlen(packet->bpdu->root_pid));
-    }else{
-        packet__write_uint16(packet, 0);
-    }
+    packet__write_bpdu(packet, stp, binary, mosq->bridge && mosq->bridge->publish_stamp);
     
     return packet__queue(mosq, packet);
 }
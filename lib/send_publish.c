@@ -39,7 +39,7 @@ Contributors:
 #include "util_list.h"
 
 #ifdef WITH_BROKER
-int send__publish(struct mosquitto_db *db, struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval, char *source_id)
+int send__publish(struct mosquitto_db *db, struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval, char *source_id, const struct mosquitto__stp_stamp *stamp)
 {
 #else
 int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval, char *source_id)
@@ -48,26 +48,24 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
 #ifdef WITH_BROKER
 	size_t len;
 #ifdef WITH_BRIDGE
-	int i;
-	struct mosquitto__bridge_topic *cur_topic;
-	bool match;
 	int rc;
 	char *mapped_topic = NULL;
-	char *topic_temp = NULL;
-    int address_port = 0;
     int src_id = 0;
-    BROKER broker;
-    
-    
-    if(strlen(source_id)>5){
-        char *last = &source_id[strlen(source_id)- 5];
-        strcpy(source_id, last);
-        log__printf(NULL, MOSQ_LOG_DEBUG, "Last: %s", last);
+    char src_port[5];
+    size_t src_len;
+
+    /* The sender's listener port is the first four characters of the last
+     * five of its client id (e.g. "1884a"). Read it without modifying the
+     * stored source id, which is shared by every subscriber of the message. */
+    if(source_id){
+        src_len = strlen(source_id);
+        if(src_len > 5){
+            source_id += src_len - 5;
+        }
+        strncpy(src_port, source_id, 4);
+        src_port[4] = '\0';
+        src_id = (int) strtol(src_port, (char **)NULL, 10);
     }
-        //= (int) strtol(source_id, (char **)NULL, 10);
-    source_id[4] = '\0';
-    src_id = (int) strtol(source_id, (char **)NULL, 10);
-    
 #endif
 #endif
 	assert(mosq);
@@ -89,125 +87,195 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
 		}
 	}
 #ifdef WITH_BRIDGE
-    /* Check whether a custom message is present or not */
-    /*
-     if(mosq->bridge){
-        if(mosq->bridge->port_state == 1){
-            log__printf(NULL, MOSQ_LOG_DEBUG, "[FORWARD] no msg to be sent");
-            return MOSQ_ERR_SUCCESS; //send a fake success
-        }else{
-            log__printf(NULL, MOSQ_LOG_DEBUG, "[FORWARD] pub the message correctly");
+    if(mosq->bridge){
+        /* Never send a message back towards the broker it came from, and
+         * only forward on ports the spanning tree has put in forwarding state. */
+        if(mosq->bridge->cur_address < mosq->bridge->address_count
+                && mosq->bridge->addresses[mosq->bridge->cur_address].port == src_id){
+            return MOSQ_DROPPING_BRIDGE;
+        }
+        if(!stp__port_forwarding(mosq->bridge)){
+            mosq->bridge->stats.msgs_blocked++;
+            return MOSQ_DROPPING_BRIDGE;
         }
     }
-    */
-    
-	if(mosq->bridge && mosq->bridge->topics && mosq->bridge->topic_remapping){
-        for(i=0; i<mosq->bridge->topic_count; i++){
-			cur_topic = &mosq->bridge->topics[i];
-			if((cur_topic->direction == bd_both || cur_topic->direction == bd_out)
-					&& (cur_topic->remote_prefix || cur_topic->local_prefix)){
-				/* Topic mapping required on this topic if the message matches */
-
-				rc = mosquitto_topic_matches_sub(cur_topic->local_topic, topic, &match);
-				if(rc){
-					return rc;
-				}
-				if(match){
-					mapped_topic = mosquitto__strdup(topic);
-					if(!mapped_topic) return MOSQ_ERR_NOMEM;
-					if(cur_topic->local_prefix){
-						/* This prefix needs removing. */
-						if(!strncmp(cur_topic->local_prefix, mapped_topic, strlen(cur_topic->local_prefix))){
-							topic_temp = mosquitto__strdup(mapped_topic+strlen(cur_topic->local_prefix));
-							mosquitto__free(mapped_topic);
-							if(!topic_temp){
-								return MOSQ_ERR_NOMEM;
-							}
-							mapped_topic = topic_temp;
-						}
-					}
-
-					if(cur_topic->remote_prefix){
-						/* This prefix needs adding. */
-						len = strlen(mapped_topic) + strlen(cur_topic->remote_prefix)+1;
-						topic_temp = mosquitto__malloc(len+1);
-						if(!topic_temp){
-							mosquitto__free(mapped_topic);
-							return MOSQ_ERR_NOMEM;
-						}
-						snprintf(topic_temp, len, "%s%s", cur_topic->remote_prefix, mapped_topic);
-						topic_temp[len] = '\0';
-						mosquitto__free(mapped_topic);
-						mapped_topic = topic_temp;
-					}
-					log__printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH number 1 to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, mapped_topic, (long)payloadlen);
-					G_PUB_BYTES_SENT_INC(payloadlen);
-					rc =  send__real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval);
-					mosquitto__free(mapped_topic);
-					return rc;
-				}
-			}
+
+	if(mosq->bridge && mosq->bridge->topic_remapping){
+		rc = bridge__remap_topic(mosq->bridge, bd_out, topic, &mapped_topic);
+		if(rc) return rc;
+		if(mapped_topic){
+			log__printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH number 1 to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, mapped_topic, (long)payloadlen);
+			G_PUB_BYTES_SENT_INC(payloadlen);
+			rc =  send__real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval, stamp);
+			mosquitto__free(mapped_topic);
+			if(!rc) mosq->bridge->stats.msgs_forwarded++;
+			return rc;
 		}
 	}
     
-    //checking ports state
-    if(mosq->bridge){
-        if(mosq->bridge->addresses){
-            broker.address = mosq->bridge->addresses->address;
-            broker.port = mosq->bridge->addresses->port;
-            
-            if(broker.port == src_id){
-                //log__printf(NULL, MOSQ_LOG_INFO, "[BRIDGE] fwd_port(%d) == src_id (%d) --> DON'T forward packets", broker.port, src_id);
-                return MOSQ_ERR_SUCCESS;
-            }
-            else{
-                //log__printf(NULL, MOSQ_LOG_INFO, "[BRIDGE] fwd_port(%d) != src_id (%d) --> PUBLISH allowed", broker.port, src_id);
-            }
-            
-            print_list(db->blocked_ports, "BLOCK from send");
-            print_list(db->designated_ports, "DES from send");
-            log__printf(NULL, MOSQ_LOG_INFO, "ROOT PORT %s:%d", db->king_port.address, db->king_port.port);
-            log__printf(NULL, MOSQ_LOG_INFO, "--> %s", print_all_lists(db->designated_ports, db->blocked_ports, db->king_port));
-            //print_list(db->config->bridges->root_ports, "ROOT from send");
-
-            if(in_list(db->blocked_ports, broker)){
-                log__printf(NULL, MOSQ_LOG_INFO, "[BRIDGE] port (%d) is blocked", broker.port);
-                return MOSQ_ERR_SUCCESS;
-            }else{
-                log__printf(NULL, MOSQ_LOG_INFO, "not blocked");
-                }
-            if(in_list(db->designated_ports, broker) || (strcmp(broker.address, db->king_port.address) == 0 && broker.port == db->king_port.port)){
-                log__printf(NULL, MOSQ_LOG_INFO, "Forward to %d", broker.port);
-            }else{
-                log__printf(NULL, MOSQ_LOG_INFO, "Why here?");
-            }
-        }
-        else{
-            log__printf(NULL, MOSQ_LOG_DEBUG, "NO ADDRESS PORT ERROR %d", broker.port);
-            return MOSQ_ERR_SUCCESS;
-        }
-    }
 #endif
     log__printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH number 2 to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
     
    	G_PUB_BYTES_SENT_INC(payloadlen);
+#ifdef WITH_BRIDGE
+	rc = send__real_publish(mosq, mid, topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval, stamp);
+	if(!rc && mosq->bridge) mosq->bridge->stats.msgs_forwarded++;
+	return rc;
+#else
+	return send__real_publish(mosq, mid, topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval, stamp);
+#endif
 #else
 	log__printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBLISH (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
+
+	return send__real_publish(mosq, mid, topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval, NULL);
+#endif
+}
+
+
+#ifdef WITH_BROKER
+/* Encode a stored message as one PUBLISH variant, with a zero packet
+ * identifier for packets that have one to patch in. If the store kept the
+ * buffer its payload was received in, the payload is left out and sent
+ * from there. */
+static struct mosquitto__frame *send__frame_encode(const struct mosquitto_msg_store *store, int qos, bool retain, bool mqtt5, uint8_t variant)
+{
+	struct mosquitto__frame *frame;
+	struct mosquitto__packet packet;
+	uint32_t remaining_length, length;
+	int proplen = 0;
+
+	remaining_length = 2 + strlen(store->topic) + store->payloadlen;
+	if(qos > 0) remaining_length += 2;
+	if(mqtt5){
+		proplen = property__get_length_all(store->properties);
+		remaining_length += proplen + packet__varint_bytes(proplen);
+	}
+	if(remaining_length > MQTT_MAX_PAYLOAD) return NULL;
+
+	length = 1 + packet__varint_bytes(remaining_length) + remaining_length;
+	if(store->payload_frame){
+		length -= store->payloadlen;
+	}
+	frame = mosquitto__malloc(sizeof(struct mosquitto__frame) + length);
+	if(!frame) return NULL;
+	frame->next = NULL;
+	frame->data = (uint8_t *)&frame[1];
+	frame->length = length;
+	frame->remaining_length = remaining_length;
+	frame->ref_count = 1;
+	frame->variant = variant;
+
+	memset(&packet, 0, sizeof(packet));
+	packet.payload = frame->data;
+	packet.packet_length = frame->length;
+	packet__write_byte(&packet, CMD_PUBLISH | (qos<<1) | retain);
+	packet__write_varint(&packet, remaining_length);
+	packet__write_string(&packet, store->topic, strlen(store->topic));
+	if(qos > 0){
+		packet__write_uint16(&packet, 0);
+		frame->head_length = packet.pos;
+	}else{
+		frame->head_length = 0;
+	}
+	if(mqtt5){
+		packet__write_varint(&packet, proplen);
+		property__write_all(&packet, store->properties, false);
+	}
+	if(store->payloadlen && !store->payload_frame){
+		packet__write_bytes(&packet, UHPA_ACCESS_PAYLOAD(store), store->payloadlen);
+	}
+
+	return frame;
+}
+
+
+/* Send a stored message to a client. Where nothing about the PUBLISH is
+ * particular to the client, its bytes are encoded once for every client of
+ * the same qos, retain and protocol that it goes to and shared between
+ * their packets. Only the packet identifier and dup flag are theirs. */
+int send__publish_store(struct mosquitto_db *db, struct mosquitto *mosq, struct mosquitto_msg_store *store, uint16_t mid, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, uint32_t expiry_interval)
+{
+	struct mosquitto__packet *packet;
+	struct mosquitto__frame *frame;
+	bool mqtt5 = (mosq->protocol == mosq_p_mqtt5);
+	uint8_t variant;
+
+	if(mosq->bridge || cmsg_props || expiry_interval || !store->topic
+			|| (mosq->listener && mosq->listener->mount_point)
+#ifdef WITH_WEBSOCKETS
+			|| mosq->wsi
 #endif
+			){
 
-	return send__real_publish(mosq, mid, topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval);
+		return send__publish(db, mosq, mid, store->topic, store->payloadlen, UHPA_ACCESS_PAYLOAD(store), qos, retain, dup, cmsg_props, store->properties, expiry_interval, store->source_id, &store->stamp);
+	}
+	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+
+	variant = qos | (retain<<2) | (mqtt5<<3);
+	for(frame = store->frames; frame; frame = frame->next){
+		if(frame->variant == variant) break;
+	}
+	if(!frame){
+		frame = send__frame_encode(store, qos, retain, mqtt5, variant);
+		if(!frame){
+			return send__publish(db, mosq, mid, store->topic, store->payloadlen, UHPA_ACCESS_PAYLOAD(store), qos, retain, dup, cmsg_props, store->properties, expiry_interval, store->source_id, &store->stamp);
+		}
+		db__msg_store_frame_add(db, store, frame);
+	}
+
+	if(packet__check_oversize(mosq, frame->remaining_length)){
+		log__printf(NULL, MOSQ_LOG_NOTICE, "Dropping too large outgoing PUBLISH for %s (%d bytes)", mosq->id, frame->remaining_length);
+		return MOSQ_ERR_OVERSIZE_PACKET;
+	}
+	log__printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, store->topic, (long)store->payloadlen);
+	G_PUB_BYTES_SENT_INC(store->payloadlen);
+
+	packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+	if(!packet) return MOSQ_ERR_NOMEM;
+
+	packet->mid = mid;
+	packet->command = frame->data[0] | ((dup&0x1)<<3);
+	packet->remaining_length = frame->remaining_length;
+	packet->packet_length = 1 + packet__varint_bytes(frame->remaining_length) + frame->remaining_length;
+	if(frame->head_length){
+		packet->payload = mosquitto__malloc(frame->head_length);
+		if(!packet->payload){
+			mosquitto__free(packet);
+			return MOSQ_ERR_NOMEM;
+		}
+		memcpy(packet->payload, frame->data, frame->head_length);
+		packet->payload[0] = packet->command;
+		packet->payload[frame->head_length-2] = MOSQ_MSB(mid);
+		packet->payload[frame->head_length-1] = MOSQ_LSB(mid);
+	}
+	packet->head_length = frame->head_length;
+	packet->frame = frame;
+	frame->ref_count++;
+	if(store->payload_frame){
+		packet->tail = store->payload_frame;
+		packet->tail_data = (uint8_t *)UHPA_ACCESS_PAYLOAD(store);
+		packet->tail->ref_count++;
+	}
+
+	return packet__queue(mosq, packet);
 }
+#endif
 
 
-int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
+int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval, const struct mosquitto__stp_stamp *stamp)
 {
 	struct mosquitto__packet *packet = NULL;
 	int packetlen;
 	int proplen = 0, varbytes;
 	int rc;
 	mosquitto_property expiry_prop;
+	bool stamped = false;
 
 	assert(mosq);
+#if defined(WITH_BROKER) && defined(WITH_BRIDGE)
+	/* Once agreed, every PUBLISH on the bridge has a stamp, even if empty. */
+	stamped = mosq->bridge && mosq->bridge->publish_stamp;
+#endif
 
 	if(topic){
 		packetlen = 2+strlen(topic) + payloadlen;
@@ -215,6 +283,7 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 		packetlen = 2 + payloadlen;
 	}
 	if(qos > 0) packetlen += 2; /* For message id */
+	if(stamped) packetlen += STP_STAMP_LEN;
 	if(mosq->protocol == mosq_p_mqtt5){
 		proplen = 0;
 		proplen += property__get_length_all(cmsg_props);
@@ -277,6 +346,11 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 		}
 	}
 
+	if(stamped){
+		packet__write_uint64(packet, stamp ? stamp->origin : 0);
+		packet__write_uint64(packet, stamp ? stamp->seq : 0);
+	}
+
 	/* Payload */
 	if(payloadlen){
 		packet__write_bytes(packet, payload, payloadlen);
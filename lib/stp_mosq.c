@@ -14,50 +14,53 @@
 #include "packet_mosq.h"
 
 
-struct mosquitto__stp* stp__init(struct mosquitto__stp *stp, char* hostname, int port, int pid)
+struct mosquitto__stp* stp__init(struct mosquitto__stp *stp, char* hostname, int port, int pid, int priority)
 {
     if(stp){
         stp->distance = 0;
         stp->my->address = hostname;
         stp->my->port = port;
         stp->my->res->pid = pid;
+        stp->my->res->priority = priority;
         
         stp->my_root->address = hostname;
         stp->my_root->port = port;
         stp->my_root->res->pid = pid;
+        stp->my_root->res->priority = priority;
         return stp;
     }
     return stp;
 }
 
+int stp__bridge_id(struct broker__resources *res)
+{
+    return (res->priority << STP_PID_BITS) | (res->pid & STP_PID_MASK);
+}
+
 void print_stp(struct mosquitto__stp *stp)
 {
-    log__printf(NULL, MOSQ_LOG_NOTICE, "d%d r(%d-%d) o(%d-%d)", stp->distance, stp->my_root->port, stp->my_root->res->pid, stp->my->port, stp->my->res->pid);
+    log__printf(NULL, MOSQ_LOG_NOTICE, "d%d r(%d-%d/%d) o(%d-%d/%d)", stp->distance, stp->my_root->port, stp->my_root->res->pid, stp->my_root->res->priority, stp->my->port, stp->my->res->pid, stp->my->res->priority);
 }
 
 int update_bpdu(struct mosquitto__bpdu__packet *stored_bpdu, struct mosquitto__bpdu__packet *packet)
 {
     if(stored_bpdu && packet){
-        stored_bpdu->root_pid = packet->root_pid;
-        stored_bpdu->root_address = packet->root_address;
-        stored_bpdu->root_port = packet->root_port;
-        stored_bpdu->distance = packet->distance;
-        stored_bpdu->origin_pid = packet->origin_pid;
-        stored_bpdu->origin_address = packet->origin_address;
-        stored_bpdu->origin_port = packet->origin_port;
-                
+        *stored_bpdu = *packet;
         return 1;
     }
     return 0;
 }
 
-int update_stp(struct mosquitto__stp *stp, struct mosquitto__bpdu__packet *packet)
+int update_stp(struct mosquitto__stp *stp, struct mosquitto__bpdu__packet *packet, int path_cost)
 {
     if(stp && packet){
-        stp->distance = strint(packet->distance) +1;
-        stp->my_root->address = packet->root_address;
-        stp->my_root->port = strint(packet->root_port);
-        stp->my_root->res->pid = strint(packet->root_pid);
+        stp->distance = packet->distance + path_cost;
+        /* Keep our own copy, the packet doesn't outlive this call. */
+        snprintf(stp->root_address, sizeof(stp->root_address), "%s", packet->root_address);
+        stp->my_root->address = stp->root_address;
+        stp->my_root->port = packet->root_port;
+        stp->my_root->res->pid = packet->root_id & STP_PID_MASK;
+        stp->my_root->res->priority = packet->root_id >> STP_PID_BITS;
         
         return 1;
     }
@@ -69,7 +72,7 @@ void superior_update(struct mosquitto__bpdu__packet *stored_bpdu, struct mosquit
     log__printf(NULL, MOSQ_LOG_DEBUG, "Superior information, UPDATE");
     //update_bpdu(stored_bpdu, packet);
     
-    update_stp(stp, packet);
+    update_stp(stp, packet, STP_PATH_COST_DEFAULT);
 }
 
 char *create_full_hostname(char *address, int port)
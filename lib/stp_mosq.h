@@ -15,7 +15,8 @@
 #endif
 
 
-struct mosquitto__stp* stp__init(struct mosquitto__stp *stp, char* hostname, int port, int pid);
+struct mosquitto__stp* stp__init(struct mosquitto__stp *stp, char* hostname, int port, int pid, int priority);
+int stp__bridge_id(struct broker__resources *res);
 void print_stp(struct mosquitto__stp *stp);
 
 void superior_update(struct mosquitto__bpdu__packet *stored_bpdu, struct mosquitto__bpdu__packet *packet, struct mosquitto__stp *stp);
@@ -23,6 +24,6 @@ int update_bpdu(struct mosquitto__bpdu__packet *stored_bpdu, struct mosquitto__b
 #ifdef WITH_BROKER
 void check_old_info(struct mosquitto__stp *stp, struct mosquitto__bpdu__packet *packet,  struct mosquitto_db *db, int bridge);
 #endif
-int update_stp(struct mosquitto__stp *stp, struct mosquitto__bpdu__packet *packet);
+int update_stp(struct mosquitto__stp *stp, struct mosquitto__bpdu__packet *packet, int path_cost);
 char *create_full_hostname(char *address, int port);
 #endif
@@ -27,6 +27,7 @@ Contributors:
 #else
 #  include <unistd.h>
 #endif
+#include <stdint.h>
 #include <time.h>
 
 #include "mosquitto.h"
@@ -59,3 +60,27 @@ time_t mosquitto_time(void)
 #endif
 }
 
+/* Monotonic time in milliseconds, for measuring short intervals. */
+uint64_t mosquitto_time_ms(void)
+{
+#ifdef WIN32
+	return GetTickCount64();
+#elif _POSIX_TIMERS>0 && defined(_POSIX_MONOTONIC_CLOCK)
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec*1000 + tp.tv_nsec/1000000;
+#elif defined(__APPLE__)
+	static mach_timebase_info_data_t tb;
+	uint64_t ticks;
+
+	ticks = mach_absolute_time();
+
+	if(tb.denom == 0){
+		mach_timebase_info(&tb);
+	}
+	return ticks*tb.numer/tb.denom/1000000;
+#else
+	return (uint64_t)time(NULL)*1000;
+#endif
+}
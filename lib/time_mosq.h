@@ -17,6 +17,10 @@ Contributors:
 #ifndef TIME_MOSQ_H
 #define TIME_MOSQ_H
 
+#include <stdint.h>
+#include <time.h>
+
 time_t mosquitto_time(void);
+uint64_t mosquitto_time_ms(void);
 
 #endif
@@ -11,6 +11,7 @@
 #include <string.h>
 #include "mosquitto_internal.h"
 #include "mosquitto.h"
+#include "memory_mosq.h"
 #include "util_mosq.h"
 #include "logging_mosq.h"
 #include "util_string.h"
@@ -22,174 +23,98 @@
 
 
 #ifdef WITH_BROKER
-int init_list(PORT_LIST** head, char *type)
+/* Numeric id of a broker: FNV-1a of its address, with the listener port in
+ * the low bits. */
+uint64_t stp__port_id(const char *address, int port)
 {
-    *head = NULL;
-    return MOSQ_ERR_SUCCESS;
-}
+    uint64_t hash = 14695981039346656037ULL;
 
-void print_list(PORT_LIST* head, char *type)
-{
-    PORT_LIST * temp;
-    fprintf(stdout, "List %s:", type);
-    for (temp = head; temp; temp = temp->next){
-        fprintf(stdout, " %s:%d,", temp->broker.address, temp->broker.port);
+    while(*address){
+        hash ^= (uint8_t)*address++;
+        hash *= 1099511628211ULL;
     }
-    fprintf(stdout, "\n");
+    return (hash << 16) | (uint16_t)port;
 }
 
-void init_buf(char *buf, size_t size){
-    int i;
-    for(i=0; i<size; i++){
-        buf[i] = i + '0';
-    }
-}
-char *print_all_lists(PORT_LIST* designated, PORT_LIST* blocked, BROKER root)
+/* Every bridge is a port, indexed by the id of the broker at its far end.
+ * The role of the port lives in bridge->port_status, so moving a port
+ * between roles is a field write rather than a list operation. */
+int stp__ports_add(struct mosquitto_db *db, struct mosquitto__bridge *bridge)
 {
-    int BUFSIZE = 2000;
-    char *buf;
-    buf = (char *) malloc(sizeof(char) * BUFSIZE);
-    //init_buf(buf, BUFSIZE);
-    
-    PORT_LIST * temp_d;
-    PORT_LIST * temp_b;
-
-
-    for (temp_d = designated; temp_d; temp_d = temp_d->next){
-        sprintf(buf+ strlen(buf), " %s:%d,", temp_d->broker.address, temp_d->broker.port);
-    }
-    sprintf(buf+ strlen(buf),  " - ");
-    
-    for (temp_b = blocked; temp_b; temp_b = temp_b->next){
-        sprintf(buf+ strlen(buf), " %s:%d,", temp_b->broker.address, temp_b->broker.port);
-    }
-    sprintf(buf+strlen(buf), " - ");
-    sprintf(buf+ strlen(buf), " %s:%d", root.address, root.port);
-
-    return buf;
-}
-
-PORT_LIST* add(PORT_LIST* node, BROKER brk)
-{
-    PORT_LIST* temp = (PORT_LIST*) malloc(sizeof (PORT_LIST));
-    if (temp == NULL) {
-        exit(EXIT_FAILURE);
-        //return MOSQ_ERR_NOMEM; // no memory available
-    }
-    temp->broker = brk;
-    temp->next = node;
-    node = temp;
-    return node;
-}
+    struct mosquitto__bridge *found;
 
-bool in_list(PORT_LIST* head, BROKER brk)
-{
-    PORT_LIST* current = head;
-    while(current!= NULL){
-        if(current->broker.port == brk.port){
-        //if(strcmp(current->broker.address, brk.address) == 0 && current->broker.port == brk.port){
-            return true;
+    bridge->stp_id = stp__port_id(bridge->addresses->address, bridge->addresses->port);
+    HASH_FIND(hh_stp, db->stp_ports, &bridge->stp_id, sizeof(bridge->stp_id), found);
+    if(found){
+        if(found != bridge){
+            log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridges %s and %s connect to the same broker.", found->name, bridge->name);
         }
-        current = current->next;
+        return MOSQ_ERR_SUCCESS;
     }
-    return false;
+    HASH_ADD(hh_stp, db->stp_ports, stp_id, sizeof(bridge->stp_id), bridge);
+    db->stp_generation++;
+    return MOSQ_ERR_SUCCESS;
 }
 
-PORT_LIST* delete_node(PORT_LIST* head, BROKER brk)
+struct mosquitto__bridge *stp__ports_find(struct mosquitto_db *db, const char *address, int port)
 {
-    PORT_LIST* temp, *prev;
-    temp = head;
-    if(temp != NULL){
-        if(strcmp(temp->broker.address, brk.address) == 0 && temp->broker.port == brk.port){
-            head = temp->next;
-            free(temp);
-            log__printf(NULL, MOSQ_LOG_DEBUG, "Broker %s:%d, deleted!", brk.address, brk.port);
-            return head;
-        }
-    }
-    
-    while(temp!=NULL){
-        if(temp->broker.port == brk.port && strcmp(temp->broker.address, brk.address) == 0){
-            break;
-        }
-        prev = temp;
-        temp = temp->next;
-    }
-    
-    if(temp == NULL) return head;
+    struct mosquitto__bridge *bridge;
+    uint64_t id;
 
-    prev->next = temp->next;
-    free(temp);
-    return head;
+    id = stp__port_id(address, port);
+    HASH_FIND(hh_stp, db->stp_ports, &id, sizeof(id), bridge);
+    return bridge;
 }
 
-PORT_LIST* empty_list(PORT_LIST *head)
+void stp__ports_cleanup(struct mosquitto_db *db)
 {
-    PORT_LIST* current = head;
-    PORT_LIST* next;
-    
-    while(current!=NULL){
-        next = current->next;
-        free(current);
-        current = next;
-    }
-    head = NULL;
-    return head;
+    HASH_CLEAR(hh_stp, db->stp_ports);
 }
 
-PORT_LIST* remove_from_blocked(PORT_LIST *head, BROKER broker)
+/* Any change of role bumps the generation, so convergence is detected by
+ * comparing one counter instead of copies of the port lists. */
+void stp__port_status_set(struct mosquitto_db *db, struct mosquitto__bridge *bridge, int status)
 {
-    if(in_list(head, broker)){
-        head = delete_node(head, broker);
+    if(bridge->port_status != status){
+        bridge->port_status = status;
+        bridge->stats.role_changes++;
+        db->stp_generation++;
     }
-    
-    return head;
 }
 
-PORT_LIST* find_and_delete(PORT_LIST *head, BROKER broker)
+void stp__king_port_set(struct mosquitto_db *db, BROKER broker)
 {
-    if(in_list(head, broker)){
-        head = delete_node(head, broker);
+    if(db->king_port.port != broker.port || strcmp(db->king_port.address, broker.address) != 0){
+        db->king_port = broker;
+        db->stp_generation++;
     }
-    return head;
 }
 
-PORT_LIST* copy_list(PORT_LIST *start1)
+/* Log the ports as "designated - blocked - root". */
+void stp__ports_log(struct mosquitto_db *db)
 {
-    PORT_LIST* start2=NULL, *previous=NULL;
-    
-    while(start1!=NULL)
-    {
-        PORT_LIST* temp = (PORT_LIST*) malloc(sizeof (PORT_LIST));
-        temp->broker=start1->broker;
-        temp->next=NULL;
-        
-        if(start2==NULL)
-        {
-            start2=temp;
-            previous=temp;
+    struct mosquitto__bridge *bridge, *bridge_tmp;
+    char buf[1024];
+    size_t len = sizeof(buf);
+    size_t pos = 0;
+    int status[2] = {DESIGNATED_PORT, BLOCKED_PORT};
+    int i;
+
+    buf[0] = '\0';
+    for(i=0; i<2; i++){
+        HASH_ITER(hh_stp, db->stp_ports, bridge, bridge_tmp){
+            if(bridge->port_status == status[i] && pos < len){
+                pos += snprintf(&buf[pos], len-pos, " %s:%d,", bridge->addresses->address, bridge->addresses->port);
+            }
         }
-        else
-        {
-            previous->next=temp;
-            previous=temp;
+        if(pos < len){
+            pos += snprintf(&buf[pos], len-pos, " - ");
         }
-        start1=start1->next;
     }
-    return start2;
-}
-
-bool are_identical(PORT_LIST *a, PORT_LIST *b)
-{
-    while (a != NULL && b != NULL){
-        if (a->broker.port != b->broker.port && strcmp(a->broker.address, b->broker.address)!=0){
-            return false;
-        }
-
-        a = a->next;
-        b = b->next;
+    if(pos < len){
+        snprintf(&buf[pos], len-pos, "%s:%d", db->king_port.address, db->king_port.port);
     }
-    return (a == NULL && b == NULL);
+    log__printf(NULL, MOSQ_LOG_INFO, "--> %s", buf);
 }
 
 #endif
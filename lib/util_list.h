@@ -16,16 +16,13 @@
 #endif
 
 #ifdef WITH_BROKER
-int init_list(PORT_LIST** head, char *type);
-PORT_LIST* add(PORT_LIST* node, BROKER brk);
-PORT_LIST* delete_node(PORT_LIST* head, BROKER brk);
-PORT_LIST* empty_list(PORT_LIST *head);
-bool in_list(PORT_LIST* head, BROKER brk);
-void print_list(PORT_LIST* head, char *type);
-char *print_all_lists(PORT_LIST* designated, PORT_LIST* blocked, BROKER root);
-PORT_LIST* find_and_delete(PORT_LIST *head, BROKER broker);
-PORT_LIST* copy_list(PORT_LIST *start1);
-bool are_identical(PORT_LIST *a, PORT_LIST *b);
+uint64_t stp__port_id(const char *address, int port);
+int stp__ports_add(struct mosquitto_db *db, struct mosquitto__bridge *bridge);
+struct mosquitto__bridge *stp__ports_find(struct mosquitto_db *db, const char *address, int port);
+void stp__ports_cleanup(struct mosquitto_db *db);
+void stp__port_status_set(struct mosquitto_db *db, struct mosquitto__bridge *bridge, int status);
+void stp__king_port_set(struct mosquitto_db *db, BROKER broker);
+void stp__ports_log(struct mosquitto_db *db);
 
 #endif
 
@@ -25,6 +25,7 @@ Contributors:
 #  include <io.h>
 #  include <lmcons.h>
 #else
+#  include <sys/resource.h>
 #  include <sys/stat.h>
 #endif
 
@@ -63,35 +64,174 @@ Contributors:
 #ifdef WITH_BROKER
 struct mosquitto__bpdu__packet* init__bpdu(struct mosquitto_db *db, struct mosquitto__bpdu__packet *bpdu)
 {
-    bpdu->distance = "0";
-    bpdu->origin_address = db->ip_address;
-    bpdu->origin_port = convert_integer(db->stp->my->port);
-    bpdu->origin_pid = convert_integer(db->stp->my->res->pid);
-    bpdu->root_address = db->ip_address;
-    bpdu->root_port = convert_integer(db->stp->my->port);
-    bpdu->root_pid = convert_integer(db->stp->my->res->pid);
+    bpdu->distance = 0;
+    snprintf(bpdu->origin_address, sizeof(bpdu->origin_address), "%s", db->ip_address);
+    bpdu->origin_port = db->stp->my->port;
+    bpdu->origin_id = stp__bridge_id(db->stp->my->res);
+    snprintf(bpdu->root_address, sizeof(bpdu->root_address), "%s", db->ip_address);
+    bpdu->root_port = db->stp->my->port;
+    bpdu->root_id = stp__bridge_id(db->stp->my->res);
     
     return bpdu;
 }
 
 
-struct mosquitto__bpdu__packet* find_bridge(struct mosquitto_db *db, struct mosquitto__bpdu__packet *packet, int origin_port, int i)
+/* The bridge we have towards the broker that sent this BPDU. The result is
+ * cached in the receiving context, so this runs once per connection. */
+struct mosquitto__bridge *stp__port_find(struct mosquitto_db *db, struct mosquitto__bpdu__packet *packet)
 {
-    struct mosquitto__bpdu__packet *stored_bpdu;
-    if(strcmp(db->config->bridges[i].addresses->address, packet->origin_address) == 0 && (db->config->bridges[i].addresses->port == origin_port)){
-        stored_bpdu = db->config->bridges[i].last_bpdu;
-        return stored_bpdu;
+    return stp__ports_find(db, packet->origin_address, packet->origin_port);
+}
+
+bool stp__port_forwarding(struct mosquitto__bridge *bridge)
+{
+    return bridge->port_status == DESIGNATED_PORT || bridge->port_status == ROOT_PORT;
+}
+
+/* Smooth the PINGREQ round trip the same way TCP smooths its RTT, so a
+ * single slow reply doesn't move the tree. */
+void stp__rtt_sample(struct mosquitto__bridge *bridge, uint64_t rtt)
+{
+    if(bridge->rtt == 0){
+        bridge->rtt = (int)rtt;
+    }else{
+        bridge->rtt += ((int)rtt - bridge->rtt)/8;
+    }
+    log__printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s rtt %dms (sample %dms)", bridge->name, bridge->rtt, (int)rtt);
+}
+
+/* Refresh the load advertised in our BPDUs, at most once a second. */
+void stp__resources_update(struct mosquitto_db *db)
+{
+    static uint64_t last_update = 0;
+#ifndef WIN32
+    static uint64_t last_cpu_us = 0;
+    struct rusage usage;
+    uint64_t cpu_us;
+#endif
+    uint64_t now;
+
+    now = mosquitto_time_ms();
+    if(last_update && now - last_update < 1000) return;
+
+#ifndef WIN32
+    if(getrusage(RUSAGE_SELF, &usage) == 0){
+        cpu_us = (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)*1000000
+                + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+        if(last_update){
+            /* us of CPU per ms of wall time / 10 = percent */
+            db->stp->my->res->cpu_load = (int)((cpu_us - last_cpu_us)/(now - last_update)/10);
+        }
+        last_cpu_us = cpu_us;
+    }
+#endif
+    db->stp->my->res->queued_kb = (int)(db->msg_store_bytes/1024);
+    last_update = now;
+}
+
+/* Dedup shard of a topic, FNV-1a. */
+int stp__topic_shard(const char *topic)
+{
+    uint32_t hash = 2166136261U;
+
+    while(*topic){
+        hash ^= (uint8_t)*topic++;
+        hash *= 16777619U;
+    }
+    return hash % STP_DEDUP_SHARDS;
+}
+
+/* Has this stamp been seen before? Records it if not. Sequence numbers more
+ * than STP_DEDUP_WINDOW behind the newest one of their shard can't be told
+ * apart from duplicates any more. They are let through, a rare duplicate is
+ * better than a lost message. */
+bool stp__dedup_seen(struct mosquitto_db *db, const struct mosquitto__stp_stamp *stamp)
+{
+    struct stp__dedup *dedup;
+    uint64_t offset;
+    int shard;
+
+    if(stamp->origin == 0) return false;
+    if(stamp->origin == db->stp_origin) return true;
+
+    shard = STP_SEQ_SHARD(stamp->seq);
+    HASH_FIND(hh, db->stp_dedup, &stamp->origin, sizeof(stamp->origin), dedup);
+    if(!dedup){
+        if(db->stp_dedup_count >= STP_DEDUP_ORIGINS_MAX) return false;
+        dedup = mosquitto__calloc(1, sizeof(struct stp__dedup));
+        if(!dedup) return false;
+        dedup->origin = stamp->origin;
+        HASH_ADD(hh, db->stp_dedup, origin, sizeof(dedup->origin), dedup);
+        db->stp_dedup_count++;
+    }
+    if(!dedup->window[shard]){
+        dedup->top[shard] = stamp->seq;
+        dedup->window[shard] = 1;
+        return false;
+    }
+
+    if(stamp->seq > dedup->top[shard]){
+        offset = stamp->seq - dedup->top[shard];
+        dedup->window[shard] = offset < STP_DEDUP_WINDOW ? (dedup->window[shard] << offset) | 1 : 1;
+        dedup->top[shard] = stamp->seq;
+        return false;
+    }
+    offset = dedup->top[shard] - stamp->seq;
+    if(offset >= STP_DEDUP_WINDOW) return false;
+    if(dedup->window[shard] & ((uint64_t)1 << offset)){
+        return true;
+    }
+    dedup->window[shard] |= (uint64_t)1 << offset;
+    return false;
+}
+
+void stp__dedup_cleanup(struct mosquitto_db *db)
+{
+    struct stp__dedup *dedup, *dedup_tmp;
+
+    HASH_ITER(hh, db->stp_dedup, dedup, dedup_tmp){
+        HASH_DELETE(hh, db->stp_dedup, dedup);
+        mosquitto__free(dedup);
+    }
+    db->stp_dedup_count = 0;
+}
+
+/* Cost of reaching the root through this bridge. */
+static int stp__port_cost(struct mosquitto__bridge *bridge, struct mosquitto__bpdu__packet *packet)
+{
+    return bridge->path_cost
+        + bridge->rtt/STP_RTT_COST_MS
+        + packet->origin_cpu_load/STP_CPU_COST
+        + packet->origin_queued_kb/STP_QUEUE_COST_KB;
+}
+
+/* Only one bridge can be the root port: demote the old one before promoting
+ * the new one, so that the forwarding path never sees two root ports. */
+static void stp__root_port_set(struct mosquitto_db *db, struct mosquitto__bridge *context)
+{
+    int i;
+
+    for(i=0; i<db->config->bridge_count; i++){
+        if(&db->config->bridges[i] != context && db->config->bridges[i].port_status == ROOT_PORT){
+            stp__port_status_set(db, &db->config->bridges[i], NO_PORT);
+        }
+    }
+    stp__port_status_set(db, context, ROOT_PORT);
+    if(db->root_lost_ms){
+        log__printf(NULL, MOSQ_LOG_NOTICE, "STP root port moved to %s %lums after the old one failed.",
+                context->name, (unsigned long)(mosquitto_time_ms() - db->root_lost_ms));
+        db->root_lost_ms = 0;
     }
-    return NULL;
 }
 
 bool check_repeated(struct mosquitto__bpdu__packet *stored_bpdu, struct mosquitto__bpdu__packet *packet){
-    if(strcmp(stored_bpdu->root_address, packet->root_address) == 0 && strcmp(stored_bpdu->root_port, packet->root_port) == 0 && strcmp(stored_bpdu->root_pid, packet->root_pid) == 0){
-        if(strcmp(stored_bpdu->origin_address, packet->origin_address) == 0 && strcmp(stored_bpdu->origin_port, packet->origin_port) == 0 && strcmp(stored_bpdu->origin_pid, packet->origin_pid)==0){
-            if(strcmp(stored_bpdu->distance, packet->distance) == 0){
-                log__printf(NULL, MOSQ_LOG_DEBUG, "INFO repeated");
-                return true;
-            }
+    /* Integer fields first, they differ far more often than the addresses. */
+    if(stored_bpdu->root_id == packet->root_id && stored_bpdu->root_port == packet->root_port
+            && stored_bpdu->origin_id == packet->origin_id && stored_bpdu->origin_port == packet->origin_port
+            && stored_bpdu->distance == packet->distance){
+        if(strcmp(stored_bpdu->root_address, packet->root_address) == 0 && strcmp(stored_bpdu->origin_address, packet->origin_address) == 0){
+            log__printf(NULL, MOSQ_LOG_DEBUG, "INFO repeated");
+            return true;
         }
     }
     return false;
@@ -108,261 +248,304 @@ bool check_repeated(struct mosquitto__bpdu__packet *stored_bpdu, struct mosquitt
 //
 //}
 
-int ping_everyone_except(struct mosquitto_db *db)
+/* Send our BPDU on a bridge now, or once its hold-down has expired. */
+static void stp__bpdu_send(struct mosquitto_db *db, struct mosquitto *context, uint64_t now)
+{
+    struct mosquitto__bridge *bridge = context->bridge;
+
+    if(context->sock == INVALID_SOCKET || context->state != mosq_cs_connected){
+        /* It gets a BPDU in its CONNECT anyway. */
+        bridge->bpdu_pending = false;
+        return;
+    }
+    if(now - bridge->bpdu_sent_ms < STP_BPDU_HOLD_MS){
+        bridge->bpdu_pending = true;
+        db->bpdu_pending = true;
+        return;
+    }
+    log__printf(NULL, MOSQ_LOG_DEBUG, "Sending BPDU update to %s", context->id);
+    send__pingreq(db, context);
+}
+
+/* Our root or distance changed: tell the designated ports, the ones that
+ * rely on us to reach the root, without waiting for their keepalive. */
+void stp__bpdu_propagate(struct mosquitto_db *db)
 {
-    struct mosquitto *context;
+    uint64_t now;
     int i;
-    
+
+    now = mosquitto_time_ms();
     for(i=0; i<db->bridge_count; i++){
         if(!db->bridges[i]) continue;
-        context = db->bridges[i];
-        
-        if(strcmp(context->bridge->addresses[context->bridge->cur_address].address, db->king_port.address) != 0 || context->bridge->addresses[context->bridge->cur_address].port != db->king_port.port){
-            log__printf(NULL, MOSQ_LOG_NOTICE, "Sending NEW ROOT info to address %s:%d", context->bridge->addresses[context->bridge->cur_address].address, context->bridge->addresses[context->bridge->cur_address].port);
-            //send__pingreq(db, context);
+        if(db->bridges[i]->bridge->port_status == DESIGNATED_PORT){
+            stp__bpdu_send(db, db->bridges[i], now);
         }
     }
-    return MOSQ_ERR_SUCCESS;
 }
 
+/* Send the BPDUs held back by the hold-down timer. */
+void stp__bpdu_flush(struct mosquitto_db *db)
+{
+    uint64_t now;
+    int i;
+
+    if(!db->bpdu_pending) return;
+
+    db->bpdu_pending = false;
+    now = mosquitto_time_ms();
+    for(i=0; i<db->bridge_count; i++){
+        if(!db->bridges[i]) continue;
+        if(db->bridges[i]->bridge->bpdu_pending){
+            stp__bpdu_send(db, db->bridges[i], now);
+        }
+    }
+}
+
+/* The peer (re)connected to us: answer its BPDU with ours, so a bridge
+ * coming back validates its role with one exchange. */
+void stp__bpdu_request(struct mosquitto_db *db, struct mosquitto__bridge *bridge)
+{
+    bridge->bpdu_pending = true;
+    db->bpdu_pending = true;
+}
+
+static void stp__designated_port_set(struct mosquitto_db *db, struct mosquitto__bridge *context)
+{
+    stp__port_status_set(db, context, DESIGNATED_PORT);
+}
+
+static void stp__blocked_port_set(struct mosquitto_db *db, struct mosquitto__bridge *context)
+{
+    stp__port_status_set(db, context, BLOCKED_PORT);
+}
+
+static void stp__new_root_port(struct mosquitto_db *db, struct mosquitto__stp *stp, struct mosquitto__bridge *context, struct mosquitto__bpdu__packet *packet, BROKER broker_origin, int port_cost)
+{
+    update_stp(stp, packet, port_cost);
+    stp__king_port_set(db, broker_origin);
+    stp__root_port_set(db, context);
+}
+
+/* The root is the broker with the lowest bridge id (priority, then PID), and
+ * the root port the one with the lowest distance plus port cost towards it. */
 int stp__algorithm(struct mosquitto_db *db, struct mosquitto__stp *stp, struct mosquitto__bridge *context, struct mosquitto__bpdu__packet *packet)
 {
-    
-    BROKER broker_root;
     BROKER broker_origin;
-    int recv_root_port;
-    int recv_origin_port;
-    int recv_root_pid;
-    int recv_distance;
-    int recv_origin_pid;
+    int my_root_id;
+    int my_id;
+    int port_cost;
+    int root_cost;
     int ret;
-    recv_origin_port = strint(packet->origin_port);
-    recv_root_pid = strint(packet->root_pid);
-    recv_root_port = strint(packet->root_port);
-    recv_distance = strint(packet->distance);
-    recv_origin_pid = strint(packet->origin_pid);
-    broker_root.address = packet->root_address;
-    broker_root.port = recv_root_port;
-    broker_origin.address = packet->origin_address;
-    broker_origin.port = recv_origin_port;
+
+    my_root_id = stp__bridge_id(stp->my_root->res);
+    my_id = stp__bridge_id(stp->my->res);
+    port_cost = stp__port_cost(context, packet);
+    root_cost = packet->distance + port_cost;
+    /* The port lists keep the address pointer, so use the bridge's own copy
+     * rather than the packet, which may live on the stack. */
+    broker_origin.address = context->addresses->address;
+    broker_origin.port = packet->origin_port;
     
     /* Beginning of STP algorithm */
-    if(stp->my_root->res->pid < recv_root_pid){
+    if(my_root_id < packet->root_id){
         log__printf(NULL, MOSQ_LOG_DEBUG, "Inferior information");
-        /* Set as designated port */
-        db->blocked_ports = find_and_delete(db->blocked_ports, broker_origin);
-        
-        if(!in_list(db->designated_ports, broker_origin)){
-            db->designated_ports = add(db->designated_ports, broker_origin);
-        }
-        context->port_status = DESIGNATED_PORT;
+        stp__designated_port_set(db, context);
         return MOSQ_ERR_SUCCESS;
     }
     
-    if(stp->my_root->res->pid > recv_root_pid){
-        log__printf(NULL, MOSQ_LOG_DEBUG, "BETTER PID");
-        update_stp(stp, packet);
-        //set root port
-        //WHAT TO DO WITH OLD ROOT? DP?
-        db->designated_ports = find_and_delete(db->designated_ports, broker_origin);
-        db->blocked_ports = find_and_delete(db->blocked_ports, broker_origin);
-        
-        db->king_port = broker_origin;
-        context->port_status = ROOT_PORT;
-        
-        //TODO: send new ping to designated ports?
-        //ping_everyone_except(db);
+    if(my_root_id > packet->root_id){
+        log__printf(NULL, MOSQ_LOG_DEBUG, "Better root id");
+        stp__new_root_port(db, stp, context, packet, broker_origin, port_cost);
         return MOSQ_ERR_SUCCESS;
     }
     
-    /* SAME PID */
+    /* SAME ROOT */
     /* -> Lower level */
-    if (stp->my_root->res->pid == recv_root_pid){
-        log__printf(NULL, MOSQ_LOG_DEBUG, "Same pid");
-        if(stp->distance < recv_distance){
-            log__printf(NULL, MOSQ_LOG_DEBUG, "Same PID but Inferior information");
-            /* Set as designated port */
-            db->blocked_ports = find_and_delete(db->blocked_ports, broker_origin);
-            
-            if(!in_list(db->designated_ports, broker_origin)){
-                db->designated_ports = add(db->designated_ports, broker_origin);
-            }
-            context->port_status = DESIGNATED_PORT;
-            
-            return MOSQ_ERR_SUCCESS;
-        }
-        if(stp->distance > recv_distance){
-            log__printf(NULL, MOSQ_LOG_DEBUG, "Found a better distance to the root");
-            //WHAT TO DO WITH OLD ROOT? DP?
-            update_stp(stp, packet);
-            //set root port
-            db->designated_ports = find_and_delete(db->designated_ports, broker_origin);
-            db->blocked_ports = find_and_delete(db->blocked_ports, broker_origin);
-            
-            db->king_port = broker_origin;
-            context->port_status = ROOT_PORT;
-            
-            //TODO: send new ping to designated ports?
-            //ping_everyone_except(db);
-            return MOSQ_ERR_SUCCESS;
-            
-        }
-        /* SAME DISTANCE */
-        /* -> Lower level */
-        if (stp->distance == recv_distance){
-            //another tie, check own pid first
-            if(stp->my->res->pid < recv_origin_pid){
-                /* Set as designated port */
-                db->blocked_ports = find_and_delete(db->blocked_ports, broker_origin);
-                if(!in_list(db->designated_ports, broker_origin)){
-                    db->designated_ports = add(db->designated_ports, broker_origin);
-                }
-                context->port_status = DESIGNATED_PORT;
-                return MOSQ_ERR_SUCCESS;
-            }
-            
-            if(stp->my->res->pid > recv_origin_pid){
-                log__printf(NULL, MOSQ_LOG_DEBUG, "we tie but my PID is greater, i've to block");
-                
-                db->designated_ports = find_and_delete(db->designated_ports, broker_origin);
-                
-                if(!in_list(db->blocked_ports, broker_origin)){
-                    db->blocked_ports = add(db->blocked_ports, broker_origin);
-                }
-                
-                context->port_status = BLOCKED_PORT;
-                return MOSQ_ERR_SUCCESS;
-            }
-            /* SAME OWN PID (almost impossible to have*/
-            /* -> Lower level */
-            if (stp->my->res->pid == recv_origin_pid){
-                ret = strcmp(stp->my->address, packet->origin_address);
-                if(ret < 0){
-                    /* Set as designated port */
-                    db->blocked_ports = find_and_delete(db->blocked_ports, broker_origin);
-                    if(!in_list(db->designated_ports, broker_origin)){
-                        db->designated_ports = add(db->designated_ports, broker_origin);
-                    }
-                    context->port_status = DESIGNATED_PORT;
-                    return MOSQ_ERR_SUCCESS;
-                }else if (ret == 0){
-                    //another tie
-                    if(stp->my->port < recv_origin_port){
-                        /* Set as designated port */
-                        db->blocked_ports = find_and_delete(db->blocked_ports, broker_origin);
-                        if(!in_list(db->designated_ports, broker_origin)){
-                            db->designated_ports = add(db->designated_ports, broker_origin);
-                        }
-                        context->port_status = DESIGNATED_PORT;
-                        return MOSQ_ERR_SUCCESS;
-                    }else if(stp->my->port > recv_origin_port){
-                        log__printf(NULL, MOSQ_LOG_DEBUG, "we tie but i'm greater, i've to block");
-                        //TODO set block
-                        db->designated_ports = find_and_delete(db->designated_ports, broker_origin);
-                        
-                        if(!in_list(db->blocked_ports, broker_origin)){
-                            db->blocked_ports = add(db->blocked_ports, broker_origin);
-                        }
-                        context->port_status = BLOCKED_PORT;
-                        return MOSQ_ERR_SUCCESS;
-                    }else{
-                        return MOSQ_ERR_STP;
-                    }
-                }else{
-                    log__printf(NULL, MOSQ_LOG_DEBUG, "we tie again but i'm greater address, i've to block");
-                    db->designated_ports = find_and_delete(db->designated_ports, broker_origin);
-                    
-                    if(!in_list(db->blocked_ports, broker_origin)){
-                        db->blocked_ports = add(db->blocked_ports, broker_origin);
-                    }
-                    
-                    context->port_status = BLOCKED_PORT;
-                    return MOSQ_ERR_SUCCESS;
-                }
-            }
-        }
+    log__printf(NULL, MOSQ_LOG_DEBUG, "Same root id");
+    if(context->port_status == ROOT_PORT){
+        /* Follow the cost of the current root port, up or down. */
+        stp__new_root_port(db, stp, context, packet, broker_origin, port_cost);
+        return MOSQ_ERR_SUCCESS;
+    }
+    if(root_cost + root_cost/STP_COST_HYSTERESIS < stp->distance){
+        log__printf(NULL, MOSQ_LOG_DEBUG, "Found a cheaper path to the root");
+        stp__new_root_port(db, stp, context, packet, broker_origin, port_cost);
+        return MOSQ_ERR_SUCCESS;
+    }
+    if(stp->distance < packet->distance){
+        log__printf(NULL, MOSQ_LOG_DEBUG, "Same root but Inferior information");
+        stp__designated_port_set(db, context);
+        return MOSQ_ERR_SUCCESS;
+    }
+    if(stp->distance > packet->distance){
+        /* The peer is closer to the root, but the path through it is not
+         * cheaper than our root port. */
+        log__printf(NULL, MOSQ_LOG_DEBUG, "Peer is closer to the root, block");
+        stp__blocked_port_set(db, context);
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    /* SAME DISTANCE */
+    /* -> Lower level */
+    //another tie, check own id first
+    if(my_id < packet->origin_id){
+        stp__designated_port_set(db, context);
+        return MOSQ_ERR_SUCCESS;
+    }
+    if(my_id > packet->origin_id){
+        log__printf(NULL, MOSQ_LOG_DEBUG, "we tie but my id is greater, i've to block");
+        stp__blocked_port_set(db, context);
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    /* SAME OWN ID (almost impossible to have) */
+    /* -> Lower level */
+    ret = strcmp(stp->my->address, packet->origin_address);
+    if(ret < 0){
+        stp__designated_port_set(db, context);
+        return MOSQ_ERR_SUCCESS;
+    }else if(ret > 0){
+        log__printf(NULL, MOSQ_LOG_DEBUG, "we tie again but i'm greater address, i've to block");
+        stp__blocked_port_set(db, context);
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    //another tie
+    if(stp->my->port < packet->origin_port){
+        stp__designated_port_set(db, context);
+        return MOSQ_ERR_SUCCESS;
+    }else if(stp->my->port > packet->origin_port){
+        log__printf(NULL, MOSQ_LOG_DEBUG, "we tie but i'm greater, i've to block");
+        stp__blocked_port_set(db, context);
+        return MOSQ_ERR_SUCCESS;
     }
     return MOSQ_ERR_STP;
 }
 
-bool check_convergence(struct mosquitto_db *db, PORT_LIST *old_des, PORT_LIST *old_block, BROKER old_k)
+/* Keep the cheapest non-root port towards the same root ready, so that
+ * rapid mode can switch to it without waiting for a new election. A peer
+ * is only a safe alternate if its own path to the root doesn't go through
+ * us, which is the case when it isn't further from the root than we are. */
+void stp__alternate_port_select(struct mosquitto_db *db)
 {
-    if(are_identical(db->designated_ports, old_des) && are_identical(db->blocked_ports, old_block)){
-        if(strcmp(db->king_port.address, old_k.address) == 0 && db->king_port.port == old_k.port){
-            return true;
+    struct mosquitto__bridge *bridge;
+    struct mosquitto__bridge *best = NULL;
+    struct mosquitto__bpdu__packet *bpdu;
+    int my_root_id;
+    int my_id;
+    int cost;
+    int best_cost = 0;
+    int i;
+
+    my_root_id = stp__bridge_id(db->stp->my_root->res);
+    my_id = stp__bridge_id(db->stp->my->res);
+
+    for(i=0; i<db->config->bridge_count; i++){
+        bridge = &db->config->bridges[i];
+        bpdu = bridge->last_bpdu;
+        if(bridge->port_status == ROOT_PORT || !bpdu) continue;
+        /* Nothing heard on this port since the last restart. */
+        if(bpdu->origin_id == my_id && bpdu->origin_port == db->stp->my->port) continue;
+        if(bpdu->root_id != my_root_id || bpdu->root_port != db->stp->my_root->port) continue;
+        if(bpdu->distance > db->stp->distance) continue;
+
+        cost = bpdu->distance + stp__port_cost(bridge, bpdu);
+        if(!best || cost < best_cost){
+            best = bridge;
+            best_cost = cost;
         }
     }
-    
-    return false;
+
+    if(best != db->alternate_port){
+        if(best){
+            log__printf(NULL, MOSQ_LOG_INFO, "STP alternate port is now %s (cost %d).", best->name, best_cost);
+        }else{
+            log__printf(NULL, MOSQ_LOG_INFO, "STP has no alternate port.");
+        }
+        db->alternate_port = best;
+    }
+}
+
+/* Make the alternate port the root port, using the BPDU last received on
+ * it. Returns MOSQ_ERR_NOT_FOUND if there is no alternate to fall back on. */
+int stp__alternate_promote(struct mosquitto_db *db)
+{
+    struct mosquitto__bridge *alternate = db->alternate_port;
+    BROKER broker_origin;
+
+    if(!alternate) return MOSQ_ERR_NOT_FOUND;
+
+    broker_origin.address = alternate->addresses->address;
+    broker_origin.port = alternate->last_bpdu->origin_port;
+    log__printf(NULL, MOSQ_LOG_NOTICE, "STP promoting alternate port %s to root port.", alternate->name);
+    stp__new_root_port(db, db->stp, alternate, alternate->last_bpdu, broker_origin, stp__port_cost(alternate, alternate->last_bpdu));
+    db->alternate_port = NULL;
+    stp__alternate_port_select(db);
+    db->stp_reconvergences++;
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+bool check_convergence(struct mosquitto_db *db, unsigned int old_generation)
+{
+    return db->stp_generation == old_generation;
 }
 
 int update__stp_properties(struct mosquitto_db *db, struct mosquitto__stp *stp, struct mosquitto__bridge *bridge, struct mosquitto__bpdu__packet *packet)
 {
-    struct mosquitto__bpdu__packet *stored_bpdu = NULL;
-    struct mosquitto__bridge *context = NULL;
     bool old_convergence = false;
-    int recv_origin_port;
     bool conv_reached = false;
+    int old_root_id;
+    int old_root_port;
+    int old_distance;
+    unsigned int old_generation;
     
-    recv_origin_port = strint(packet->origin_port);
+    log__printf(NULL, MOSQ_LOG_NOTICE, "r%s:%d o%s:%d", packet->root_address, packet->root_port, packet->origin_address, packet->origin_port);
     
-    log__printf(NULL, MOSQ_LOG_NOTICE, "r%s:%s o%s:%d", packet->root_address, packet->root_port, packet->origin_address, recv_origin_port);
+    if(!bridge){
+        log__printf(NULL, MOSQ_LOG_ERR, "BPDU from %s:%d, which isn't one of our bridges.", packet->origin_address, packet->origin_port);
+        return MOSQ_ERR_STP;
+    }
+    bridge->bpdu_recv_ms = mosquitto_time_ms();
     
-    PORT_LIST *old_designated;
-    PORT_LIST *old_blocked;
-    BROKER old_king;
+    old_root_id = stp__bridge_id(stp->my_root->res);
+    old_root_port = stp->my_root->port;
+    old_distance = stp->distance;
+    old_generation = db->stp_generation;
+    old_convergence = db->convergence;
     
-    init_list(&old_designated, "Desisgnated");
-    init_list(&old_blocked, "blocked");
-    old_king.address = db->king_port.address;
-    old_king.port = db->king_port.port;
+    if(stp__algorithm(db, stp, bridge, packet) != MOSQ_ERR_SUCCESS){
+        log__printf(NULL, MOSQ_LOG_ERR, "ERROR on update STP.");
+        return MOSQ_ERR_STP;
+    }
     
-    old_designated = copy_list(db->designated_ports);
-    old_blocked = copy_list(db->blocked_ports);
-    old_convergence = db->convergence;
+    update_bpdu(bridge->last_bpdu, packet);
+    if(db->config->stp_rapid){
+        stp__alternate_port_select(db);
+    }
+    if(stp__bridge_id(stp->my_root->res) != old_root_id || stp->my_root->port != old_root_port
+            || stp->distance != old_distance){
+        stp__bpdu_propagate(db);
+    }
+    
+    if(check_convergence(db, old_generation)){
+        db->convergence = true;
+    }else{
+        stp__ports_log(db);
+        db->convergence = false;
+        bridge->is_reached = false;
+    }
     
-    for(int i=0; i<db->config->bridge_count; i++){
-        stored_bpdu = find_bridge(db, packet, recv_origin_port, i);
-        
-        context = &db->config->bridges[i];
-        if(stored_bpdu){
-            
-            if(stp__algorithm(db, stp, context, packet) == MOSQ_ERR_SUCCESS){
-                update_bpdu(stored_bpdu, packet);
-                log__printf(NULL, MOSQ_LOG_DEBUG, "----- NEW LISTS -----");
-                log__printf(NULL, MOSQ_LOG_DEBUG, "\nList ROOT: %s:%d", db->king_port.address, db->king_port.port);
-                print_list(db->designated_ports, "DESIGNATED");
-                print_list(db->blocked_ports, "BLOCK");
-                log__printf(NULL, MOSQ_LOG_INFO, "--> %s", print_all_lists(db->designated_ports, db->blocked_ports, db->king_port));
-
-                if(check_convergence(db, old_designated, old_blocked, old_king)){
-                    db->convergence = true;
-                }else{
-                    db->convergence = false;
-                    bridge->is_reached = false;
-                }
-                
-                if(old_convergence && db->convergence){
-                    conv_reached = true;
-                    for(int i=0; i<db->config->bridge_count; i++){
-                        if(!db->config->bridges[i].is_connected){
-                            conv_reached = false;
-                        }
-                    }
-                    if(!bridge->is_reached){
-                        if(conv_reached){
-                            log__printf(NULL, MOSQ_LOG_INFO, "Convergence REACHED");
-                            bridge->is_reached = true;
-                        }
-                    }
-                }
-                return MOSQ_ERR_SUCCESS;
+    if(old_convergence && db->convergence){
+        conv_reached = (db->stp_connected_count == db->config->bridge_count);
+        if(!bridge->is_reached){
+            if(conv_reached){
+                log__printf(NULL, MOSQ_LOG_INFO, "Convergence REACHED");
+                bridge->is_reached = true;
             }
         }
     }
-    
-    log__printf(NULL, MOSQ_LOG_ERR, "ERROR on update STP.");
-    return MOSQ_ERR_STP;
+    return MOSQ_ERR_SUCCESS;
 }
 #endif
 
@@ -37,10 +37,21 @@ FILE *mosquitto__fopen(const char *path, const char *mode, bool restrict_read);
 int update__stp_properties(struct mosquitto_db *db, struct mosquitto__stp *stp, struct mosquitto__bridge *bridge, struct mosquitto__bpdu__packet *packet);
 int stp__algorithm(struct mosquitto_db *db, struct mosquitto__stp *stp, struct mosquitto__bridge *context, struct mosquitto__bpdu__packet *packet);
 int set__ports(struct mosquitto__stp *status, int msg_root_port, int msg_root_pid, int msg_distance, int msg_port, int msg_pid);
-struct mosquitto__bpdu__packet *find_bridge(struct mosquitto_db *db, struct mosquitto__bpdu__packet *packet, int origin_port, int i);
+struct mosquitto__bridge *stp__port_find(struct mosquitto_db *db, struct mosquitto__bpdu__packet *packet);
+bool stp__port_forwarding(struct mosquitto__bridge *bridge);
+void stp__rtt_sample(struct mosquitto__bridge *bridge, uint64_t rtt);
+void stp__resources_update(struct mosquitto_db *db);
+void stp__alternate_port_select(struct mosquitto_db *db);
+int stp__alternate_promote(struct mosquitto_db *db);
+void stp__bpdu_propagate(struct mosquitto_db *db);
+void stp__bpdu_flush(struct mosquitto_db *db);
+void stp__bpdu_request(struct mosquitto_db *db, struct mosquitto__bridge *bridge);
+int stp__topic_shard(const char *topic);
+bool stp__dedup_seen(struct mosquitto_db *db, const struct mosquitto__stp_stamp *stamp);
+void stp__dedup_cleanup(struct mosquitto_db *db);
 bool check_repeated(struct mosquitto__bpdu__packet *stored_bpdu, struct mosquitto__bpdu__packet *packet);
 struct mosquitto__bpdu__packet* init__bpdu(struct mosquitto_db *db, struct mosquitto__bpdu__packet *bpdu);
-bool check_convergence(struct mosquitto_db *db, PORT_LIST *old_des, PORT_LIST *old_block, BROKER old_k);
+bool check_convergence(struct mosquitto_db *db, unsigned int old_generation);
 
 #endif
 
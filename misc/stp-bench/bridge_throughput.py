@@ -0,0 +1,264 @@
+#!/usr/bin/env python3
+#
+# Bridged throughput against the number of bridge links, the write batch and
+# bridge compression.
+#
+# For every combination of link count, write_batch_bytes and
+# bridge_compression value, starts two brokers on this host, A bridged to B
+# with bridge_links set to that count, publishes messages on A over a number
+# of topics as fast as possible and measures how long a subscriber on B takes
+# to receive them all. Also checks that every topic arrived in order and, on
+# Linux, reports the write syscalls both brokers made per message, the bytes
+# A wrote per message, which is mostly what went over the bridge, and the CPU
+# time both brokers used per message. Results are written as one JSON
+# document.
+#
+# Example:
+#   ./bridge_throughput.py --broker ../../build/src/mosquitto --links 1 2 4 8 \
+#       --batch-bytes 0 16384 --compression none zlib --messages 100000 \
+#       --topics 64 --output results.json
+
+import argparse
+import json
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from stp_bench import ProbeClient, log  # noqa: E402
+
+
+def write_config(path, port, peer_port, address, links, qos, batch, compression):
+    with open(path, "w") as f:
+        f.write("port %d\n" % port)
+        if os.geteuid() == 0:
+            f.write("user root\n")
+        f.write("write_batch_bytes %d\n" % batch)
+        f.write("log_type error\n")
+        f.write("log_type warning\n")
+        f.write("log_dest stdout\n")
+        f.write("max_queued_messages 0\n")
+        f.write("max_inflight_messages 0\n")
+        if peer_port:
+            f.write("\nconnection %d_%d\n" % (port, peer_port))
+            f.write("address %s:%d\n" % (address, peer_port))
+            f.write("topic bench/# out %d\n" % qos)
+            f.write("remote_clientid %da%d\n" % (port, peer_port))
+            f.write("bridge_links %d\n" % links)
+            f.write("bridge_compression %s\n" % compression)
+            f.write("restart_timeout 1\n")
+
+
+def wait_port(port, timeout=10):
+    end = time.monotonic() + timeout
+    while time.monotonic() < end:
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=1).close()
+            return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+def proc_io(procs, field):
+    """Sum of a /proc/<pid>/io counter, such as syscw or wchar, over procs,
+    None if unknown."""
+    total = 0
+    try:
+        for p in procs:
+            with open("/proc/%d/io" % p.pid) as f:
+                for line in f:
+                    if line.startswith(field + ":"):
+                        total += int(line.split()[1])
+    except OSError:
+        return None
+    return total
+
+
+def cpu_seconds(procs):
+    """User and system CPU time used so far by procs, None if unknown."""
+    total = 0
+    try:
+        for p in procs:
+            with open("/proc/%d/stat" % p.pid) as f:
+                fields = f.read().rsplit(")", 1)[1].split()
+            total += int(fields[11]) + int(fields[12])
+    except (OSError, IndexError, ValueError):
+        return None
+    return total / os.sysconf("SC_CLK_TCK")
+
+
+def per_message(start, end, count, scale=1):
+    if start is None or end is None or not count:
+        return None
+    return round((end - start) * scale / count, 3)
+
+
+def receive(client, count, timeout):
+    """Read PUBLISH payloads until count have arrived or nothing came for
+    timeout seconds. Returns the payloads and the time of the last one."""
+    payloads = []
+    last = time.monotonic()
+    client.sock.settimeout(timeout)
+    while len(payloads) < count:
+        try:
+            command, body = client._read_packet()
+        except (socket.timeout, ConnectionError, OSError):
+            break
+        if command & 0xF0 == 0x30:
+            topic_len = struct.unpack("!H", body[:2])[0]
+            pos = 2 + topic_len
+            if command & 0x06:
+                pos += 2
+            payloads.append(body[pos:])
+            last = time.monotonic()
+    return payloads, last
+
+
+def run(args, links, batch, compression, address, workdir):
+    name = "%d-%d-%s" % (links, batch, compression)
+    conf_a = os.path.join(workdir, "a%s.conf" % name)
+    conf_b = os.path.join(workdir, "b%s.conf" % name)
+    write_config(conf_b, args.base_port+1, None, address, links, args.qos, batch, compression)
+    write_config(conf_a, args.base_port, args.base_port+1, address, links, args.qos, batch, compression)
+
+    log_b = open(os.path.join(workdir, "b%s.log" % name), "w")
+    log_a = open(os.path.join(workdir, "a%s.log" % name), "w")
+    procs = [subprocess.Popen([args.broker, "-c", conf_b], stdout=log_b, stderr=subprocess.STDOUT)]
+    try:
+        if not wait_port(args.base_port+1):
+            raise RuntimeError("broker B did not start")
+        procs.append(subprocess.Popen([args.broker, "-c", conf_a], stdout=log_a, stderr=subprocess.STDOUT))
+        if not wait_port(args.base_port):
+            raise RuntimeError("broker A did not start")
+        # Let the bridge and its extra links connect.
+        time.sleep(args.settle)
+
+        sub = ProbeClient(args.base_port+1, "bench-sub")
+        sub.subscribe("bench/#")
+        # A topic always goes through the same publisher to keep its order.
+        pubs = [ProbeClient(args.base_port, "bench-pub%d" % i) for i in range(args.publishers)]
+
+        # Telemetry like JSON compresses well, random bytes don't. The
+        # random paddings span more than the zlib window.
+        if args.payload == "json":
+            paddings = [(b'{"sensor":"temperature","unit":"C","value":21.5,"ok":true}' * (args.size // 58 + 1))[:max(0, args.size - 16)]]
+        else:
+            paddings = [os.urandom(max(0, args.size - 16)) for i in range(max(1, 65536 // max(1, args.size - 16) + 1))]
+        syscw_start = proc_io(procs, "syscw")
+        wchar_start = proc_io(procs[1:], "wchar")
+        cpu_start = cpu_seconds(procs)
+        start = time.monotonic()
+        for i in range(args.messages):
+            topic = "bench/%d" % (i % args.topics)
+            pubs[(i % args.topics) % len(pubs)].publish(topic, b"%d/%d/" % (i % args.topics, i // args.topics) + paddings[i % len(paddings)])
+        sent = time.monotonic()
+
+        payloads, last = receive(sub, args.messages, args.timeout)
+        syscw_end = proc_io(procs, "syscw")
+        wchar_end = proc_io(procs[1:], "wchar")
+        cpu_end = cpu_seconds(procs)
+        for pub in pubs:
+            pub.close()
+        sub.close()
+    finally:
+        for p in procs:
+            p.kill()
+            p.wait()
+        log_a.close()
+        log_b.close()
+
+    expected = {}
+    out_of_order = 0
+    for payload in payloads:
+        topic, seq = payload.split(b"/")[:2]
+        seq = int(seq)
+        if seq < expected.get(topic, 0):
+            out_of_order += 1
+        expected[topic] = seq + 1
+
+    elapsed = last - start
+    syscw = per_message(syscw_start, syscw_end, len(payloads))
+    result = {
+        "links": links,
+        "write_batch_bytes": batch,
+        "compression": compression,
+        "sent": args.messages,
+        "received": len(payloads),
+        "out_of_order": out_of_order,
+        "publish_s": round(sent - start, 3),
+        "elapsed_s": round(elapsed, 3),
+        "msgs_per_s": round(len(payloads) / elapsed) if elapsed > 0 else None,
+        "mbytes_per_s": round(len(payloads) * args.size / elapsed / 1e6, 2) if elapsed > 0 else None,
+        "write_syscalls_per_msg": syscw,
+        "sent_bytes_per_msg": per_message(wchar_start, wchar_end, len(payloads)),
+        "cpu_us_per_msg": per_message(cpu_start, cpu_end, len(payloads), 1e6),
+    }
+    log("links %2d batch %6d %s: %d/%d received in %.3f s, %s msg/s, %s writes/msg, %s bytes/msg, %s us cpu/msg, %d out of order" % (
+            links, batch, compression, result["received"], args.messages, elapsed, result["msgs_per_s"],
+            syscw, result["sent_bytes_per_msg"], result["cpu_us_per_msg"], out_of_order))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measure bridged throughput against bridge_links.")
+    parser.add_argument("--broker", required=True, help="path to the mosquitto broker binary")
+    parser.add_argument("--links", type=int, nargs="+", default=[1, 2, 4, 8], help="link counts to run")
+    parser.add_argument("--batch-bytes", type=int, nargs="+", default=[0],
+                        help="write_batch_bytes values to run")
+    parser.add_argument("--compression", nargs="+", choices=("none", "zlib"), default=["none"],
+                        help="bridge_compression values to run")
+    parser.add_argument("--payload", choices=("json", "random"), default="json", help="payload contents")
+    parser.add_argument("--messages", type=int, default=50000)
+    parser.add_argument("--topics", type=int, default=64)
+    parser.add_argument("--publishers", type=int, default=1, help="publishing connections on broker A")
+    parser.add_argument("--size", type=int, default=64, help="payload size in bytes")
+    parser.add_argument("--qos", type=int, choices=(0, 1, 2), default=1, help="QoS of the bridge topic")
+    parser.add_argument("--base-port", type=int, default=18930)
+    parser.add_argument("--settle", type=float, default=2.0, help="seconds to wait for the bridge to connect")
+    parser.add_argument("--timeout", type=float, default=5.0, help="give up after this long without a message")
+    parser.add_argument("--keep", action="store_true", help="keep the configs and logs")
+    parser.add_argument("--output", help="write the JSON results here instead of stdout")
+    args = parser.parse_args()
+
+    args.broker = os.path.abspath(args.broker)
+    address = socket.gethostbyname(socket.gethostname())
+    workdir = tempfile.mkdtemp(prefix="bridge-throughput-")
+    results = {
+        "version": 3,
+        "started": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "messages": args.messages,
+        "topics": args.topics,
+        "publishers": args.publishers,
+        "size": args.size,
+        "payload": args.payload,
+        "qos": args.qos,
+        "runs": [],
+    }
+    try:
+        for links in args.links:
+            for batch in args.batch_bytes:
+                for compression in args.compression:
+                    results["runs"].append(run(args, links, batch, compression, address, workdir))
+    finally:
+        if args.keep:
+            log("configs and logs kept in %s" % workdir)
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+    out = json.dumps(results, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(out + "\n")
+    else:
+        print(out)
+    return 0 if all(r["received"] == r["sent"] for r in results["runs"]) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+#
+# Time for a broker to take back a storm of reconnecting clients.
+#
+# For every listen_backlog value, starts a broker on this host and has a
+# number of worker processes open connections to it all at once, each
+# sending a CONNECT and waiting for the CONNACK. The broker can be stopped
+# for a while as the storm starts, as it would be while busy with something
+# else, so that the connections pile up in the listen backlog. Reports how
+# long it took until every client had its CONNACK, with percentiles. Results
+# are written as one JSON document.
+#
+# Example:
+#   ./connect_storm.py --broker ../../build/src/mosquitto --clients 8000 \
+#       --workers 8 --backlog 100 0 --pause 1.5 --output results.json
+
+import argparse
+import asyncio
+import json
+import multiprocessing
+import os
+import resource
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from stp_bench import log  # noqa: E402
+
+
+def raise_nofile(count):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if hard != resource.RLIM_INFINITY:
+        count = min(count, hard)
+    if soft != resource.RLIM_INFINITY and soft < count:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (count, hard))
+
+
+def connect_packet(client_id):
+    client_id = client_id.encode()
+    body = b"\x00\x04MQTT\x04\x02\x00\x3c" + len(client_id).to_bytes(2, "big") + client_id
+    return bytes([0x10, len(body)]) + body
+
+
+def worker(index, count, port, start, timeout, results):
+    """Connect count clients from start on, then report when each got its
+    CONNACK, relative to start, and how many failed."""
+    raise_nofile(count + 64)
+    done = []
+    failed = 0
+
+    async def one(i):
+        nonlocal failed
+        try:
+            reader, writer = await asyncio.wait_for(asyncio.open_connection("127.0.0.1", port), timeout)
+            writer.write(connect_packet("storm%d_%d" % (index, i)))
+            connack = await asyncio.wait_for(reader.readexactly(4), timeout)
+            if connack[0] != 0x20 or connack[3] != 0:
+                raise ConnectionError("refused")
+            done.append(time.time() - start)
+            return writer
+        except (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError, ConnectionError):
+            failed += 1
+            return None
+
+    async def run():
+        await asyncio.sleep(max(0, start - time.time()))
+        writers = await asyncio.gather(*[one(i) for i in range(count)])
+        results.put((done, failed))
+        for w in writers:
+            if w:
+                w.close()
+
+    asyncio.run(run())
+
+
+def percentile(values, fraction):
+    if not values:
+        return None
+    return round(values[min(len(values) - 1, int(len(values) * fraction))], 3)
+
+
+def run(args, backlog, workdir):
+    conf = os.path.join(workdir, "storm-%d.conf" % backlog)
+    with open(conf, "w") as f:
+        if os.geteuid() == 0:
+            f.write("user root\n")
+        f.write("log_type error\n")
+        f.write("log_dest stdout\n")
+        f.write("listener %d\n" % args.port)
+        if backlog:
+            f.write("listen_backlog %d\n" % backlog)
+
+    logf = open(os.path.join(workdir, "storm-%d.log" % backlog), "w")
+    broker = subprocess.Popen([args.broker, "-c", conf], stdout=logf, stderr=subprocess.STDOUT,
+                              preexec_fn=lambda: raise_nofile(args.clients + 256))
+    try:
+        time.sleep(args.settle)
+        results = multiprocessing.Queue()
+        start = time.time() + 1.0
+        per_worker = args.clients // args.workers
+        workers = [multiprocessing.Process(target=worker, args=(i, per_worker, args.port, start, args.timeout, results))
+                   for i in range(args.workers)]
+        for w in workers:
+            w.start()
+        if args.pause:
+            time.sleep(max(0, start - time.time()))
+            broker.send_signal(signal.SIGSTOP)
+            time.sleep(args.pause)
+            broker.send_signal(signal.SIGCONT)
+
+        done = []
+        failed = 0
+        for _ in workers:
+            d, f = results.get()
+            done += d
+            failed += f
+        for w in workers:
+            w.join()
+    finally:
+        broker.send_signal(signal.SIGCONT)
+        broker.terminate()
+        broker.wait()
+        logf.close()
+
+    done.sort()
+    result = {
+        "listen_backlog": backlog or "default",
+        "clients": per_worker * args.workers,
+        "connected": len(done),
+        "failed": failed,
+        "all_s": round(done[-1], 3) if done else None,
+        "p50_s": percentile(done, 0.5),
+        "p99_s": percentile(done, 0.99),
+    }
+    log("backlog %7s: %d/%d connected, all in %s s, p50 %s s, p99 %s s" % (
+            result["listen_backlog"], result["connected"], result["clients"],
+            result["all_s"], result["p50_s"], result["p99_s"]))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measure how fast a broker takes back a reconnect storm.")
+    parser.add_argument("--broker", required=True, help="path to the mosquitto broker binary")
+    parser.add_argument("--backlog", type=int, nargs="+", default=[100, 0],
+                        help="listen_backlog values to run, 0 for the broker default")
+    parser.add_argument("--clients", type=int, default=8000)
+    parser.add_argument("--workers", type=int, default=8, help="client processes")
+    parser.add_argument("--pause", type=float, default=1.5,
+                        help="seconds to stop the broker for as the storm starts, 0 for none")
+    parser.add_argument("--port", type=int, default=18960)
+    parser.add_argument("--settle", type=float, default=0.5, help="seconds to wait for the broker to start")
+    parser.add_argument("--timeout", type=float, default=30.0, help="give up on a client after this long")
+    parser.add_argument("--output", help="write the JSON results here instead of stdout")
+    args = parser.parse_args()
+
+    args.broker = os.path.abspath(args.broker)
+    results = {
+        "version": 1,
+        "started": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "clients": args.clients,
+        "workers": args.workers,
+        "pause_s": args.pause,
+        "runs": [],
+    }
+    with tempfile.TemporaryDirectory(prefix="connect-storm-") as workdir:
+        for backlog in args.backlog:
+            results["runs"].append(run(args, backlog, workdir))
+
+    out = json.dumps(results, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(out + "\n")
+    else:
+        print(out)
+    return 0 if all(r["failed"] == 0 for r in results["runs"]) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+#
+# Fan-out of a single topic to many subscribers.
+#
+# For every broker binary given, starts it on this host with a number of
+# subscribers on one topic, then has a publisher send messages on it as fast
+# as possible, and the run ends when every subscriber has received all of
+# them. Reports the messages delivered per second and the broker CPU time per
+# published message, so that two builds can be compared. At QoS 1 the
+# subscribers never acknowledge, and the broker is set not to limit the
+# messages in flight. Each broker can also be run once per zero_copy_bytes
+# value given. Results are written as one JSON document.
+#
+# Example:
+#   ./fanout.py --broker ../../build/src/mosquitto /tmp/old/src/mosquitto \
+#       --subscribers 500 --messages 1000 --payload 1024 --output results.json
+#   ./fanout.py --broker ../../build/src/mosquitto --zero-copy-bytes 0 1024 \
+#       --subscribers 50 --messages 2000 --payload 262144
+
+import argparse
+import json
+import os
+import selectors
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from stp_bench import ProbeClient, log, mqtt_packet, mqtt_string  # noqa: E402
+from bridge_throughput import cpu_seconds, wait_port  # noqa: E402
+from connect_storm import raise_nofile  # noqa: E402
+
+TOPIC = "fanout/site1/telemetry"
+
+
+def run(args, broker_path, zero_copy, index, workdir):
+    conf = os.path.join(workdir, "fanout-%d.conf" % index)
+    with open(conf, "w") as f:
+        if os.geteuid() == 0:
+            f.write("user root\n")
+        f.write("log_type error\n")
+        f.write("listener %d\n" % args.port)
+        f.write("max_inflight_messages 0\n")
+        f.write("max_queued_messages 0\n")
+        if args.batch_bytes:
+            f.write("write_batch_bytes %d\n" % args.batch_bytes)
+        if zero_copy:
+            f.write("zero_copy_bytes %d\n" % zero_copy)
+    broker = subprocess.Popen([broker_path, "-c", conf], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+                              preexec_fn=lambda: raise_nofile(args.subscribers + 256))
+    try:
+        if not wait_port(args.port) or broker.poll() is not None:
+            raise RuntimeError("broker did not start, is port %d in use?" % args.port)
+
+        subscribers = []
+        for i in range(args.subscribers):
+            client = ProbeClient(args.port, "fanout%d" % i)
+            client.sock.sendall(mqtt_packet(0x82, struct.pack("!H", 1) + mqtt_string(TOPIC) + bytes([args.qos])))
+            client._read_packet()  # SUBACK
+            subscribers.append(client)
+        publisher = ProbeClient(args.port, "publisher")
+
+        # Every PUBLISH a subscriber gets is the same size, a packet
+        # identifier included at QoS 1.
+        payload = b"x" * args.payload
+        packet = mqtt_packet(0x30 | (args.qos << 1), mqtt_string(TOPIC) + (b"\x00\x01" if args.qos else b"") + payload)
+        expected = len(packet) * args.messages
+
+        def publish():
+            buf = b""
+            for _ in range(args.messages):
+                buf += packet
+                if len(buf) > 65536:
+                    publisher.sock.sendall(buf)
+                    buf = b""
+            publisher.sock.sendall(buf)
+
+        sel = selectors.DefaultSelector()
+        received = [0] * len(subscribers)
+        for i, c in enumerate(subscribers):
+            c.sock.setblocking(False)
+            sel.register(c.sock, selectors.EVENT_READ, i)
+
+        cpu_start = cpu_seconds([broker])
+        start = time.monotonic()
+        thread = threading.Thread(target=publish)
+        thread.start()
+        last = start
+        done = 0
+        while done < len(subscribers):
+            events = sel.select(args.timeout)
+            if not events:
+                break
+            for key, _ in events:
+                data = key.fileobj.recv(262144)
+                received[key.data] += len(data)
+                if received[key.data] >= expected:
+                    sel.unregister(key.fileobj)
+                    done += 1
+            last = time.monotonic()
+        thread.join()
+        cpu_end = cpu_seconds([broker])
+        rss_kb = 0
+        with open("/proc/%d/status" % broker.pid) as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    rss_kb = int(line.split()[1])
+        for c in subscribers:
+            c.sock.setblocking(True)
+            c.close()
+        publisher.close()
+    finally:
+        broker.terminate()
+        broker.wait()
+
+    elapsed = last - start
+    deliveries = args.messages * args.subscribers
+    result = {
+        "broker": broker_path,
+        "zero_copy_bytes": zero_copy,
+        "complete": all(r == expected for r in received),
+        "elapsed_s": round(elapsed, 3),
+        "delivered_per_s": round(deliveries / elapsed) if elapsed else None,
+        "delivered_mb_per_s": round(expected * args.subscribers / elapsed / 1e6, 1) if elapsed else None,
+        "broker_cpu_us_per_message": round((cpu_end - cpu_start) * 1e6 / args.messages, 1)
+            if cpu_start is not None and cpu_end is not None else None,
+        "broker_peak_rss_kb": rss_kb,
+    }
+    log("%s (zero copy %d): %s msgs/s delivered, %s MB/s, %s us broker CPU per message, peak RSS %d kB%s" % (
+            broker_path, zero_copy, result["delivered_per_s"], result["delivered_mb_per_s"],
+            result["broker_cpu_us_per_message"], rss_kb, "" if result["complete"] else ", INCOMPLETE"))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measure fan-out of one topic to many subscribers.")
+    parser.add_argument("--broker", required=True, nargs="+", help="paths to the mosquitto broker binaries to compare")
+    parser.add_argument("--subscribers", type=int, default=500)
+    parser.add_argument("--messages", type=int, default=1000)
+    parser.add_argument("--payload", type=int, default=1024, help="payload bytes")
+    parser.add_argument("--qos", type=int, choices=[0, 1], default=0)
+    parser.add_argument("--batch-bytes", type=int, default=0, help="write_batch_bytes, 0 for the broker default")
+    parser.add_argument("--zero-copy-bytes", type=int, nargs="+", default=[0],
+                        help="zero_copy_bytes values to run each broker with, 0 for off")
+    parser.add_argument("--port", type=int, default=18990)
+    parser.add_argument("--timeout", type=float, default=10.0, help="give up once nothing arrives for this long")
+    parser.add_argument("--output", help="write the JSON results here instead of stdout")
+    args = parser.parse_args()
+
+    raise_nofile(args.subscribers + 256)
+    results = {
+        "version": 1,
+        "started": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "subscribers": args.subscribers,
+        "messages": args.messages,
+        "payload": args.payload,
+        "qos": args.qos,
+        "runs": [],
+    }
+    with tempfile.TemporaryDirectory(prefix="fanout-") as workdir:
+        for broker in args.broker:
+            for zero_copy in args.zero_copy_bytes:
+                results["runs"].append(run(args, os.path.abspath(broker), zero_copy, len(results["runs"]), workdir))
+
+    out = json.dumps(results, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(out + "\n")
+    else:
+        print(out)
+    return 0 if all(r["complete"] for r in results["runs"]) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+#
+# Fan-out throughput with and without the match cache.
+#
+# For every match_cache_bytes value, starts a broker on this host in which a
+# number of subscribers hold filters made from a set of hot telemetry topics
+# with levels randomly replaced by + or cut short with #, so that matching a
+# topic walks many branches of the subscription tree. A publisher then sends
+# messages on the hot topics at QoS 0 as fast as possible, and the run ends
+# when every subscriber has received all the messages it should. Reports the
+# messages delivered per second and the broker CPU time per published
+# message. Results are written as one JSON document.
+#
+# Example:
+#   ./match_cache.py --broker ../../build/src/mosquitto --cache-bytes 0 4194304 \
+#       --topics 2000 --filters 20000 --messages 200000 --output results.json
+
+import argparse
+import json
+import os
+import random
+import selectors
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from stp_bench import ProbeClient, log, mqtt_packet, mqtt_string  # noqa: E402
+from bridge_throughput import cpu_seconds, wait_port  # noqa: E402
+
+
+def hot_topics(count, rng):
+    return ["tele/site%d/dev%d/%s/%s" % (rng.randrange(50), i, rng.choice(["env", "power", "net"]),
+                                         rng.choice(["temp", "rh", "volt", "rssi"]))
+            for i in range(count)]
+
+
+# Chance of each level of a filter being +. Few filters are for every
+# device, so that each subscriber only gets some of the messages.
+PLUS = [0.0, 0.2, 0.005, 0.3, 0.3]
+
+
+def make_filter(topic, rng):
+    levels = topic.split("/")
+    out = []
+    for i, level in enumerate(levels):
+        if i > 2 and rng.random() < 0.1:
+            out.append("#")
+            break
+        out.append("+" if rng.random() < PLUS[i] else level)
+    return "/".join(out)
+
+
+def matching_filters(topic):
+    """Every filter make_filter() can produce that matches topic."""
+    out = [""]
+    found = set()
+    for i, level in enumerate(topic.split("/")):
+        if i > 2:
+            found.update(f + "/#" for f in out)
+        out = [(f + "/" if i else "") + l for f in out for l in (level, "+")]
+    found.update(out)
+    return found
+
+
+def subscribe_all(client, filters, per_packet=100):
+    for i in range(0, len(filters), per_packet):
+        body = struct.pack("!H", i // per_packet % 65535 + 1)
+        for f in filters[i:i+per_packet]:
+            body += mqtt_string(f) + bytes([0])
+        client.sock.sendall(mqtt_packet(0x82, body))
+        client._read_packet()  # SUBACK
+
+
+def run(args, cache_bytes, topics, filters, workdir):
+    conf = os.path.join(workdir, "cache-%d.conf" % cache_bytes)
+    with open(conf, "w") as f:
+        if os.geteuid() == 0:
+            f.write("user root\n")
+        f.write("log_type error\n")
+        f.write("listener %d\n" % args.port)
+        f.write("match_cache_bytes %d\n" % cache_bytes)
+        f.write("write_batch_bytes %d\n" % args.batch_bytes)
+    broker = subprocess.Popen([args.broker, "-c", conf], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        if not wait_port(args.port) or broker.poll() is not None:
+            raise RuntimeError("broker did not start, is port %d in use?" % args.port)
+
+        rng = random.Random(args.seed)
+        order = [rng.choice(topics) for _ in range(args.messages)]
+        packets = {t: mqtt_packet(0x30, mqtt_string(t) + b"x" * args.payload) for t in topics}
+
+        # What each subscriber should get, in bytes, as one PUBLISH per
+        # matching message whatever the number of its filters that match.
+        subscribers, expected = [], []
+        deliveries = 0
+        for i in range(args.subscribers):
+            mine = filters[i::args.subscribers]
+            client = ProbeClient(args.port, "fanout%d" % i)
+            subscribe_all(client, mine)
+            mine = set(mine)
+            wanted = {t for t in topics if mine & matching_filters(t)}
+            expected.append(sum(len(packets[t]) for t in order if t in wanted))
+            deliveries += sum(1 for t in order if t in wanted)
+            subscribers.append(client)
+        publisher = ProbeClient(args.port, "publisher")
+
+        def publish():
+            buf = b""
+            for t in order:
+                buf += packets[t]
+                if len(buf) > 65536:
+                    publisher.sock.sendall(buf)
+                    buf = b""
+            publisher.sock.sendall(buf)
+
+        sel = selectors.DefaultSelector()
+        received = [0] * len(subscribers)
+        for i, c in enumerate(subscribers):
+            c.sock.setblocking(False)
+            sel.register(c.sock, selectors.EVENT_READ, i)
+
+        cpu_start = cpu_seconds([broker])
+        start = time.monotonic()
+        thread = threading.Thread(target=publish)
+        thread.start()
+        last = start
+        while sum(min(r, e) for r, e in zip(received, expected)) < sum(expected):
+            events = sel.select(args.timeout)
+            if not events:
+                break
+            for key, _ in events:
+                data = key.fileobj.recv(262144)
+                received[key.data] += len(data)
+            last = time.monotonic()
+        thread.join()
+        cpu_end = cpu_seconds([broker])
+        for c in subscribers:
+            c.sock.setblocking(True)
+            c.close()
+        publisher.close()
+    finally:
+        broker.terminate()
+        broker.wait()
+
+    elapsed = last - start
+    result = {
+        "match_cache_bytes": cache_bytes,
+        "complete": received == expected,
+        "elapsed_s": round(elapsed, 3),
+        "published_per_s": round(args.messages / elapsed) if elapsed else None,
+        "delivered_per_s": round(deliveries / elapsed) if elapsed else None,
+        "broker_cpu_us_per_message": round((cpu_end - cpu_start) * 1e6 / args.messages, 2)
+            if cpu_start is not None and cpu_end is not None else None,
+    }
+    log("cache %8d: %s msgs/s published, %s delivered, %s us broker CPU per message%s" % (
+            cache_bytes, result["published_per_s"], result["delivered_per_s"],
+            result["broker_cpu_us_per_message"], "" if result["complete"] else ", INCOMPLETE"))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measure fan-out throughput with and without the match cache.")
+    parser.add_argument("--broker", required=True, help="path to the mosquitto broker binary")
+    parser.add_argument("--cache-bytes", type=int, nargs="+", default=[0, 4194304],
+                        help="match_cache_bytes values to run, 0 for no cache")
+    parser.add_argument("--topics", type=int, default=2000, help="hot topics published to")
+    parser.add_argument("--filters", type=int, default=20000, help="subscriptions made from them")
+    parser.add_argument("--subscribers", type=int, default=4)
+    parser.add_argument("--messages", type=int, default=200000)
+    parser.add_argument("--payload", type=int, default=16, help="payload bytes")
+    parser.add_argument("--batch-bytes", type=int, default=16384,
+                        help="write_batch_bytes, so that sending doesn't hide matching")
+    parser.add_argument("--port", type=int, default=18980)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--timeout", type=float, default=10.0, help="give up once nothing arrives for this long")
+    parser.add_argument("--output", help="write the JSON results here instead of stdout")
+    args = parser.parse_args()
+
+    args.broker = os.path.abspath(args.broker)
+    rng = random.Random(args.seed)
+    topics = hot_topics(args.topics, rng)
+    filters = [make_filter(rng.choice(topics), rng) for _ in range(args.filters)]
+
+    results = {
+        "version": 1,
+        "started": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "topics": args.topics,
+        "filters": args.filters,
+        "subscribers": args.subscribers,
+        "messages": args.messages,
+        "runs": [],
+    }
+    with tempfile.TemporaryDirectory(prefix="match-cache-") as workdir:
+        for cache_bytes in args.cache_bytes:
+            results["runs"].append(run(args, cache_bytes, topics, filters, workdir))
+
+    out = json.dumps(results, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(out + "\n")
+    else:
+        print(out)
+    return 0 if all(r["complete"] for r in results["runs"]) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
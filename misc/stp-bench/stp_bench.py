@@ -0,0 +1,496 @@
+#!/usr/bin/env python3
+#
+# Spanning tree convergence benchmark for MQTT-ST.
+#
+# Starts N brokers on this host, bridged along a ring, a full mesh or a
+# random graph, and measures how long the spanning tree takes to settle:
+# at start up, after a broker is taken down, and after it comes back.
+# After each of those the tree is checked and probe messages are sent
+# through it to count missing and duplicate deliveries. Results are written
+# as one JSON document.
+#
+# Example:
+#   ./stp_bench.py --broker ../../build/src/mosquitto -n 6 --topology mesh \
+#       --failures 3 --mode rstp --output results.json
+
+import argparse
+import json
+import os
+import random
+import re
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+RESULT_VERSION = 1
+
+RE_PORTS = re.compile(r"--> (.*)$")
+RE_ADDRESS = re.compile(r"[^\s,]+:(\d+)")
+RE_MOVED = re.compile(r"STP root port moved to \S+ (\d+)ms")
+
+
+def now_ms():
+    return time.monotonic() * 1000.0
+
+
+# ---------------------------------------------------------------------------
+# Topologies
+# ---------------------------------------------------------------------------
+
+def topology_ring(n, rng):
+    if n == 2:
+        return [(0, 1)]
+    return [(i, (i+1) % n) for i in range(n)]
+
+
+def topology_mesh(n, rng):
+    return [(i, j) for i in range(n) for j in range(i+1, n)]
+
+
+def topology_random(n, rng, degree=3.0):
+    # A random spanning tree keeps the graph connected, then extra links
+    # are added until the average degree is reached.
+    nodes = list(range(n))
+    rng.shuffle(nodes)
+    edges = set()
+    for i in range(1, n):
+        a, b = nodes[i], nodes[rng.randrange(i)]
+        edges.add((min(a, b), max(a, b)))
+    wanted = min(int(n*degree/2), n*(n-1)//2)
+    while len(edges) < wanted:
+        a, b = rng.sample(range(n), 2)
+        edges.add((min(a, b), max(a, b)))
+    return sorted(edges)
+
+
+TOPOLOGIES = {
+    "ring": topology_ring,
+    "mesh": topology_mesh,
+    "random": topology_random,
+}
+
+
+# ---------------------------------------------------------------------------
+# Minimal MQTT 3.1.1 client, enough for probe messages
+# ---------------------------------------------------------------------------
+
+def mqtt_string(s):
+    b = s.encode()
+    return struct.pack("!H", len(b)) + b
+
+
+def mqtt_packet(command, body):
+    length = len(body)
+    header = bytearray([command])
+    while True:
+        byte = length % 128
+        length //= 128
+        header.append(byte | 0x80 if length else byte)
+        if not length:
+            break
+    return bytes(header) + body
+
+
+class ProbeClient:
+    def __init__(self, port, client_id):
+        self.sock = socket.create_connection(("127.0.0.1", port), timeout=5)
+        body = mqtt_string("MQTT") + bytes([4, 0x02]) + struct.pack("!H", 60) + mqtt_string(client_id)
+        self.sock.sendall(mqtt_packet(0x10, body))
+        self._read_packet()  # CONNACK
+        self.received = []
+        self._buf = b""
+
+    def _read_exact(self, n):
+        data = b""
+        while len(data) < n:
+            chunk = self.sock.recv(n - len(data))
+            if not chunk:
+                raise ConnectionError("connection closed")
+            data += chunk
+        return data
+
+    def _read_packet(self):
+        command = self._read_exact(1)[0]
+        length, mult = 0, 1
+        while True:
+            byte = self._read_exact(1)[0]
+            length += (byte & 0x7F) * mult
+            mult *= 128
+            if not byte & 0x80:
+                break
+        return command, self._read_exact(length)
+
+    def subscribe(self, topic):
+        self.sock.sendall(mqtt_packet(0x82, struct.pack("!H", 1) + mqtt_string(topic) + bytes([0])))
+        self._read_packet()  # SUBACK
+
+    def publish(self, topic, payload):
+        self.sock.sendall(mqtt_packet(0x30, mqtt_string(topic) + payload))
+
+    def drain(self, timeout):
+        end = time.monotonic() + timeout
+        while True:
+            left = end - time.monotonic()
+            if left <= 0:
+                break
+            self.sock.settimeout(left)
+            try:
+                command, body = self._read_packet()
+            except (socket.timeout, ConnectionError, OSError):
+                break
+            if command & 0xF0 == 0x30:
+                topic_len = struct.unpack("!H", body[:2])[0]
+                self.received.append(body[2+topic_len:])
+
+    def close(self):
+        try:
+            self.sock.sendall(bytes([0xE0, 0]))
+            self.sock.close()
+        except OSError:
+            pass
+
+
+# ---------------------------------------------------------------------------
+# Brokers
+# ---------------------------------------------------------------------------
+
+class Broker:
+    def __init__(self, index, port, binary, workdir):
+        self.index = index
+        self.port = port
+        self.binary = binary
+        self.conf = os.path.join(workdir, "%d.conf" % port)
+        self.log = open(os.path.join(workdir, "%d.log" % port), "w")
+        self.proc = None
+        self.lock = threading.Lock()
+        self.events = []  # (time ms, kind, value)
+        self.ports = None  # (designated, blocked, root port) from the last summary
+        self.alive = False
+        self.stopped = False
+
+    def write_config(self, address, peers, args):
+        with open(self.conf, "w") as f:
+            f.write("port %d\n" % self.port)
+            if os.geteuid() == 0:
+                f.write("user root\n")
+            f.write("log_type all\n")
+            f.write("log_dest stdout\n")
+            f.write("stp_mode %s\n" % args.mode)
+            if self.index == 0 and args.root_priority is not None:
+                f.write("stp_priority %d\n" % args.root_priority)
+            for peer in peers:
+                f.write("\nconnection %d_%d\n" % (self.port, peer.port))
+                f.write("address %s:%d\n" % (address, peer.port))
+                f.write("topic # out 2\n")
+                f.write("remote_clientid %da%d\n" % (self.port, peer.port))
+                f.write("keepalive_interval %d\n" % args.keepalive)
+                f.write("restart_timeout 1\n")
+
+    def start(self):
+        self.proc = subprocess.Popen([self.binary, "-c", self.conf],
+                stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                bufsize=1, universal_newlines=True, errors="replace")
+        self.alive = True
+        self.stopped = False
+        self._record("start", None)
+        threading.Thread(target=self._reader, args=(self.proc,), daemon=True).start()
+
+    def kill(self):
+        if self.proc:
+            self.proc.kill()
+            self.proc.wait()
+        self.alive = False
+        with self.lock:
+            self.ports = None
+
+    def stop(self):
+        self.proc.send_signal(signal.SIGSTOP)
+        self.stopped = True
+
+    def cont(self):
+        self.proc.send_signal(signal.SIGCONT)
+        self.stopped = False
+
+    def _record(self, kind, value):
+        with self.lock:
+            self.events.append((now_ms(), kind, value))
+
+    def _reader(self, proc):
+        for line in proc.stdout:
+            self.log.write(line)
+            if "Sending PINGREQ COMP" in line or "Connecting bridge" in line:
+                self._record("bpdu", None)
+            elif "Dropped duplicate PUBLISH" in line:
+                self._record("dup", None)
+            elif "Convergence REACHED" in line:
+                self._record("reached", None)
+            m = RE_PORTS.search(line)
+            if m:
+                parts = m.group(1).split(" - ")
+                if len(parts) == 3:
+                    ports = tuple(set(int(p) for p in RE_ADDRESS.findall(part)) for part in parts)
+                    with self.lock:
+                        self.ports = (ports[0], ports[1], next(iter(ports[2]), 0))
+                    self._record("change", None)
+                continue
+            m = RE_MOVED.search(line)
+            if m:
+                self._record("moved", int(m.group(1)))
+        self.log.flush()
+
+    def count(self, kind, since):
+        with self.lock:
+            return sum(1 for t, k, _ in self.events if k == kind and t >= since)
+
+    def last(self, kinds, since):
+        with self.lock:
+            times = [t for t, k, _ in self.events if k in kinds and t >= since]
+        return max(times) if times else None
+
+    def values(self, kind, since):
+        with self.lock:
+            return [v for t, k, v in self.events if k == kind and t >= since]
+
+
+# ---------------------------------------------------------------------------
+# Measurements
+# ---------------------------------------------------------------------------
+
+def wait_converged(brokers, since, quiet_ms, timeout_ms, all_reached=False):
+    """Wait until no live broker has changed its ports for quiet_ms. With
+    all_reached, every live broker must also have had all of its bridges up
+    and reported convergence, bridges that failed to connect at start up are
+    retried late. Returns the time of the last change, or None if it never
+    settled."""
+    while True:
+        t = now_ms()
+        live = [b for b in brokers if b.alive and not b.stopped]
+        kinds = ("change", "moved", "reached") if all_reached else ("change", "moved")
+        changes = [b.last(kinds, since) for b in live]
+        reached = all(b.count("reached", since) for b in live) if all_reached else True
+        changes = [c for c in changes if c is not None]
+        last = max(changes) if changes else since
+        if reached and t - last >= quiet_ms:
+            return last
+        if t - since > timeout_ms:
+            return None
+        time.sleep(0.05)
+
+
+def check_tree(brokers, edges):
+    """An edge carries traffic when both ends forward on it. The live brokers
+    should be joined by exactly a spanning tree of such edges."""
+    live = [b for b in brokers if b.alive and not b.stopped]
+    by_port = {b.port: b for b in live}
+    forwarding = {}
+    for b in live:
+        with b.lock:
+            ports = b.ports
+        if ports is None:
+            forwarding[b.port] = set(p.port for p in brokers)  # Never blocked anything
+        else:
+            forwarding[b.port] = ports[0] | {ports[2]}
+    active = []
+    for a, c in edges:
+        pa, pc = brokers[a].port, brokers[c].port
+        if pa in by_port and pc in by_port and pc in forwarding[pa] and pa in forwarding[pc]:
+            active.append((pa, pc))
+
+    seen = set()
+    if live:
+        stack = [live[0].port]
+        while stack:
+            p = stack.pop()
+            if p in seen:
+                continue
+            seen.add(p)
+            stack.extend(q for a, c in active for q in (a, c) if p in (a, c) and q != p)
+    return {
+        "live_brokers": len(live),
+        "active_links": len(active),
+        "connected": len(seen) == len(live),
+        "spanning_tree": len(seen) == len(live) and len(active) == len(live) - 1,
+    }
+
+
+def probe(brokers, count, wait_s, rng):
+    """Publish count messages from one live broker and count how many copies
+    each live broker's subscriber gets."""
+    live = [b for b in brokers if b.alive and not b.stopped]
+    if not live:
+        return None
+    subscribers = []
+    for b in live:
+        try:
+            client = ProbeClient(b.port, "stpbench-sub-%d" % b.port)
+            client.subscribe("stpbench/probe")
+            subscribers.append(client)
+        except OSError:
+            pass
+    source = rng.choice(live)
+    try:
+        pub = ProbeClient(source.port, "stpbench-pub")
+        for i in range(count):
+            pub.publish("stpbench/probe", b"%d" % i)
+        pub.close()
+    except OSError:
+        pass
+
+    missing = 0
+    duplicates = 0
+    for client in subscribers:
+        client.drain(wait_s)
+        client.close()
+        for i in range(count):
+            copies = client.received.count(b"%d" % i)
+            if copies == 0:
+                missing += 1
+            else:
+                duplicates += copies - 1
+    return {
+        "source": source.port,
+        "sent": count,
+        "subscribers": len(subscribers),
+        "missing": missing,
+        "duplicates": duplicates,
+    }
+
+
+def phase(name, brokers, edges, since, args, rng, victim=None):
+    settled = wait_converged(brokers, since, args.quiet*1000, args.timeout*1000, name == "start")
+    result = {
+        "event": name,
+        "broker": victim.port if victim else None,
+        "converged": settled is not None,
+        "convergence_ms": round(settled - since) if settled is not None else None,
+        "bpdus": sum(b.count("bpdu", since) for b in brokers),
+        "topology_changes": sum(b.count("change", since) for b in brokers),
+        "root_moves_ms": sorted(v for b in brokers for v in b.values("moved", since)),
+        "tree": check_tree(brokers, edges),
+    }
+    if args.probes:
+        result["probe"] = probe(brokers, args.probes, args.probe_wait, rng)
+    result["dropped_duplicates"] = sum(b.count("dup", since) for b in brokers)
+    log("%-8s %s converged=%s in %s ms, %d BPDUs, tree=%s" % (name,
+            victim.port if victim else "", result["converged"], result["convergence_ms"],
+            result["bpdus"], result["tree"]["spanning_tree"]))
+    return result
+
+
+def log(msg):
+    sys.stderr.write(msg + "\n")
+    sys.stderr.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measure MQTT-ST spanning tree convergence on a local cluster.")
+    parser.add_argument("--broker", required=True, help="path to the mosquitto broker binary")
+    parser.add_argument("-n", "--brokers", type=int, default=5, help="number of brokers (default 5)")
+    parser.add_argument("--topology", choices=sorted(TOPOLOGIES), default="ring")
+    parser.add_argument("--degree", type=float, default=3.0, help="average degree of the random topology")
+    parser.add_argument("--mode", choices=("stp", "rstp"), default="stp", help="stp_mode of the brokers")
+    parser.add_argument("--base-port", type=int, default=18830)
+    parser.add_argument("--keepalive", type=int, default=2, help="bridge keepalive_interval in seconds")
+    parser.add_argument("--root-priority", type=int, default=None,
+            help="stp_priority of the first broker, to force it to be the root")
+    parser.add_argument("--failures", type=int, default=1, help="number of failure/recovery rounds")
+    parser.add_argument("--failure", choices=("kill", "stop"), default="kill",
+            help="kill the broker (connections reset) or SIGSTOP it (keepalive timeout)")
+    parser.add_argument("--down-time", type=float, default=None,
+            help="seconds to keep a failed broker down, default until the rest converged")
+    parser.add_argument("--quiet", type=float, default=None,
+            help="seconds without port changes that count as converged (default 2 keepalives + 1)")
+    parser.add_argument("--timeout", type=float, default=60.0, help="give up on convergence after this long")
+    parser.add_argument("--probes", type=int, default=20, help="probe messages per phase, 0 to disable")
+    parser.add_argument("--probe-wait", type=float, default=1.0, help="seconds to wait for probe messages")
+    parser.add_argument("--seed", type=int, default=None)
+    parser.add_argument("--keep", action="store_true", help="keep the configs and logs")
+    parser.add_argument("--output", help="write the JSON results here instead of stdout")
+    args = parser.parse_args()
+
+    if args.brokers < 2:
+        parser.error("at least 2 brokers are needed")
+    if args.quiet is None:
+        args.quiet = 2*args.keepalive + 1
+    if args.seed is None:
+        args.seed = random.randrange(1 << 31)
+    rng = random.Random(args.seed)
+
+    if args.topology == "random":
+        edges = topology_random(args.brokers, rng, args.degree)
+    else:
+        edges = TOPOLOGIES[args.topology](args.brokers, rng)
+
+    # Brokers identify each other by the address of the host name, so the
+    # bridges have to use it too.
+    address = socket.gethostbyname(socket.gethostname())
+    workdir = tempfile.mkdtemp(prefix="stp-bench-")
+    brokers = [Broker(i, args.base_port + i, os.path.abspath(args.broker), workdir) for i in range(args.brokers)]
+    for b in brokers:
+        peers = [brokers[c] for a, c in edges if a == b.index] + [brokers[a] for a, c in edges if c == b.index]
+        b.write_config(address, peers, args)
+
+    results = {
+        "version": RESULT_VERSION,
+        "started": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "brokers": args.brokers,
+        "topology": args.topology,
+        "links": [[brokers[a].port, brokers[c].port] for a, c in edges],
+        "mode": args.mode,
+        "keepalive": args.keepalive,
+        "failure": args.failure,
+        "seed": args.seed,
+        "phases": [],
+    }
+
+    try:
+        since = now_ms()
+        for b in brokers:
+            b.start()
+        results["phases"].append(phase("start", brokers, edges, since, args, rng))
+
+        for i in range(args.failures):
+            victim = rng.choice(brokers)
+            since = now_ms()
+            if args.failure == "kill":
+                victim.kill()
+            else:
+                victim.stop()
+            if args.down_time:
+                time.sleep(args.down_time)
+            results["phases"].append(phase("down", brokers, edges, since, args, rng, victim))
+
+            since = now_ms()
+            if args.failure == "kill":
+                victim.start()
+            else:
+                victim.cont()
+            results["phases"].append(phase("up", brokers, edges, since, args, rng, victim))
+    finally:
+        for b in brokers:
+            if b.stopped:
+                b.cont()
+            b.kill()
+        if args.keep:
+            log("configs and logs kept in %s" % workdir)
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+    out = json.dumps(results, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(out + "\n")
+    else:
+        print(out)
+
+    return 0 if all(p["converged"] for p in results["phases"]) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+#
+# Memory per subscription and PUBLISH match time of the subscription tree.
+#
+# Starts a broker on this host and has a client subscribe to a number of
+# filters shaped like those of a large device fleet, e.g. site/<n>/dev/<n>/cmd
+# with some + and # filters mixed in, reading the broker's resident memory
+# before and after. Then publishes messages on topics that match those
+# filters to a second client, one at a time, and reports the round trip
+# time. Results are written as one JSON document.
+#
+# Example:
+#   ./sub_index.py --broker ../../build/src/mosquitto --subscriptions 200000 \
+#       --messages 20000 --output results.json
+
+import argparse
+import json
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from stp_bench import ProbeClient, log, mqtt_packet, mqtt_string  # noqa: E402
+
+
+def rss_kb(pid):
+    with open("/proc/%d/status" % pid) as f:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1])
+    return 0
+
+
+def filters(count, sites, rng):
+    """Mostly exact device filters, with a few per site level wildcards."""
+    out = []
+    for i in range(count):
+        site = i % sites
+        r = rng.random()
+        if r < 0.02:
+            out.append("site/%d/dev/+/status" % site)
+        elif r < 0.03:
+            out.append("site/%d/alarm/#" % site)
+        else:
+            out.append("site/%d/dev/%d/cmd" % (site, i))
+    return out
+
+
+def subscribe_all(client, topics, per_packet=100):
+    mid = 1
+    for i in range(0, len(topics), per_packet):
+        body = struct.pack("!H", mid)
+        for topic in topics[i:i+per_packet]:
+            body += mqtt_string(topic) + bytes([0])
+        client.sock.sendall(mqtt_packet(0x82, body))
+        client._read_packet()  # SUBACK
+        mid = mid % 65535 + 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measure subscription tree memory and match time.")
+    parser.add_argument("--broker", required=True, help="path to the mosquitto broker binary")
+    parser.add_argument("--subscriptions", type=int, default=200000)
+    parser.add_argument("--sites", type=int, default=1000, help="distinct second level topics")
+    parser.add_argument("--messages", type=int, default=20000)
+    parser.add_argument("--port", type=int, default=18970)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--output", help="write the JSON results here instead of stdout")
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    topics = filters(args.subscriptions, args.sites, rng)
+
+    with tempfile.TemporaryDirectory(prefix="sub-index-") as workdir:
+        conf = os.path.join(workdir, "broker.conf")
+        with open(conf, "w") as f:
+            if os.geteuid() == 0:
+                f.write("user root\n")
+            f.write("log_type error\n")
+            f.write("listener %d\n" % args.port)
+        broker = subprocess.Popen([os.path.abspath(args.broker), "-c", conf],
+                                  stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(0.5)
+            if broker.poll() is not None:
+                raise RuntimeError("broker exited, is port %d in use?" % args.port)
+            subscriber = ProbeClient(args.port, "subscriber")
+            before = rss_kb(broker.pid)
+            start = time.monotonic()
+            subscribe_all(subscriber, topics)
+            subscribe_s = time.monotonic() - start
+            after = rss_kb(broker.pid)
+            publisher = ProbeClient(args.port, "publisher")
+
+            exact = [t for t in topics if "+" not in t and "#" not in t]
+            rtts = []
+            for i in range(args.messages):
+                topic = rng.choice(exact)
+                start = time.monotonic()
+                publisher.publish(topic, b"x")
+                subscriber._read_packet()
+                rtts.append(time.monotonic() - start)
+            subscriber.close()
+            publisher.close()
+        finally:
+            broker.terminate()
+            broker.wait()
+
+    rtts.sort()
+    results = {
+        "version": 1,
+        "started": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "subscriptions": args.subscriptions,
+        "sites": args.sites,
+        "subscribe_s": round(subscribe_s, 3),
+        "rss_kb_before": before,
+        "rss_kb_after": after,
+        "bytes_per_subscription": round((after - before) * 1024 / args.subscriptions, 1),
+        "messages": args.messages,
+        "rtt_p50_us": round(rtts[len(rtts)//2] * 1e6, 1),
+        "rtt_p99_us": round(rtts[int(len(rtts)*0.99)] * 1e6, 1),
+    }
+    log("%d subscriptions: %.1f bytes each, round trip p50 %.1f us, p99 %.1f us" % (
+            args.subscriptions, results["bytes_per_subscription"], results["rtt_p50_us"], results["rtt_p99_us"]))
+
+    out = json.dumps(results, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(out + "\n")
+    else:
+        print(out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -24,6 +24,9 @@ Contributors:
 #ifndef WIN32
 #include <netdb.h>
 #include <sys/socket.h>
+#ifdef WITH_EPOLL
+#include <sys/epoll.h>
+#endif
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -48,6 +51,7 @@ Contributors:
 
 static void bridge__backoff_step(struct mosquitto *context);
 static void bridge__backoff_reset(struct mosquitto *context);
+static int bridge__local_subscribe(struct mosquitto_db *db, struct mosquitto *context);
 
 char* char__pid(){
     char * mypid = malloc(6);
@@ -60,7 +64,6 @@ int bridge__new(struct mosquitto_db *db, struct mosquitto__bridge *bridge)
 	struct mosquitto *new_context = NULL;
     struct mosquitto__bpdu__packet *bpdu = NULL;
 	struct mosquitto **bridges;
-    BROKER broker;
 	char *local_id;
 
 	assert(db);
@@ -86,6 +89,18 @@ int bridge__new(struct mosquitto_db *db, struct mosquitto__bridge *bridge)
 	new_context->is_bridge = true;
     bridge->is_connected = false;
     bridge->is_reached = false;
+    bridge->port_status = DESIGNATED_PORT;
+    bridge->peer_stale = true;
+    stp__ports_add(db, bridge);
+
+	if(bridge->topic_remapping && bridge__remap_compile(bridge)){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	if(bridge->spool_location && !bridge->spool && bridge__spool_open(bridge)){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
 
 	new_context->username = new_context->bridge->remote_username;
 	new_context->password = new_context->bridge->remote_password;
@@ -106,10 +121,6 @@ int bridge__new(struct mosquitto_db *db, struct mosquitto__bridge *bridge)
     
     //log__printf(NULL, MOSQ_LOG_DEBUG, "BDPU CHECK r%s:%s-%s o%s:%s-%s", bridge->last_bpdu->root_address, bridge->last_bpdu->root_port, bridge->last_bpdu->root_pid, bridge->last_bpdu->origin_address, bridge->last_bpdu->origin_port, bridge->last_bpdu->origin_pid);
     
-    broker.address = bridge->addresses->address;
-    broker.port = bridge->addresses->port;
-    db->designated_ports = add(db->designated_ports, broker);
-    
 #ifdef WITH_TLS
 	new_context->tls_cafile = new_context->bridge->tls_cafile;
 	new_context->tls_capath = new_context->bridge->tls_capath;
@@ -129,6 +140,11 @@ int bridge__new(struct mosquitto_db *db, struct mosquitto__bridge *bridge)
 	bridge->try_private_accepted = true;
 	new_context->protocol = bridge->protocol_version;
 
+	if(bridge->link_count > 1 && bridge__links_new(db, new_context)){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+
 	bridges = mosquitto__realloc(db->bridges, (db->bridge_count+1)*sizeof(struct mosquitto *));
 	if(bridges){
 		db->bridges = bridges;
@@ -173,24 +189,11 @@ int bridge__connect_step1(struct mosquitto_db *db, struct mosquitto *context)
 		db__messages_delete(db, context);
 	}
 
-	/* Delete all local subscriptions even for clean_start==false. We don't
-	 * remove any messages and the next loop carries out the resubscription
-	 * anyway. This means any unwanted subs will be removed.
-	 */
-	sub__clean_session(db, context);
-
+	if(bridge__local_subscribe(db, context)){
+		return 1;
+	}
 	for(i=0; i<context->bridge->topic_count; i++){
 		if(context->bridge->topics[i].direction == bd_out || context->bridge->topics[i].direction == bd_both){
-			log__printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s doing local SUBSCRIBE on topic %s", context->id, context->bridge->topics[i].local_topic);
-			if(sub__add(db,
-						context,
-						context->bridge->topics[i].local_topic,
-						context->bridge->topics[i].qos,
-						0,
-						MQTT_SUB_OPT_NO_LOCAL | MQTT_SUB_OPT_RETAIN_AS_PUBLISHED,
-						&db->subs) > 0){
-				return 1;
-			}
 			sub__retain_queue(db, context,
 					context->bridge->topics[i].local_topic,
 					context->bridge->topics[i].qos, 0);
@@ -329,7 +332,6 @@ int bridge__connect_step3(struct mosquitto_db *db, struct mosquitto *context)
 int bridge__connect(struct mosquitto_db *db, struct mosquitto *context)
 {
 	int rc, rc2;
-	int i;
 	char *notification_topic;
 	int notification_topic_len;
 	uint8_t notification_payload;
@@ -355,26 +357,8 @@ int bridge__connect(struct mosquitto_db *db, struct mosquitto *context)
 		db__messages_delete(db, context);
 	}
 
-	/* Delete all local subscriptions even for clean_start==false. We don't
-	 * remove any messages and the next loop carries out the resubscription
-	 * anyway. This means any unwanted subs will be removed.
-	 */
-	sub__clean_session(db, context);
-
-	for(i=0; i<context->bridge->topic_count; i++){
-		if(context->bridge->topics[i].direction == bd_out || context->bridge->topics[i].direction == bd_both){
-			//log__printf(NULL, MOSQ_LOG_NOTICE, "[BRIDGE] %s trying to create a local SUBSCRIBE on topic %s", context->id, context->bridge->topics[i].local_topic);
-			if(sub__add(db,
-						context,
-						context->bridge->topics[i].local_topic,
-						context->bridge->topics[i].qos,
-						0,
-						MQTT_SUB_OPT_NO_LOCAL | MQTT_SUB_OPT_RETAIN_AS_PUBLISHED,
-						&db->subs) > 0){
-
-				return 1;
-			}
-		}
+	if(bridge__local_subscribe(db, context)){
+		return 1;
 	}
 
 	/* prepare backoff for a possible failure. Restart timeout will be reset if connection gets established */
@@ -461,6 +445,42 @@ int bridge__connect(struct mosquitto_db *db, struct mosquitto *context)
 #endif
 
 
+/* The local subscriptions for the out topics are only made on the first
+ * connect. Nothing removes them while the bridge is down, so messages keep
+ * being queued for it, and a reconnect, such as a lazy bridge waking up,
+ * doesn't have to rebuild them and make the interest of this broker churn.
+ */
+static int bridge__local_subscribe(struct mosquitto_db *db, struct mosquitto *context)
+{
+	int i;
+
+	if(context->bridge->local_subscribed) return MOSQ_ERR_SUCCESS;
+
+	/* Delete all local subscriptions even for clean_start==false. This means
+	 * any unwanted subs will be removed.
+	 */
+	sub__clean_session(db, context);
+
+	for(i=0; i<context->bridge->topic_count; i++){
+		if(context->bridge->topics[i].direction == bd_out || context->bridge->topics[i].direction == bd_both){
+			log__printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s doing local SUBSCRIBE on topic %s", context->id, context->bridge->topics[i].local_topic);
+			if(sub__add(db,
+						context,
+						context->bridge->topics[i].local_topic,
+						context->bridge->topics[i].qos,
+						0,
+						MQTT_SUB_OPT_NO_LOCAL | MQTT_SUB_OPT_RETAIN_AS_PUBLISHED,
+						&db->subs) > 0){
+
+				return 1;
+			}
+		}
+	}
+	context->bridge->local_subscribed = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
 void bridge__packet_cleanup(struct mosquitto *context)
 {
 	struct mosquitto__packet *packet;
@@ -479,6 +499,8 @@ void bridge__packet_cleanup(struct mosquitto *context)
 	}
 	context->out_packet = NULL;
 	context->out_packet_last = NULL;
+	context->compress_from = NULL;
+	context->compress_prev = NULL;
 
 	packet__cleanup(&(context->in_packet));
 }
@@ -522,4 +544,211 @@ static void bridge__backoff_reset(struct mosquitto *context)
 	}
 }
 
+
+/* Bundled bridges.
+ *
+ * With bridge_links > 1 a bridge opens extra connections to the same peer
+ * once its own connection is up. They only carry outgoing messages, each
+ * topic always goes over the same one so its order is kept. Everything else
+ * - remote subscriptions, notifications and the spanning tree, which sees
+ * the bundle as a single port - stays on the bridge's own connection.
+ */
+int bridge__links_new(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto__bridge *bridge = context->bridge;
+	struct mosquitto *link;
+	char *id;
+	int len;
+	int i;
+
+	bridge->links = mosquitto__calloc(bridge->link_count-1, sizeof(struct mosquitto__bridge_link));
+	if(!bridge->links) return MOSQ_ERR_NOMEM;
+
+	for(i=0; i<bridge->link_count-1; i++){
+		/* Keep the remote client id as the suffix, the peer reads our port
+		 * from the end of it. */
+		len = strlen(bridge->remote_clientid) + strlen("link99.") + 1;
+		id = mosquitto__malloc(len);
+		if(!id) return MOSQ_ERR_NOMEM;
+		snprintf(id, len, "link%d.%s", i+1, bridge->remote_clientid);
+
+		HASH_FIND(hh_id, db->contexts_by_id, id, strlen(id), link);
+		if(link){
+			/* (possible from persistent db) */
+			mosquitto__free(id);
+		}else{
+			link = context__init(db, -1);
+			if(!link){
+				mosquitto__free(id);
+				return MOSQ_ERR_NOMEM;
+			}
+			link->id = id;
+			HASH_ADD_KEYPTR(hh_id, db->contexts_by_id, link->id, strlen(link->id), link);
+		}
+		link->bridge = bridge;
+		link->bridge_main = context;
+		link->is_bridge = true;
+		link->protocol = context->protocol;
+#ifdef WITH_TLS
+		link->tls_cafile = bridge->tls_cafile;
+		link->tls_capath = bridge->tls_capath;
+		link->tls_certfile = bridge->tls_certfile;
+		link->tls_keyfile = bridge->tls_keyfile;
+		link->tls_cert_reqs = SSL_VERIFY_PEER;
+		link->tls_ocsp_required = bridge->tls_ocsp_required;
+		link->tls_version = bridge->tls_version;
+		link->tls_insecure = bridge->tls_insecure;
+		link->tls_alpn = bridge->tls_alpn;
+#ifdef FINAL_WITH_TLS_PSK
+		link->tls_psk_identity = bridge->tls_psk_identity;
+		link->tls_psk = bridge->tls_psk;
+#endif
+#endif
+		bridge->links[i].context = link;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int bridge__link_connect(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto__bridge *bridge = context->bridge;
+	int rc, rc2;
+#ifdef WITH_EPOLL
+	struct epoll_event ev;
+#endif
+
+	context__set_state(context, mosq_cs_new);
+	context->sock = INVALID_SOCKET;
+	context->last_msg_in = mosquitto_time();
+	context->next_msg_out = mosquitto_time() + bridge->keepalive;
+	context->keepalive = bridge->keepalive;
+	context->clean_start = bridge->clean_start;
+	context->in_packet.payload = NULL;
+	context->ping_t = 0;
+	bridge__packet_cleanup(context);
+	/* Outgoing messages of its shard queued while the link was down are
+	 * kept and sent first, even on a clean start, so none are lost or
+	 * overtaken. Only the remote's half finished ones are forgotten. */
+	if(context->clean_start){
+		db__messages_delete_list(db, &context->msgs_in.inflight);
+		db__messages_delete_list(db, &context->msgs_in.queued);
+	}
+	db__message_reconnect_reset(db, context);
+
+	log__printf(NULL, MOSQ_LOG_NOTICE, "Connecting bridge link %s (%s:%d)", context->id, bridge->addresses[bridge->cur_address].address, bridge->addresses[bridge->cur_address].port);
+	rc = net__socket_connect(context, bridge->addresses[bridge->cur_address].address, bridge->addresses[bridge->cur_address].port, NULL, false);
+	if(rc > 0){
+		if(rc == MOSQ_ERR_TLS){
+			net__socket_close(db, context);
+			return rc; /* Error already printed */
+		}else if(rc == MOSQ_ERR_ERRNO){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error creating bridge link: %s.", strerror(errno));
+		}else if(rc == MOSQ_ERR_EAI){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error creating bridge link: %s.", gai_strerror(errno));
+		}
+		return rc;
+	}else if(rc == MOSQ_ERR_CONN_PENDING){
+		context__set_state(context, mosq_cs_connect_pending);
+	}
+
+	HASH_ADD(hh_sock, db->contexts_by_sock, sock, sizeof(context->sock), context);
+	/* Not in this round's poll set, the next round picks it up. */
+	context->pollfd_index = -1;
+
+	rc2 = send__connect(db->stp, context, context->keepalive, context->clean_start, NULL);
+	if(rc2 && !(rc2 == MOSQ_ERR_ERRNO && errno == ENOTCONN)){
+		if(rc2 == MOSQ_ERR_ERRNO){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error creating bridge link: %s.", strerror(errno));
+		}
+		do_disconnect(db, context, rc2);
+		return rc2;
+	}
+
+#ifdef WITH_EPOLL
+	ev.data.fd = context->sock;
+	ev.events = EPOLLIN;
+	if(context->current_out_packet || context->state == mosq_cs_connect_pending){
+		ev.events |= EPOLLOUT;
+	}
+	if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1){
+		log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll registering bridge link: %s", strerror(errno));
+	}
+	context->events = ev.events;
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Called from the main loop while the bridge's own connection is up, to
+ * (re)connect the extra links. */
+void bridge__links_check(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto__bridge *bridge = context->bridge;
+	time_t now;
+	int i;
+
+	now = mosquitto_time();
+	for(i=0; i<bridge->link_count-1; i++){
+		if(bridge->links[i].context->sock != INVALID_SOCKET) continue;
+		if(now < bridge->links[i].restart_t) continue;
+
+		if(bridge__link_connect(db, bridge->links[i].context)){
+			bridge->links[i].restart_t = now + (bridge->restart_timeout > 1?bridge->restart_timeout:1);
+		}
+	}
+}
+
+
+/* The bundle only exists while the bridge's own connection does. */
+void bridge__links_disconnect(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto__bridge *bridge = context->bridge;
+	int i;
+
+	for(i=0; i<bridge->link_count-1; i++){
+		if(bridge->links[i].context->sock != INVALID_SOCKET){
+			do_disconnect(db, bridge->links[i].context, MOSQ_ERR_SUCCESS);
+		}
+		bridge->links[i].restart_t = 0;
+	}
+}
+
+
+void bridge__links_cleanup(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto__bridge *bridge = context->bridge;
+	int i;
+
+	if(!bridge->links) return;
+
+	for(i=0; i<bridge->link_count-1; i++){
+		if(!bridge->links[i].context) continue;
+		/* The bridge configuration belongs to the main context. */
+		bridge->links[i].context->bridge = NULL;
+		context__cleanup(db, bridge->links[i].context, true);
+	}
+	mosquitto__free(bridge->links);
+	bridge->links = NULL;
+}
+
+
+/* Pick the connection for an outgoing message from the dedup shard of its
+ * stamp. Every message of a shard goes the same way, so the receiving
+ * broker's duplicate filter sees them in order. A link that is down queues
+ * its messages until it is back, rather than letting later ones overtake
+ * them over another connection. */
+struct mosquitto *bridge__link_select(struct mosquitto *context, const struct mosquitto__stp_stamp *stamp)
+{
+	struct mosquitto__bridge *bridge = context->bridge;
+	int i;
+
+	if(!stamp->origin) return context;
+
+	i = STP_SEQ_SHARD(stamp->seq) % bridge->link_count;
+	if(i == 0) return context;
+
+	return bridge->links[i-1].context;
+}
+
 #endif
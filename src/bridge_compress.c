@@ -0,0 +1,267 @@
+/*
+Copyright (c) 2009-2019 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "mqtt_protocol.h"
+#include "packet_mosq.h"
+#include "read_handle.h"
+
+#ifdef WITH_BRIDGE
+#ifdef WITH_ZLIB
+#  include <zlib.h>
+#endif
+
+/* Compressed bridges.
+ *
+ * A broker that accepts compressed batches says so in its CONNACK. A bridge
+ * with bridge_compression set then holds back its PUBLISHes like
+ * write_batch_bytes does and, when it flushes, replaces each run of queued
+ * PUBLISHes with one QoS 0 PUBLISH on STP_COMPRESS_TOPIC. Its payload is
+ * the length of the run followed by the run compressed with zlib, so the
+ * packets inside are exactly those that would have gone on the wire. The
+ * receiving broker inflates the run and handles each packet in turn as if
+ * it had been read from the socket, acknowledgements included.
+ */
+
+/* Each connection of a bridge is agreed on separately. */
+void bridge__compress_connected(struct mosquitto_db *db, struct mosquitto *context, bool accepted)
+{
+	context->stp_compress = context->bridge->compression && accepted;
+	context->write_batch = db->config->write_batch_bytes;
+	if(context->stp_compress){
+		if(context->write_batch < STP_COMPRESS_BATCH){
+			context->write_batch = STP_COMPRESS_BATCH;
+		}
+		log__printf(NULL, MOSQ_LOG_INFO, "Compressing messages on bridge %s.", context->id);
+	}
+}
+
+
+#ifdef WITH_ZLIB
+static bool compress__candidate(const struct mosquitto__packet *packet)
+{
+	return ((packet->command)&0xF0) == CMD_PUBLISH && packet->pos == 0;
+}
+
+
+/* Build the batch for the packets from first up to, but not including, end.
+ * Returns NULL if that isn't worth it or can't be done, in which case the
+ * packets are sent as they are. */
+static struct mosquitto__packet *compress__batch(struct mosquitto *context, struct mosquitto__packet *first, struct mosquitto__packet *end, uint32_t bytes)
+{
+	struct mosquitto__packet *packet, *batch;
+	uint8_t *raw, *out;
+	uLongf out_len;
+	uint32_t pos = 0;
+	int rc;
+
+	raw = mosquitto__malloc(bytes);
+	if(!raw) return NULL;
+	for(packet = first; packet != end; packet = packet->next){
+		memcpy(&raw[pos], packet->payload, packet->packet_length);
+		pos += packet->packet_length;
+	}
+
+	out_len = compressBound(bytes);
+	out = mosquitto__malloc(out_len);
+	if(!out){
+		mosquitto__free(raw);
+		return NULL;
+	}
+	rc = compress2(out, &out_len, raw, bytes, context->bridge->compress_level);
+	mosquitto__free(raw);
+	if(rc != Z_OK || out_len + 4 >= bytes){
+		mosquitto__free(out);
+		return NULL;
+	}
+
+	batch = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+	if(!batch){
+		mosquitto__free(out);
+		return NULL;
+	}
+	batch->command = CMD_PUBLISH;
+	batch->remaining_length = 2 + strlen(STP_COMPRESS_TOPIC) + 4 + out_len;
+	if(context->protocol == mosq_p_mqtt5) batch->remaining_length++;
+	if(context->bridge->publish_stamp) batch->remaining_length += STP_STAMP_LEN;
+	if(packet__check_oversize(context, batch->remaining_length) || packet__alloc(batch)){
+		mosquitto__free(batch);
+		mosquitto__free(out);
+		return NULL;
+	}
+	packet__write_string(batch, STP_COMPRESS_TOPIC, strlen(STP_COMPRESS_TOPIC));
+	if(context->protocol == mosq_p_mqtt5){
+		packet__write_byte(batch, 0);
+	}
+	if(context->bridge->publish_stamp){
+		packet__write_uint64(batch, 0);
+		packet__write_uint64(batch, 0);
+	}
+	packet__write_uint32(batch, bytes);
+	packet__write_bytes(batch, out, out_len);
+	mosquitto__free(out);
+
+	batch->pos = 0;
+	batch->to_process = batch->packet_length;
+	return batch;
+}
+
+
+/* Only the packets queued since the last call are looked at, so nothing is
+ * compressed twice and a backed up queue isn't walked on every write. */
+void bridge__compress_queue(struct mosquitto *context)
+{
+	struct mosquitto__packet *prev, *packet, *first, *last = NULL, *next, *batch;
+	uint32_t bytes;
+	int count;
+
+	prev = context->compress_prev;
+	packet = context->compress_from;
+	context->compress_from = NULL;
+	context->compress_prev = NULL;
+	if(!context->stp_compress) return;
+
+	while(packet){
+		if(!compress__candidate(packet)){
+			prev = packet;
+			packet = packet->next;
+			continue;
+		}
+
+		first = packet;
+		bytes = 0;
+		count = 0;
+		while(packet && compress__candidate(packet) && bytes + packet->packet_length <= STP_COMPRESS_MAX){
+			bytes += packet->packet_length;
+			count++;
+			last = packet;
+			packet = packet->next;
+		}
+		if(count == 0){
+			/* Too large to go in a batch on its own. */
+			prev = packet;
+			packet = packet->next;
+			continue;
+		}
+		if(bytes < STP_COMPRESS_MIN){
+			prev = last;
+			continue;
+		}
+
+		batch = compress__batch(context, first, packet, bytes);
+		if(!batch){
+			prev = last;
+			continue;
+		}
+		batch->next = packet;
+		if(prev){
+			prev->next = batch;
+		}else{
+			context->out_packet = batch;
+		}
+		if(!packet){
+			context->out_packet_last = batch;
+		}
+		prev = batch;
+
+		while(first != packet){
+			next = first->next;
+			packet__cleanup(first);
+			mosquitto__free(first);
+			first = next;
+		}
+	}
+}
+
+
+/* Set while the packets of a batch are handled. Their bytes belong to the
+ * batch, so nothing may keep them. */
+static bool in_batch = false;
+
+bool bridge__compress_in_batch(void)
+{
+	return in_batch;
+}
+
+
+int bridge__compress_handle(struct mosquitto_db *db, struct mosquitto *context, const uint8_t *payload, uint32_t payloadlen)
+{
+	struct mosquitto__packet batch_packet;
+	uint8_t *raw;
+	uLongf raw_len;
+	uint32_t len, pos, remaining_length, mult;
+	uint8_t byte;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	/* Batches are never nested. */
+	if(in_batch || payloadlen < 4) return MOSQ_ERR_PROTOCOL;
+
+	len = ((uint32_t)payload[0]<<24) | ((uint32_t)payload[1]<<16) | ((uint32_t)payload[2]<<8) | payload[3];
+	if(len == 0 || len > STP_COMPRESS_MAX) return MOSQ_ERR_PROTOCOL;
+
+	raw = mosquitto__malloc(len);
+	if(!raw) return MOSQ_ERR_NOMEM;
+	raw_len = len;
+	if(uncompress(raw, &raw_len, &payload[4], payloadlen-4) != Z_OK || raw_len != len){
+		mosquitto__free(raw);
+		return MOSQ_ERR_PROTOCOL;
+	}
+
+	/* Each packet in the batch takes the place of the batch's own packet
+	 * while it is handled. */
+	batch_packet = context->in_packet;
+	memset(&context->in_packet, 0, sizeof(struct mosquitto__packet));
+	in_batch = true;
+	pos = 0;
+	while(pos < len && rc == MOSQ_ERR_SUCCESS){
+		context->in_packet.command = raw[pos++];
+		remaining_length = 0;
+		mult = 1;
+		do{
+			if(pos == len || mult > 128*128*128){
+				rc = MOSQ_ERR_PROTOCOL;
+				break;
+			}
+			byte = raw[pos++];
+			remaining_length += (byte & 127) * mult;
+			mult *= 128;
+		}while(byte & 128);
+		if(rc) break;
+
+		if(((context->in_packet.command)&0xF0) != CMD_PUBLISH || remaining_length > len - pos){
+			rc = MOSQ_ERR_PROTOCOL;
+			break;
+		}
+		context->in_packet.remaining_length = remaining_length;
+		context->in_packet.payload = &raw[pos];
+		context->in_packet.pos = 0;
+		rc = handle__publish(db, context);
+		pos += remaining_length;
+	}
+	in_batch = false;
+	context->in_packet = batch_packet;
+	mosquitto__free(raw);
+
+	return rc;
+}
+
+#endif
+#endif
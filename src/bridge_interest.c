@@ -0,0 +1,453 @@
+/*
+Copyright (c) 2009-2019 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "send_mosq.h"
+#include "time_mosq.h"
+#include "util_mosq.h"
+
+#ifdef WITH_BRIDGE
+
+/* Subscription aware forwarding.
+ *
+ * Each broker tells the brokers it bridges to which topics it wants, as a
+ * set of subscription filters: those of its own clients, plus everything
+ * the brokers behind its other forwarding ports have asked for. A port
+ * whose peer has not said anything yet counts as wanting everything, so
+ * brokers that don't take part still get every message. Only the changes
+ * since the last update go on the wire.
+ *
+ * The filters a peer has sent us are compiled into a filter tree, and a
+ * PUBLISH is only queued for the bridge towards that peer if it matches.
+ */
+
+static int filter__add(struct bridge__filter **set, const char *filter, size_t len)
+{
+	struct bridge__filter *f;
+
+	HASH_FIND(hh, *set, filter, len, f);
+	if(f) return MOSQ_ERR_SUCCESS;
+
+	f = mosquitto__calloc(1, sizeof(struct bridge__filter));
+	if(!f) return MOSQ_ERR_NOMEM;
+	f->filter = mosquitto__malloc(len+1);
+	if(!f->filter){
+		mosquitto__free(f);
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(f->filter, filter, len);
+	f->filter[len] = '\0';
+	HASH_ADD_KEYPTR(hh, *set, f->filter, len, f);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void filter__remove(struct bridge__filter **set, struct bridge__filter *f)
+{
+	HASH_DELETE(hh, *set, f);
+	mosquitto__free(f->filter);
+	mosquitto__free(f);
+}
+
+
+static void filter__set_free(struct bridge__filter **set)
+{
+	struct bridge__filter *f, *f_tmp;
+
+	HASH_ITER(hh, *set, f, f_tmp){
+		filter__remove(set, f);
+	}
+}
+
+
+static int filter__set_union(struct bridge__filter **set, struct bridge__filter *other)
+{
+	struct bridge__filter *f, *f_tmp;
+
+	HASH_ITER(hh, other, f, f_tmp){
+		if(filter__add(set, f->filter, strlen(f->filter))) return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* True if every topic matching filter also matches cover, which ends in
+ * '#'. Only the levels before the '#' have to be compared. */
+static bool filter__covered(const char *filter, const char *cover)
+{
+	const char *f = filter, *c = cover;
+	const char *f_end, *c_end;
+	size_t f_len, c_len;
+
+	if(!strcmp(filter, cover)) return false;
+
+	while(strcmp(c, "#")){
+		if(!f) return false;
+
+		c_end = strchr(c, '/');
+		if(!c_end) return false;
+		c_len = (size_t)(c_end-c);
+		f_end = strchr(f, '/');
+		f_len = f_end?(size_t)(f_end-f):strlen(f);
+
+		if(f_len == 1 && f[0] == '#') return false;
+		if(!(c_len == 1 && c[0] == '+')){
+			if(f_len != c_len || strncmp(f, c, c_len)) return false;
+		}
+		c = c_end+1;
+		f = f_end?f_end+1:NULL;
+	}
+	return true;
+}
+
+
+/* Drop the filters that another filter in the set already covers. */
+static void filter__set_collapse(struct bridge__filter **set)
+{
+	struct bridge__filter *f, *f_tmp, *c, *c_tmp;
+	size_t len;
+
+	HASH_ITER(hh, *set, c, c_tmp){
+		len = strlen(c->filter);
+		if(c->filter[len-1] != '#') continue;
+
+		HASH_ITER(hh, *set, f, f_tmp){
+			if(f != c && filter__covered(f->filter, c->filter)){
+				if(f == c_tmp) c_tmp = f->hh.next;
+				filter__remove(set, f);
+			}
+		}
+	}
+}
+
+
+/* Only subscriptions of ordinary clients are local interest. Those of our
+ * own bridges and of incoming bridges from other brokers are the mesh's. */
+static bool interest__local_client(const struct mosquitto *context)
+{
+	return context && !context->bridge && !context->stp_port && !context->is_bridge;
+}
+
+
+/* Add the filters of every subscription in the tree below hier that
+ * belongs to a client rather than to a bridge. */
+static int interest__local_add(struct bridge__filter **set, struct mosquitto__subhier *hier, const char *path)
+{
+	struct mosquitto__subhier *branch;
+	struct mosquitto__subshared *shared, *shared_tmp;
+	struct mosquitto__subleaf *leaf;
+	char *child;
+	size_t len;
+	uint32_t i;
+	bool wanted = false;
+
+	for(leaf = hier->subs; leaf && !wanted; leaf = leaf->next){
+		if(interest__local_client(leaf->context)) wanted = true;
+	}
+	HASH_ITER(hh, hier->shared, shared, shared_tmp){
+		for(leaf = shared->subs; leaf && !wanted; leaf = leaf->next){
+			if(interest__local_client(leaf->context)) wanted = true;
+		}
+	}
+	if(wanted && path){
+		if(filter__add(set, path, strlen(path))) return MOSQ_ERR_NOMEM;
+	}
+
+	for(i=0; i<hier->child_count; i++){
+		branch = hier->children[i].hier;
+		if(path){
+			len = strlen(path) + 1 + branch->topic_len + 1;
+			child = mosquitto__malloc(len);
+			if(!child) return MOSQ_ERR_NOMEM;
+			snprintf(child, len, "%s/%s", path, branch->topic);
+		}else{
+			child = mosquitto__strdup(branch->topic);
+			if(!child) return MOSQ_ERR_NOMEM;
+		}
+		if(interest__local_add(set, branch, child)){
+			mosquitto__free(child);
+			return MOSQ_ERR_NOMEM;
+		}
+		mosquitto__free(child);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int interest__record(uint8_t **buf, uint32_t *len, uint32_t *cap, uint8_t op, const char *filter)
+{
+	size_t flen = strlen(filter);
+	uint8_t *tmp;
+
+	if(*len + 3 + flen > *cap){
+		*cap = (*len + 3 + flen)*2;
+		tmp = mosquitto__realloc(*buf, *cap);
+		if(!tmp) return MOSQ_ERR_NOMEM;
+		*buf = tmp;
+	}
+	(*buf)[(*len)++] = op;
+	(*buf)[(*len)++] = (uint8_t)(flen >> 8);
+	(*buf)[(*len)++] = (uint8_t)(flen & 0xFF);
+	memcpy(&(*buf)[*len], filter, flen);
+	*len += flen;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Send the peer the difference between what it has been told and
+ * desired, which then becomes what it has been told. */
+static int interest__send(struct mosquitto *context, struct bridge__filter **desired)
+{
+	struct mosquitto__bridge *bridge = context->bridge;
+	struct bridge__filter *f, *f_tmp, *found;
+	uint8_t *buf = NULL;
+	uint32_t len = 0, cap = 0;
+	int added = 0, removed = 0;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	HASH_ITER(hh, bridge->advertised, f, f_tmp){
+		HASH_FIND(hh, *desired, f->filter, strlen(f->filter), found);
+		if(!found){
+			if(interest__record(&buf, &len, &cap, STP_INTEREST_REMOVE, f->filter)) goto error;
+			removed++;
+		}
+	}
+	HASH_ITER(hh, *desired, f, f_tmp){
+		HASH_FIND(hh, bridge->advertised, f->filter, strlen(f->filter), found);
+		if(!found){
+			if(interest__record(&buf, &len, &cap, STP_INTEREST_ADD, f->filter)) goto error;
+			added++;
+		}
+	}
+
+	if(len || !bridge->interest_synced){
+		log__printf(NULL, MOSQ_LOG_DEBUG, "Sending interest update to %s (%d added, %d removed)", context->id, added, removed);
+		rc = send__real_publish(context, 0, STP_INTEREST_TOPIC, len, buf, 0, false, false, NULL, NULL, 0, NULL);
+		bridge->interest_synced = true;
+	}
+	mosquitto__free(buf);
+
+	filter__set_free(&bridge->advertised);
+	bridge->advertised = *desired;
+	*desired = NULL;
+	return rc;
+
+error:
+	mosquitto__free(buf);
+	filter__set_free(desired);
+	return MOSQ_ERR_NOMEM;
+}
+
+
+/* Recompute what each bridged broker should be told and send the changes.
+ * Called once per pass of the main loop, at most every
+ * STP_INTEREST_HOLD_MS. */
+void bridge__interest_flush(struct mosquitto_db *db)
+{
+	struct mosquitto__subhier *root, *top = NULL;
+	struct bridge__filter *local = NULL, *desired;
+	struct mosquitto__bridge *bridge, *other;
+	uint64_t now;
+	int i, j;
+
+	if(!db->interest_dirty && db->interest_generation == db->stp_generation) return;
+
+	now = mosquitto_time_ms();
+	if(now - db->interest_sent_ms < STP_INTEREST_HOLD_MS) return;
+
+	db->interest_dirty = false;
+	db->interest_generation = db->stp_generation;
+	db->interest_sent_ms = now;
+
+	/* Don't walk the subscription tree for nobody. A bridge that connects
+	 * later marks the interest dirty again. */
+	for(i=0; i<db->bridge_count; i++){
+		if(db->bridges[i] && db->bridges[i]->state == mosq_cs_connected
+				&& db->bridges[i]->bridge->interest_adverts){
+			break;
+		}
+	}
+	if(i == db->bridge_count) return;
+
+	/* Subscriptions to $ topics are never forwarded on the tree, so only
+	 * the "" branch matters. Its first level is the empty token that
+	 * sub__topic_tokenise() puts in front of every other topic. */
+	HASH_FIND(hh, db->subs, "", 0, root);
+	if(root){
+		top = sub__child_find(root, "", 0);
+	}
+	if(top && interest__local_add(&local, top, NULL)){
+		filter__set_free(&local);
+		return;
+	}
+
+	for(i=0; i<db->bridge_count; i++){
+		if(!db->bridges[i]) continue;
+		bridge = db->bridges[i]->bridge;
+		if(db->bridges[i]->state != mosq_cs_connected || !bridge->interest_adverts) continue;
+
+		desired = NULL;
+		if(filter__set_union(&desired, local)) goto error;
+		for(j=0; j<db->bridge_count; j++){
+			if(j == i || !db->bridges[j]) continue;
+			other = db->bridges[j]->bridge;
+			if(!stp__port_forwarding(other)) continue;
+
+			if(other->interest_from){
+				if(filter__set_union(&desired, other->interest)) goto error;
+			}else{
+				if(filter__add(&desired, "#", 1)) goto error;
+			}
+		}
+		filter__set_collapse(&desired);
+
+		if(interest__send(db->bridges[i], &desired)){
+			db->interest_dirty = true;
+		}
+	}
+	filter__set_free(&local);
+	return;
+
+error:
+	filter__set_free(&desired);
+	filter__set_free(&local);
+	db->interest_dirty = true;
+}
+
+
+/* An interest update from the broker at the far end of context, which is
+ * an incoming bridge connection. */
+int bridge__interest_handle(struct mosquitto_db *db, struct mosquitto *context, const uint8_t *payload, uint32_t payloadlen)
+{
+	struct mosquitto__bridge *bridge = context->stp_port;
+	struct bridge__filter *f, *f_tmp;
+	uint32_t pos = 0;
+	uint16_t flen;
+	uint8_t op;
+	char *filter;
+	int rc;
+	int added = 0, removed = 0;
+
+	if(bridge->interest_from != context){
+		/* Updates on a new connection start from nothing. */
+		filter__set_free(&bridge->interest);
+		bridge->interest_from = context;
+	}
+
+	while(pos < payloadlen){
+		if(payloadlen - pos < 3) return MOSQ_ERR_PROTOCOL;
+		op = payload[pos];
+		flen = (uint16_t)((payload[pos+1] << 8) | payload[pos+2]);
+		pos += 3;
+		if(flen == 0 || flen > payloadlen - pos) return MOSQ_ERR_PROTOCOL;
+
+		if(op == STP_INTEREST_ADD){
+			filter = mosquitto__malloc(flen+1);
+			if(!filter) return MOSQ_ERR_NOMEM;
+			memcpy(filter, &payload[pos], flen);
+			filter[flen] = '\0';
+			if(mosquitto_sub_topic_check(filter) != MOSQ_ERR_SUCCESS){
+				mosquitto__free(filter);
+				return MOSQ_ERR_PROTOCOL;
+			}
+			rc = filter__add(&bridge->interest, filter, flen);
+			mosquitto__free(filter);
+			if(rc) return rc;
+			added++;
+		}else if(op == STP_INTEREST_REMOVE){
+			HASH_FIND(hh, bridge->interest, &payload[pos], flen, f);
+			if(f) filter__remove(&bridge->interest, f);
+			removed++;
+		}else{
+			return MOSQ_ERR_PROTOCOL;
+		}
+		pos += flen;
+	}
+
+	bridge__filter_tree_free(bridge->interest_tree);
+	bridge->interest_tree = NULL;
+	HASH_ITER(hh, bridge->interest, f, f_tmp){
+		if(bridge__filter_tree_add(&bridge->interest_tree, f->filter, 0)) return MOSQ_ERR_NOMEM;
+	}
+
+	log__printf(NULL, MOSQ_LOG_DEBUG, "Received interest update from %s (%d added, %d removed, %d filters)",
+			context->id, added, removed, HASH_COUNT(bridge->interest));
+	db->interest_dirty = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Does the broker at the far end of bridge want messages on topic? */
+bool bridge__interest_match(struct mosquitto__bridge *bridge, const char *topic)
+{
+	char *mapped = NULL;
+	bool match;
+
+	if(!bridge->interest_from || topic[0] == '$') return true;
+
+	if(bridge->topic_remapping){
+		if(bridge__remap_topic(bridge, bd_out, topic, &mapped)) return true;
+		if(mapped) topic = mapped;
+	}
+	match = bridge__filter_tree_match(bridge->interest_tree, topic) != -1;
+	mosquitto__free(mapped);
+	return match;
+}
+
+
+/* The bridge has connected, the peer gets our whole interest again. */
+void bridge__interest_connected(struct mosquitto_db *db, struct mosquitto__bridge *bridge, bool adverts)
+{
+	filter__set_free(&bridge->advertised);
+	bridge->interest_adverts = adverts;
+	bridge->interest_synced = false;
+	if(adverts){
+		db->interest_dirty = true;
+	}
+}
+
+
+/* Forget the peer's interest when the connection it came on goes. */
+void bridge__interest_disconnected(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto__bridge *bridge = context->stp_port;
+
+	if(!bridge || bridge->interest_from != context) return;
+
+	filter__set_free(&bridge->interest);
+	bridge__filter_tree_free(bridge->interest_tree);
+	bridge->interest_tree = NULL;
+	bridge->interest_from = NULL;
+	db->interest_dirty = true;
+}
+
+
+void bridge__interest_cleanup(struct mosquitto__bridge *bridge)
+{
+	filter__set_free(&bridge->advertised);
+	filter__set_free(&bridge->interest);
+	bridge__filter_tree_free(bridge->interest_tree);
+	bridge->interest_tree = NULL;
+	bridge->interest_from = NULL;
+}
+
+#endif
@@ -0,0 +1,482 @@
+/*
+Copyright (c) 2009-2019 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef WIN32
+#  include <dirent.h>
+#  include <sys/stat.h>
+#endif
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "mqtt_protocol.h"
+#include "sys_tree.h"
+#include "util_mosq.h"
+
+#ifdef WITH_BRIDGE
+
+/* Bridge spool.
+ *
+ * A bridge with bridge_spool_location set keeps at most bridge_spool_memory
+ * outgoing messages in memory. The rest are appended to a log of segment
+ * files, <location>/<connection name>.<segment>.spool, and read back into
+ * the queue as the bridge sends what it has. Segments are deleted once
+ * read. Segments left by a previous run are sent after a restart.
+ *
+ * Each record is a uint32 length followed by:
+ *   uint8 qos, uint8 retain, uint64 stamp origin, uint64 stamp seq,
+ *   uint16 source id length, source id, uint16 topic length, topic, payload
+ * all in network byte order. Message properties are not kept.
+ */
+
+#define SPOOL_RECORD_HEADER 20
+/* No PUBLISH makes a longer record, anything above is corrupt. */
+#define SPOOL_RECORD_MAX (SPOOL_RECORD_HEADER + UINT16_MAX + MQTT_MAX_PAYLOAD)
+
+
+static void spool__write_uint16(uint8_t *buf, uint16_t value)
+{
+	buf[0] = (uint8_t)(value >> 8);
+	buf[1] = (uint8_t)(value & 0xFF);
+}
+
+
+static void spool__write_uint64(uint8_t *buf, uint64_t value)
+{
+	int i;
+
+	for(i=7; i>=0; i--){
+		buf[i] = (uint8_t)(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+
+static uint16_t spool__read_uint16(const uint8_t *buf)
+{
+	return (uint16_t)((buf[0] << 8) | buf[1]);
+}
+
+
+static uint64_t spool__read_uint64(const uint8_t *buf)
+{
+	uint64_t value = 0;
+	int i;
+
+	for(i=0; i<8; i++){
+		value = (value << 8) | buf[i];
+	}
+	return value;
+}
+
+
+static char *spool__segment_path(struct bridge__spool *spool, unsigned int segment)
+{
+	char *path;
+	size_t len;
+
+	len = strlen(spool->prefix) + 16;
+	path = mosquitto__malloc(len);
+	if(!path) return NULL;
+	snprintf(path, len, "%s%08u.spool", spool->prefix, segment);
+	return path;
+}
+
+
+/* Find the segments a previous run left behind. */
+static void spool__scan(struct mosquitto__bridge *bridge, struct bridge__spool *spool)
+{
+#ifndef WIN32
+	DIR *dh;
+	struct dirent *de;
+	struct stat st;
+	char *path;
+	size_t name_len;
+	unsigned int segment;
+	bool found = false;
+	char tail[8];
+
+	dh = opendir(bridge->spool_location);
+	if(!dh) return;
+
+	name_len = strlen(bridge->name);
+	while((de = readdir(dh)) != NULL){
+		if(strncmp(de->d_name, bridge->name, name_len) || de->d_name[name_len] != '.'){
+			continue;
+		}
+		if(sscanf(&de->d_name[name_len+1], "%u%7s", &segment, tail) != 2 || strcmp(tail, ".spool")){
+			continue;
+		}
+		path = spool__segment_path(spool, segment);
+		if(path && !stat(path, &st)){
+			spool->bytes += (uint64_t)st.st_size;
+			if(!found || segment < spool->rseg) spool->rseg = segment;
+			if(!found || segment >= spool->wseg) spool->wseg = segment+1;
+			found = true;
+		}
+		mosquitto__free(path);
+	}
+	closedir(dh);
+
+	if(spool->bytes){
+		log__printf(NULL, MOSQ_LOG_NOTICE, "Bridge %s has %llu bytes of spooled messages to send.",
+				bridge->name, (unsigned long long)spool->bytes);
+	}
+#else
+	(void)bridge;
+	(void)spool;
+#endif
+}
+
+
+int bridge__spool_open(struct mosquitto__bridge *bridge)
+{
+	struct bridge__spool *spool;
+	size_t len;
+
+	spool = mosquitto__calloc(1, sizeof(struct bridge__spool));
+	if(!spool) return MOSQ_ERR_NOMEM;
+
+	len = strlen(bridge->spool_location) + 1 + strlen(bridge->name) + 2;
+	spool->prefix = mosquitto__malloc(len);
+	if(!spool->prefix){
+		mosquitto__free(spool);
+		return MOSQ_ERR_NOMEM;
+	}
+	snprintf(spool->prefix, len, "%s/%s.", bridge->spool_location, bridge->name);
+
+	spool__scan(bridge, spool);
+	bridge->spool = spool;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void bridge__spool_close(struct mosquitto__bridge *bridge)
+{
+	struct bridge__spool *spool = bridge->spool;
+
+	if(!spool) return;
+
+	if(spool->wfile) fclose(spool->wfile);
+	if(spool->rfile) fclose(spool->rfile);
+	mosquitto__free(spool->prefix);
+	mosquitto__free(spool);
+	bridge->spool = NULL;
+}
+
+
+static void spool__drop(struct mosquitto__bridge *bridge, const char *reason)
+{
+	/* The peer's retained messages may be out of date now. */
+	bridge->peer_stale = true;
+	if(!bridge->spool->dropping){
+		bridge->spool->dropping = true;
+		log__printf(NULL, MOSQ_LOG_NOTICE, "Outgoing messages are being dropped for bridge %s (%s).", bridge->name, reason);
+	}
+	G_MSGS_DROPPED_INC();
+}
+
+
+/* Append a message to the spool. Returns 2 if it had to be dropped. */
+int bridge__spool_write(struct mosquitto__bridge *bridge, struct mosquitto_msg_store *stored, int qos, bool retain)
+{
+	struct bridge__spool *spool = bridge->spool;
+	uint8_t header[4+SPOOL_RECORD_HEADER];
+	uint8_t len16[2];
+	size_t source_len, topic_len;
+	uint32_t record_len;
+	char *path;
+
+	source_len = stored->source_id?strlen(stored->source_id):0;
+	topic_len = strlen(stored->topic);
+	record_len = SPOOL_RECORD_HEADER + (uint32_t)source_len + 2 + (uint32_t)topic_len + stored->payloadlen;
+
+	if(bridge->spool_max_size && spool->bytes + 4 + record_len > bridge->spool_max_size){
+		spool__drop(bridge, "spool full");
+		return 2;
+	}
+
+	if(!spool->wfile){
+		path = spool__segment_path(spool, spool->wseg);
+		if(!path){
+			spool__drop(bridge, "out of memory");
+			return 2;
+		}
+		spool->wfile = mosquitto__fopen(path, "ab", false);
+		mosquitto__free(path);
+		if(!spool->wfile){
+			spool__drop(bridge, strerror(errno));
+			return 2;
+		}
+	}
+
+	header[0] = (uint8_t)(record_len >> 24);
+	header[1] = (uint8_t)((record_len >> 16) & 0xFF);
+	header[2] = (uint8_t)((record_len >> 8) & 0xFF);
+	header[3] = (uint8_t)(record_len & 0xFF);
+	header[4] = (uint8_t)qos;
+	header[5] = retain;
+	spool__write_uint64(&header[6], stored->stamp.origin);
+	spool__write_uint64(&header[14], stored->stamp.seq);
+	spool__write_uint16(&header[22], (uint16_t)source_len);
+
+	spool__write_uint16(len16, (uint16_t)topic_len);
+	if(fwrite(header, 1, sizeof(header), spool->wfile) != sizeof(header)
+			|| fwrite(stored->source_id, 1, source_len, spool->wfile) != source_len
+			|| fwrite(len16, 1, 2, spool->wfile) != 2
+			|| fwrite(stored->topic, 1, topic_len, spool->wfile) != topic_len
+			|| fwrite(UHPA_ACCESS_PAYLOAD(stored), 1, stored->payloadlen, spool->wfile) != stored->payloadlen){
+
+		/* Start a new segment rather than append after a torn record. */
+		fclose(spool->wfile);
+		spool->wfile = NULL;
+		spool->wseg++;
+		spool__drop(bridge, "write error");
+		return 2;
+	}
+	spool->bytes += 4 + record_len;
+	spool->dropping = false;
+
+	if(ftell(spool->wfile) >= BRIDGE_SPOOL_SEGMENT_SIZE){
+		fclose(spool->wfile);
+		spool->wfile = NULL;
+		spool->wseg++;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Open the oldest segment for reading. The segment being appended to is
+ * closed first, so reads never see a half written record. */
+static int spool__read_open(struct bridge__spool *spool)
+{
+	char *path;
+
+	while(!spool->rfile){
+		if(spool->rseg == spool->wseg){
+			if(!spool->wfile) return 1;
+			fclose(spool->wfile);
+			spool->wfile = NULL;
+			spool->wseg++;
+		}
+		path = spool__segment_path(spool, spool->rseg);
+		if(!path) return 1;
+		spool->rfile = mosquitto__fopen(path, "rb", false);
+		if(!spool->rfile){
+			spool->rseg++;
+		}
+		mosquitto__free(path);
+	}
+	return 0;
+}
+
+
+/* Done with the oldest segment, whatever is left of it is lost. */
+static void spool__read_next(struct bridge__spool *spool)
+{
+	char *path;
+	long pos;
+
+	pos = ftell(spool->rfile);
+	if(fseek(spool->rfile, 0, SEEK_END) == 0 && ftell(spool->rfile) > pos){
+		spool->bytes -= (uint64_t)(ftell(spool->rfile) - pos);
+	}
+	fclose(spool->rfile);
+	spool->rfile = NULL;
+
+	path = spool__segment_path(spool, spool->rseg);
+	if(path){
+		remove(path);
+		mosquitto__free(path);
+	}
+	spool->rseg++;
+	if(spool->rseg == spool->wseg && !spool->wfile){
+		spool->bytes = 0;
+	}
+}
+
+
+/* Put a record back in the queue of the bridge. Returns 2 without touching
+ * the queue if it has no room for the message, the record must then stay
+ * in the spool. A message the queue drops regardless is gone like any other
+ * dropped message. */
+static int spool__requeue(struct mosquitto_db *db, struct mosquitto *context, uint8_t *record, uint32_t record_len)
+{
+	struct mosquitto_msg_store *stored;
+	struct mosquitto *target;
+	struct mosquitto__stp_stamp stamp;
+	mosquitto__payload_uhpa payload;
+	uint16_t source_len, topic_len, mid;
+	uint32_t pos, payloadlen;
+	char *source_id, *topic;
+	int qos;
+	bool retain;
+	int rc;
+
+	if(record_len < SPOOL_RECORD_HEADER) return MOSQ_ERR_MALFORMED_PACKET;
+	qos = record[0];
+	retain = record[1];
+	stamp.origin = spool__read_uint64(&record[2]);
+	stamp.seq = spool__read_uint64(&record[10]);
+	source_len = spool__read_uint16(&record[18]);
+	pos = SPOOL_RECORD_HEADER;
+	if(qos > 2 || pos + source_len + 2 > record_len) return MOSQ_ERR_MALFORMED_PACKET;
+	pos += source_len;
+	topic_len = spool__read_uint16(&record[pos]);
+	pos += 2;
+	if(topic_len == 0 || pos + topic_len > record_len) return MOSQ_ERR_MALFORMED_PACKET;
+
+	/* The connection db__message_insert() will pick. */
+	target = context;
+	if(context->bridge->link_count > 1){
+		target = bridge__link_select(context, &stamp);
+	}
+	if(!db__message_insert_ready(db, target, qos)){
+		return 2;
+	}
+
+	source_id = mosquitto__malloc(source_len+1);
+	topic = mosquitto__malloc(topic_len+1);
+	if(!source_id || !topic){
+		mosquitto__free(source_id);
+		mosquitto__free(topic);
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(source_id, &record[SPOOL_RECORD_HEADER], source_len);
+	source_id[source_len] = '\0';
+	memcpy(topic, &record[pos], topic_len);
+	topic[topic_len] = '\0';
+	pos += topic_len;
+
+	payloadlen = record_len - pos;
+	payload.ptr = NULL;
+	if(UHPA_ALLOC(payload, payloadlen) == 0){
+		mosquitto__free(source_id);
+		mosquitto__free(topic);
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(UHPA_ACCESS(payload, payloadlen), &record[pos], payloadlen);
+
+	if(db__message_store(db, NULL, 0, topic, qos, payloadlen, &payload, NULL, retain, &stored, 0, NULL, 0, mosq_mo_broker)){
+		mosquitto__free(source_id);
+		return MOSQ_ERR_NOMEM;
+	}
+	mosquitto__free(stored->source_id);
+	stored->source_id = source_id;
+	stored->stamp = stamp;
+
+	mid = qos?mosquitto__mid_generate(context):0;
+	db__msg_store_ref_inc(stored);
+	rc = db__message_insert(db, context, mid, mosq_md_out, qos, retain, stored, NULL);
+	db__msg_store_ref_dec(db, &stored);
+	return rc == 1?MOSQ_ERR_NOMEM:MOSQ_ERR_SUCCESS;
+}
+
+
+/* Move spooled messages back into the queue of a connected bridge, as many
+ * as bridge_spool_memory and the queue limits allow. Called on every pass
+ * of the main loop. */
+void bridge__spool_drain(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto__bridge *bridge = context->bridge;
+	struct bridge__spool *spool = bridge->spool;
+	uint8_t len_buf[4];
+	uint8_t *record;
+	uint32_t record_len;
+	int count = 0;
+	int rc;
+	int i;
+
+	if(!spool->bytes || !stp__port_forwarding(bridge)) return;
+
+	spool->draining = true;
+	while(spool->bytes && count < bridge->spool_memory
+			&& context->msgs_out.msg_count < bridge->spool_memory){
+		if(spool__read_open(spool)){
+			spool->bytes = 0;
+			break;
+		}
+		if(fread(len_buf, 1, 4, spool->rfile) != 4){
+			spool__read_next(spool);
+			continue;
+		}
+		record_len = ((uint32_t)len_buf[0] << 24) | ((uint32_t)len_buf[1] << 16)
+				| ((uint32_t)len_buf[2] << 8) | len_buf[3];
+		if(record_len > SPOOL_RECORD_MAX || 4 + (uint64_t)record_len > spool->bytes){
+			/* Nothing after it can be found either. */
+			log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Skipping corrupt segment in spool of bridge %s.", bridge->name);
+			spool->bytes = spool->bytes > 4?spool->bytes - 4:0;
+			spool__read_next(spool);
+			bridge->peer_stale = true;
+			continue;
+		}
+
+		record = mosquitto__malloc(record_len);
+		if(!record){
+			/* Skip it rather than fail on it again every pass. */
+			if(fseek(spool->rfile, (long)record_len, SEEK_CUR)){
+				spool__read_next(spool);
+				continue;
+			}
+			spool__drop(bridge, "out of memory");
+			spool->bytes -= 4 + record_len;
+			count++;
+			continue;
+		}
+		if(fread(record, 1, record_len, spool->rfile) != record_len){
+			mosquitto__free(record);
+			spool__read_next(spool);
+			continue;
+		}
+		rc = spool__requeue(db, context, record, record_len);
+		mosquitto__free(record);
+		if(rc == 2){
+			/* No room in the queue, read it again on a later pass. */
+			fseek(spool->rfile, -(long)(4 + record_len), SEEK_CUR);
+			break;
+		}else if(rc == MOSQ_ERR_MALFORMED_PACKET){
+			log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Skipping corrupt record in spool of bridge %s.", bridge->name);
+			bridge->peer_stale = true;
+		}else if(rc){
+			bridge->peer_stale = true;
+		}
+		spool->bytes -= 4 + record_len;
+		count++;
+	}
+	spool->draining = false;
+
+	if(spool->rfile && !spool->bytes){
+		spool__read_next(spool);
+	}
+	if(count){
+		log__printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s requeued %d spooled messages, %llu bytes left.",
+				bridge->name, count, (unsigned long long)spool->bytes);
+
+		/* Send them now rather than on the next pass of the main loop. */
+		db__message_write(db, context);
+		for(i=0; i<bridge->link_count-1; i++){
+			if(bridge->links[i].context && bridge->links[i].context->state == mosq_cs_connected){
+				db__message_write(db, bridge->links[i].context);
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,258 @@
+/*
+Copyright (c) 2009-2019 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+
+#ifdef WITH_BRIDGE
+
+/* Bridge topic remapping.
+ *
+ * The topics of a bridge that have a prefix are compiled into two tries of
+ * topic levels, one for incoming and one for outgoing messages, so finding
+ * the rule for a message costs one lookup per topic level whatever the
+ * number of topics configured. Each node remembers the first matching topic
+ * in configuration order, which keeps the first-match behaviour of the
+ * configuration file. The same trees hold the subscription filters that
+ * bridged brokers advertise, see bridge_interest.c.
+ */
+struct bridge__remap_node{
+	UT_hash_handle hh;
+	char *level;
+	struct bridge__remap_node *children;
+	struct bridge__remap_node *plus;
+	int topic; /* Index of the first topic ending here, -1 if none */
+	int hash; /* Index of the first topic ending in '#' here, -1 if none */
+};
+
+
+static struct bridge__remap_node *remap__node_new(const char *level, size_t len)
+{
+	struct bridge__remap_node *node;
+
+	node = mosquitto__calloc(1, sizeof(struct bridge__remap_node));
+	if(!node) return NULL;
+
+	if(level){
+		node->level = mosquitto__malloc(len+1);
+		if(!node->level){
+			mosquitto__free(node);
+			return NULL;
+		}
+		memcpy(node->level, level, len);
+		node->level[len] = '\0';
+	}
+	node->topic = -1;
+	node->hash = -1;
+	return node;
+}
+
+
+void bridge__filter_tree_free(struct bridge__remap_node *node)
+{
+	struct bridge__remap_node *child, *child_tmp;
+
+	if(!node) return;
+
+	HASH_ITER(hh, node->children, child, child_tmp){
+		HASH_DELETE(hh, node->children, child);
+		bridge__filter_tree_free(child);
+	}
+	bridge__filter_tree_free(node->plus);
+	mosquitto__free(node->level);
+	mosquitto__free(node);
+}
+
+
+/* Add the subscription filter sub to the tree at *root. index is what a
+ * match returns, the lowest index wins when several filters match. */
+int bridge__filter_tree_add(struct bridge__remap_node **root, const char *sub, int index)
+{
+	struct bridge__remap_node *node, *child;
+	const char *level, *end;
+	size_t len;
+
+	if(!*root){
+		*root = remap__node_new(NULL, 0);
+		if(!*root) return MOSQ_ERR_NOMEM;
+	}
+	node = *root;
+
+	level = sub;
+	while(1){
+		end = strchr(level, '/');
+		len = end?(size_t)(end-level):strlen(level);
+
+		if(len == 1 && level[0] == '#'){
+			if(node->hash == -1) node->hash = index;
+			return MOSQ_ERR_SUCCESS;
+		}else if(len == 1 && level[0] == '+'){
+			if(!node->plus){
+				node->plus = remap__node_new(level, len);
+				if(!node->plus) return MOSQ_ERR_NOMEM;
+			}
+			child = node->plus;
+		}else{
+			HASH_FIND(hh, node->children, level, len, child);
+			if(!child){
+				child = remap__node_new(level, len);
+				if(!child) return MOSQ_ERR_NOMEM;
+				HASH_ADD_KEYPTR(hh, node->children, child->level, len, child);
+			}
+		}
+		node = child;
+
+		if(!end) break;
+		level = end+1;
+	}
+	if(node->topic == -1) node->topic = index;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* level is the start of the next topic level, or NULL once the topic has
+ * been used up. Wildcards don't match a first level starting with '$'. */
+static void remap__match(struct bridge__remap_node *node, const char *level, bool dollar, int *best)
+{
+	struct bridge__remap_node *child;
+	const char *end;
+	size_t len;
+
+	if(node->hash != -1 && !dollar && (*best == -1 || node->hash < *best)){
+		*best = node->hash;
+	}
+	if(!level){
+		if(node->topic != -1 && (*best == -1 || node->topic < *best)){
+			*best = node->topic;
+		}
+		return;
+	}
+
+	end = strchr(level, '/');
+	len = end?(size_t)(end-level):strlen(level);
+
+	HASH_FIND(hh, node->children, level, len, child);
+	if(child){
+		remap__match(child, end?end+1:NULL, false, best);
+	}
+	if(node->plus && !dollar){
+		remap__match(node->plus, end?end+1:NULL, false, best);
+	}
+}
+
+
+/* Index of the first filter in the tree that matches topic, or -1. */
+int bridge__filter_tree_match(struct bridge__remap_node *root, const char *topic)
+{
+	int best = -1;
+
+	if(root){
+		remap__match(root, topic, topic[0] == '$', &best);
+	}
+	return best;
+}
+
+
+int bridge__remap_compile(struct mosquitto__bridge *bridge)
+{
+	struct mosquitto__bridge_topic *cur_topic;
+	int i;
+
+	bridge__remap_cleanup(bridge);
+
+	for(i=0; i<bridge->topic_count; i++){
+		cur_topic = &bridge->topics[i];
+		cur_topic->local_prefix_len = cur_topic->local_prefix?strlen(cur_topic->local_prefix):0;
+		cur_topic->remote_prefix_len = cur_topic->remote_prefix?strlen(cur_topic->remote_prefix):0;
+
+		if(!cur_topic->local_prefix && !cur_topic->remote_prefix){
+			continue;
+		}
+		if(cur_topic->direction == bd_both || cur_topic->direction == bd_in){
+			if(bridge__filter_tree_add(&bridge->remap_in, cur_topic->remote_topic, i)){
+				bridge__remap_cleanup(bridge);
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		if(cur_topic->direction == bd_both || cur_topic->direction == bd_out){
+			if(bridge__filter_tree_add(&bridge->remap_out, cur_topic->local_topic, i)){
+				bridge__remap_cleanup(bridge);
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void bridge__remap_cleanup(struct mosquitto__bridge *bridge)
+{
+	bridge__filter_tree_free(bridge->remap_in);
+	bridge__filter_tree_free(bridge->remap_out);
+	bridge->remap_in = NULL;
+	bridge->remap_out = NULL;
+}
+
+
+/* Incoming messages have the remote prefix removed and the local prefix
+ * added, outgoing messages the other way round. *mapped is set to NULL if no
+ * topic applies to the message. */
+int bridge__remap_topic(struct mosquitto__bridge *bridge, enum mosquitto__bridge_direction direction, const char *topic, char **mapped)
+{
+	struct mosquitto__bridge_topic *cur_topic;
+	const char *strip, *add;
+	size_t strip_len, add_len, len;
+	int best;
+
+	*mapped = NULL;
+
+	best = bridge__filter_tree_match((direction == bd_in)?bridge->remap_in:bridge->remap_out, topic);
+	if(best == -1) return MOSQ_ERR_SUCCESS;
+
+	cur_topic = &bridge->topics[best];
+	if(direction == bd_in){
+		strip = cur_topic->remote_prefix;
+		strip_len = cur_topic->remote_prefix_len;
+		add = cur_topic->local_prefix;
+		add_len = cur_topic->local_prefix_len;
+	}else{
+		strip = cur_topic->local_prefix;
+		strip_len = cur_topic->local_prefix_len;
+		add = cur_topic->remote_prefix;
+		add_len = cur_topic->remote_prefix_len;
+	}
+
+	if(strip && !strncmp(strip, topic, strip_len)){
+		topic += strip_len;
+	}
+	len = strlen(topic);
+
+	*mapped = mosquitto__malloc(add_len + len + 1);
+	if(!*mapped) return MOSQ_ERR_NOMEM;
+
+	if(add_len){
+		memcpy(*mapped, add, add_len);
+	}
+	memcpy(&(*mapped)[add_len], topic, len+1);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+#endif
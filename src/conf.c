@@ -230,6 +230,9 @@ static void config__init_reload(struct mosquitto_db *db, struct mosquitto__confi
 	config->set_tcp_nodelay = false;
 	config->sys_interval = 10;
 	config->upgrade_outgoing_qos = false;
+	config->write_batch_bytes = 0;
+	config->match_cache_bytes = 0;
+	config->zero_copy_bytes = 0;
 
 	config__cleanup_plugins(config);
 }
@@ -274,6 +277,9 @@ void config__init(struct mosquitto_db *db, struct mosquitto__config *config)
 	config->default_listener.security_options.allow_anonymous = -1;
 	config->default_listener.maximum_qos = 2;
 	config->default_listener.max_topic_alias = 10;
+#ifdef WITH_BRIDGE
+	config->stp_priority = STP_PRIORITY_DEFAULT;
+#endif
 }
 
 void config__cleanup(struct mosquitto__config *config)
@@ -353,6 +359,10 @@ void config__cleanup(struct mosquitto__config *config)
 				}
 				mosquitto__free(config->bridges[i].topics);
 			}
+			bridge__remap_cleanup(&config->bridges[i]);
+			bridge__interest_cleanup(&config->bridges[i]);
+			bridge__spool_close(&config->bridges[i]);
+			mosquitto__free(config->bridges[i].spool_location);
 			mosquitto__free(config->bridges[i].notification_topic);
 #ifdef WITH_TLS
 			mosquitto__free(config->bridges[i].tls_version);
@@ -468,6 +478,8 @@ int config__parse_args(struct mosquitto_db *db, struct mosquitto__config *config
 			|| config->default_listener.mount_point
 			|| config->default_listener.protocol != mp_mqtt
 			|| config->default_listener.socket_domain
+			|| config->default_listener.listen_backlog
+			|| config->default_listener.reuse_port
 			|| config->default_listener.security_options.password_file
 			|| config->default_listener.security_options.psk_file
 			|| config->default_listener.security_options.auth_plugin_config_count
@@ -499,6 +511,8 @@ int config__parse_args(struct mosquitto_db *db, struct mosquitto__config *config
 		config->listeners[config->listener_count-1].max_connections = config->default_listener.max_connections;
 		config->listeners[config->listener_count-1].protocol = config->default_listener.protocol;
 		config->listeners[config->listener_count-1].socket_domain = config->default_listener.socket_domain;
+		config->listeners[config->listener_count-1].listen_backlog = config->default_listener.listen_backlog;
+		config->listeners[config->listener_count-1].reuse_port = config->default_listener.reuse_port;
 		config->listeners[config->listener_count-1].client_count = 0;
 		config->listeners[config->listener_count-1].socks = NULL;
 		config->listeners[config->listener_count-1].sock_count = 0;
@@ -601,6 +615,9 @@ void config__copy(struct mosquitto__config *src, struct mosquitto__config *dest)
 	dest->queue_qos0_messages = src->queue_qos0_messages;
 	dest->sys_interval = src->sys_interval;
 	dest->upgrade_outgoing_qos = src->upgrade_outgoing_qos;
+	dest->write_batch_bytes = src->write_batch_bytes;
+	dest->match_cache_bytes = src->match_cache_bytes;
+	dest->zero_copy_bytes = src->zero_copy_bytes;
 
 #ifdef WITH_WEBSOCKETS
 	dest->websockets_log_level = src->websockets_log_level;
@@ -1042,6 +1059,49 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 					if(conf__parse_string(&token, "bridge_certfile", &cur_bridge->tls_certfile, saveptr)) return MOSQ_ERR_INVAL;
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge and/or TLS support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_compression")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "none")){
+							cur_bridge->compression = false;
+						}else if(!strcmp(token, "zlib")){
+#ifdef WITH_ZLIB
+							cur_bridge->compression = true;
+#else
+							log__printf(NULL, MOSQ_LOG_WARNING, "Warning: zlib support not available.");
+#endif
+						}else{
+							log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge_compression value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty bridge_compression value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_compression_level")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(conf__parse_int(&token, "bridge_compression_level", &cur_bridge->compress_level, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->compress_level < 1 || cur_bridge->compress_level > 9){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: bridge_compression_level must be between 1 and 9.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
 				}else if(!strcmp(token, "bridge_identity")){
 #if defined(WITH_BRIDGE) && defined(FINAL_WITH_TLS_PSK)
@@ -1099,6 +1159,69 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 					if(conf__parse_string(&token, "bridge_keyfile", &cur_bridge->tls_keyfile, saveptr)) return MOSQ_ERR_INVAL;
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge and/or TLS support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_links")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(conf__parse_int(&token, "bridge_links", &cur_bridge->link_count, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->link_count < 1 || cur_bridge->link_count > BRIDGE_LINKS_MAX){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: bridge_links must be between 1 and %d.", BRIDGE_LINKS_MAX);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_spool_location")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(conf__parse_string(&token, "bridge_spool_location", &cur_bridge->spool_location, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_spool_max_size")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						char *endptr;
+						cur_bridge->spool_max_size = strtoul(token, &endptr, 10);
+						if(token[0] == '-' || endptr == token || *endptr != '\0'){
+							log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge_spool_max_size value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty bridge_spool_max_size value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_spool_memory")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(conf__parse_int(&token, "bridge_spool_memory", &cur_bridge->spool_memory, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->spool_memory < 1){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: bridge_spool_memory must be at least 1.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
 				}else if(!strcmp(token, "bridge_protocol_version")){
 #ifdef WITH_BRIDGE
@@ -1256,6 +1379,10 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 						cur_bridge->attempt_unsubscribe = true;
 						cur_bridge->protocol_version = mosq_p_mqtt311;
 						cur_bridge->primary_retry_sock = INVALID_SOCKET;
+						cur_bridge->path_cost = STP_PATH_COST_DEFAULT;
+						cur_bridge->link_count = 1;
+						cur_bridge->spool_memory = BRIDGE_SPOOL_MEMORY_DEFAULT;
+						cur_bridge->compress_level = STP_COMPRESS_LEVEL_DEFAULT;
 					}else{
 						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty connection value in configuration.");
 						return MOSQ_ERR_INVAL;
@@ -1355,6 +1482,13 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
 #endif
+				}else if(!strcmp(token, "listen_backlog")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(conf__parse_int(&token, "listen_backlog", &cur_listener->listen_backlog, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->listen_backlog < 1){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: listen_backlog must be at least 1.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "listener")){
 					token = strtok_r(NULL, " ", &saveptr);
 					if(token){
@@ -1574,6 +1708,12 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 					}else{
 						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_connections value in configuration.");
 					}
+				}else if(!strcmp(token, "match_cache_bytes")){
+					if(conf__parse_int(&token, "match_cache_bytes", &config->match_cache_bytes, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->match_cache_bytes < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid match_cache_bytes value (%d).", config->match_cache_bytes);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "maximum_qos")){
 					if(reload) continue; // Listeners not valid for reloading.
 					if(conf__parse_int(&token, "maximum_qos", &tmp_int, saveptr)) return MOSQ_ERR_INVAL;
@@ -1847,6 +1987,14 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 					if(conf__parse_bool(&token, token, &config->retain_available, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "retry_interval")){
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: The retry_interval option is no longer available.");
+				}else if(!strcmp(token, "reuse_port")){
+#ifdef SO_REUSEPORT
+					if(reload) continue; // Listeners not valid for reloading.
+					if(conf__parse_bool(&token, "reuse_port", &cur_listener->reuse_port, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					log__printf(NULL, MOSQ_LOG_ERR, "Error: reuse_port specified but socket option not available.");
+					return MOSQ_ERR_INVAL;
+#endif
 				}else if(!strcmp(token, "round_robin")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1907,6 +2055,67 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 					}
 				}else if(!strcmp(token, "store_clean_interval")){
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: store_clean_interval is no longer needed.");
+				}else if(!strcmp(token, "stp_mode")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "stp")){
+							config->stp_rapid = false;
+						}else if(!strcmp(token, "rstp")){
+							config->stp_rapid = true;
+						}else{
+							log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid stp_mode value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty stp_mode value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "stp_path_cost")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(conf__parse_int(&token, "stp_path_cost", &cur_bridge->path_cost, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->path_cost < 1 || cur_bridge->path_cost > 65535){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: stp_path_cost must be between 1 and 65535.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "stp_resume_timeout")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(conf__parse_int(&token, "stp_resume_timeout", &cur_bridge->resume_timeout, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->resume_timeout < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: stp_resume_timeout must not be negative.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "stp_priority")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // Priority is fixed once the tree has been built.
+					if(conf__parse_int(&token, "stp_priority", &config->stp_priority, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->stp_priority < 0 || config->stp_priority > STP_PRIORITY_MAX){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: stp_priority must be between 0 and %d.", STP_PRIORITY_MAX);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
 				}else if(!strcmp(token, "sys_interval")){
 					if(conf__parse_int(&token, "sys_interval", &config->sys_interval, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->sys_interval < 0 || config->sys_interval > 65535){
@@ -2189,6 +2398,18 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Websockets support not available.");
 #endif
+				}else if(!strcmp(token, "write_batch_bytes")){
+					if(conf__parse_int(&token, "write_batch_bytes", &config->write_batch_bytes, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->write_batch_bytes < 0 || config->write_batch_bytes > WRITE_BATCH_BYTES_MAX){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: write_batch_bytes must be between 0 and %d.", WRITE_BATCH_BYTES_MAX);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "zero_copy_bytes")){
+					if(conf__parse_int(&token, "zero_copy_bytes", &config->zero_copy_bytes, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->zero_copy_bytes < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid zero_copy_bytes value (%d).", config->zero_copy_bytes);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "trace_level")
 						|| !strcmp(token, "ffdc_output")
 						|| !strcmp(token, "max_log_entries")
@@ -74,6 +74,7 @@ struct mosquitto *context__init(struct mosquitto_db *db, mosq_sock_t sock)
 		}
 	}
 	context->bridge = NULL;
+	context->write_batch = db->config->write_batch_bytes;
 	context->msgs_in.inflight_maximum = db->config->max_inflight_messages;
 	context->msgs_out.inflight_maximum = db->config->max_inflight_messages;
 	context->msgs_in.inflight_quota = db->config->max_inflight_messages;
@@ -104,8 +105,13 @@ void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool d
 
 	if(!context) return;
 
+	loop__context_pending_remove(db, context);
+
 #ifdef WITH_BRIDGE
-	if(context->bridge){
+	/* The extra links of a bridge share its configuration, only the
+	 * bridge's own context cleans that up and the links with it. */
+	if(context->bridge && !context->bridge_main){
+		bridge__links_cleanup(db, context);
 		for(i=0; i<db->bridge_count; i++){
 			if(db->bridges[i] == context){
 				db->bridges[i] = NULL;
@@ -225,6 +231,9 @@ void context__send_will(struct mosquitto_db *db, struct mosquitto *ctxt)
 
 void context__disconnect(struct mosquitto_db *db, struct mosquitto *context)
 {
+#ifdef WITH_BRIDGE
+	bridge__interest_disconnected(db, context);
+#endif
 	net__socket_close(db, context);
 
 	context__send_will(db, context);
@@ -117,6 +117,9 @@ int db__open(struct mosquitto__config *config, struct mosquitto_db *db, int pid)
 {
 	struct mosquitto__subhier *subhier;
     int rc;
+#ifdef WITH_BRIDGE
+    int i;
+#endif
 
 	if(!config || !db) return MOSQ_ERR_INVAL;
 
@@ -127,9 +130,9 @@ int db__open(struct mosquitto__config *config, struct mosquitto_db *db, int pid)
 	db->contexts_for_free = NULL;
     db->ip_address = get__hostIP();
 #ifdef WITH_BRIDGE
-    /* Initialise lists for the STP ports */
-    init_list(&(db->blocked_ports), "BLOCK");
-    init_list(&(db->designated_ports), "Designated");
+    db->stp_ports = NULL;
+    db->stp_generation = 0;
+    db->stp_connected_count = 0;
     db->king_port.port = 0;
     db->king_port.address = "";
     db->convergence = false;
@@ -138,6 +141,14 @@ int db__open(struct mosquitto__config *config, struct mosquitto_db *db, int pid)
 	db->bridge_count = 0;
     rc = info__init(db, config->default_listener.port, pid);
     if(rc) return MOSQ_ERR_NOMEM;
+    db->stp_origin = stp__port_id(db->ip_address, db->stp->my->port);
+    /* Start from the clock so that a restarted broker doesn't reuse
+     * sequence numbers the other brokers still remember. */
+    for(i=0; i<STP_DEDUP_SHARDS; i++){
+        db->stp_seq[i] = (uint64_t)time(NULL) << 20;
+    }
+    db->stp_dedup = NULL;
+    db->stp_dedup_count = 0;
     
 #endif
 
@@ -188,13 +199,7 @@ int info__init(struct mosquitto_db *db, int port, int pid)
     stp->my_root->res = alloc__res(pid);
     if(!stp->my_root->res) return MOSQ_ERR_NOMEM;
     
-    /* Cheat on PORT 1888 */
-    if(port == 1888){
-        log__printf(NULL, MOSQ_LOG_DEBUG, "Change broker with port %d to a very low PID", port);
-        pid = 100;
-    }
-    
-    db->stp = stp__init(stp, db->ip_address, port, pid);
+    db->stp = stp__init(stp, db->ip_address, port, pid, db->config->stp_priority);
     if(!db->stp){
         return MOSQ_ERR_NOMEM;
     }
@@ -225,32 +230,37 @@ struct broker__resources *alloc__res(int pid){
     return res;
 }
 
-static void subhier_clean(struct mosquitto_db *db, struct mosquitto__subhier **subhier)
+static void subhier_clean(struct mosquitto_db *db, struct mosquitto__subhier *peer)
 {
-	struct mosquitto__subhier *peer, *subhier_tmp;
 	struct mosquitto__subleaf *leaf, *nextleaf;
+	uint32_t i;
 
-	HASH_ITER(hh, *subhier, peer, subhier_tmp){
-		leaf = peer->subs;
-		while(leaf){
-			nextleaf = leaf->next;
-			mosquitto__free(leaf);
-			leaf = nextleaf;
-		}
-		if(peer->retained){
-			db__msg_store_ref_dec(db, &peer->retained);
-		}
-		subhier_clean(db, &peer->children);
-		mosquitto__free(peer->topic);
-
-		HASH_DELETE(hh, *subhier, peer);
-		mosquitto__free(peer);
+	leaf = peer->subs;
+	while(leaf){
+		nextleaf = leaf->next;
+		mosquitto__free(leaf);
+		leaf = nextleaf;
+	}
+	if(peer->retained){
+		db__msg_store_ref_dec(db, &peer->retained);
 	}
+	HASH_CLEAR(hh, peer->child_index);
+	for(i=0; i<peer->child_count; i++){
+		subhier_clean(db, peer->children[i].hier);
+	}
+	mosquitto__free(peer->children);
+	mosquitto__free(peer);
 }
 
 int db__close(struct mosquitto_db *db)
 {
-	subhier_clean(db, &db->subs);
+	struct mosquitto__subhier *peer, *subhier_tmp;
+
+	sub__cache_clean(db);
+	HASH_ITER(hh, db->subs, peer, subhier_tmp){
+		HASH_DELETE(hh, db->subs, peer);
+		subhier_clean(db, peer);
+	}
 	db__msg_store_clean(db);
 
 	return MOSQ_ERR_SUCCESS;
@@ -268,6 +278,41 @@ void db__msg_store_add(struct mosquitto_db *db, struct mosquitto_msg_store *stor
 }
 
 
+static void db__msg_store_frames_free(struct mosquitto_db *db, struct mosquitto_msg_store *store)
+{
+	struct mosquitto__frame *frame;
+
+	while(store->frames){
+		frame = store->frames;
+		store->frames = frame->next;
+		packet__frame_deref(&frame);
+	}
+	DL_DELETE2(db->frame_stores, store, frames_prev, frames_next);
+}
+
+
+/* Keep a frame with its message so that other clients it goes to share it. */
+void db__msg_store_frame_add(struct mosquitto_db *db, struct mosquitto_msg_store *store, struct mosquitto__frame *frame)
+{
+	if(!store->frames){
+		DL_APPEND2(db->frame_stores, store, frames_prev, frames_next);
+	}
+	frame->next = store->frames;
+	store->frames = frame;
+}
+
+
+/* Frames are only worth keeping while a message is being sent out to its
+ * subscribers, which is done in one pass of the main loop. Packets still
+ * queued keep theirs. */
+void db__msg_store_frames_release(struct mosquitto_db *db)
+{
+	while(db->frame_stores){
+		db__msg_store_frames_free(db, db->frame_stores);
+	}
+}
+
+
 void db__msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *store)
 {
 	int i;
@@ -285,6 +330,9 @@ void db__msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *s
 	}
 	db->msg_store_count--;
 	db->msg_store_bytes -= store->payloadlen;
+	if(store->frames){
+		db__msg_store_frames_free(db, store);
+	}
 
 	mosquitto__free(store->source_id);
 	mosquitto__free(store->source_username);
@@ -296,7 +344,11 @@ void db__msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *s
 	}
 	mosquitto__free(store->topic);
 	mosquitto_property_free_all(&store->properties);
-	UHPA_FREE_PAYLOAD(store);
+	if(store->payload_frame){
+		packet__frame_deref(&store->payload_frame);
+	}else{
+		UHPA_FREE_PAYLOAD(store);
+	}
 	mosquitto__free(store);
 }
 
@@ -422,6 +474,39 @@ int db__message_delete_outgoing(struct mosquitto_db *db, struct mosquitto *conte
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Would db__message_insert() take an outgoing message of this qos for
+ * context now, rather than drop it? */
+bool db__message_insert_ready(struct mosquitto_db *db, struct mosquitto *context, int qos)
+{
+	struct mosquitto_msg_data *msg_data = &context->msgs_out;
+
+	if(context->sock == INVALID_SOCKET){
+		if(qos == 0 && !db->config->queue_qos0_messages) return false;
+		return db__ready_for_queue(context, qos, msg_data);
+	}
+	return db__ready_for_flight(msg_data, qos) || db__ready_for_queue(context, qos, msg_data);
+}
+
+#ifdef WITH_BRIDGE
+/* Should a message for a bridge with a spool go to the spool rather than
+ * the queue? Once anything is spooled, everything is until the spool has
+ * been read back, to keep messages in order. */
+static bool db__spool_wanted(struct mosquitto *context, int qos, struct mosquitto_msg_data *msg_data)
+{
+	struct bridge__spool *spool = context->bridge->spool;
+
+	if(spool->draining) return false;
+	if(spool->bytes || msg_data->msg_count >= context->bridge->spool_memory) return true;
+
+	if(context->sock == INVALID_SOCKET){
+		return qos == 0 || !db__ready_for_queue(context, qos, msg_data);
+	}else{
+		return !db__ready_for_flight(msg_data, qos) && !db__ready_for_queue(context, qos, msg_data);
+	}
+}
+#endif
+
+
 int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, mosquitto_property *properties)
 {
 	struct mosquitto_client_msg *msg;
@@ -435,6 +520,12 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 	if(!context) return MOSQ_ERR_INVAL;
 	if(!context->id) return MOSQ_ERR_SUCCESS; /* Protect against unlikely "client is disconnected but not entirely freed" scenario */
 
+#ifdef WITH_BRIDGE
+	if(dir == mosq_md_out && context->bridge && context->bridge->link_count > 1 && !context->bridge_main){
+		context = bridge__link_select(context, &stored->stamp);
+	}
+#endif
+
 	if(dir == mosq_md_out){
 		msg_data = &context->msgs_out;
 	}else{
@@ -460,6 +551,14 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 			}
 		}
 	}
+#ifdef WITH_BRIDGE
+	if(dir == mosq_md_out && context->bridge && context->bridge->spool
+			&& db__spool_wanted(context, qos, msg_data)){
+
+		mosquitto_property_free_all(&properties);
+		return bridge__spool_write(context->bridge, stored, qos, retain);
+	}
+#endif
 	if(context->sock == INVALID_SOCKET){
 		/* Client is not connected only queue messages with QoS>0. */
 		if(qos == 0 && !db->config->queue_qos0_messages){
@@ -468,6 +567,7 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 				return 2;
 			}else{
 				if(context->bridge->start_type != bst_lazy){
+					context->bridge->peer_stale = true;
 					mosquitto_property_free_all(&properties);
 					return 2;
 				}
@@ -508,6 +608,11 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 						"Outgoing messages are being dropped for client %s.",
 						context->id);
 			}
+#ifdef WITH_BRIDGE
+			if(context->bridge){
+				context->bridge->peer_stale = true;
+			}
+#endif
 			G_MSGS_DROPPED_INC();
 			mosquitto_property_free_all(&properties);
 			return 2;
@@ -523,6 +628,11 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 						"Outgoing messages are being dropped for client %s.",
 						context->id);
 			}
+#ifdef WITH_BRIDGE
+			if(context->bridge){
+				context->bridge->peer_stale = true;
+			}
+#endif
 			mosquitto_property_free_all(&properties);
 			return 2;
 		}
@@ -559,6 +669,7 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 	}else{
 		DL_APPEND(msg_data->inflight, msg);
 	}
+	loop__context_pending(db, context);
 	msg_data->msg_count++;
 	msg_data->msg_bytes+= msg->store->payloadlen;
 	if(qos > 0){
@@ -705,16 +816,20 @@ int db__messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context,
 	}else{
 		origin = mosq_mo_broker;
 	}
-	if(db__message_store(db, context, 0, topic_heap, qos, payloadlen, &payload_uhpa, retain, &stored, message_expiry_interval, local_properties, 0, origin)) return 1;
+	if(db__message_store(db, context, 0, topic_heap, qos, payloadlen, &payload_uhpa, NULL, retain, &stored, message_expiry_interval, local_properties, 0, origin)) return 1;
 
 	return sub__messages_queue(db, source_id, topic_heap, qos, retain, &stored);
 }
 
-/* This function requires topic to be allocated on the heap. Once called, it owns topic and will free it on error. Likewise payload and properties. */
-int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, uint16_t source_mid, char *topic, int qos, uint32_t payloadlen, mosquitto__payload_uhpa *payload, int retain, struct mosquitto_msg_store **stored, uint32_t message_expiry_interval, mosquitto_property *properties, dbid_t store_id, enum mosquitto_msg_origin origin)
+/* This function requires topic to be allocated on the heap. Once called, it owns topic and will free it on error. Likewise payload and properties.
+ * If payload_frame is given, payload points into it and it is kept instead. */
+int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, uint16_t source_mid, char *topic, int qos, uint32_t payloadlen, mosquitto__payload_uhpa *payload, struct mosquitto__frame *payload_frame, int retain, struct mosquitto_msg_store **stored, uint32_t message_expiry_interval, mosquitto_property *properties, dbid_t store_id, enum mosquitto_msg_origin origin)
 {
 	struct mosquitto_msg_store *temp = NULL;
 	int rc = MOSQ_ERR_SUCCESS;
+#ifdef WITH_BRIDGE
+	int shard;
+#endif
 
 	assert(db);
 	assert(stored);
@@ -760,11 +875,18 @@ int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, u
 	temp->payloadlen = payloadlen;
 	temp->properties = properties;
 	temp->origin = origin;
+#ifdef WITH_BRIDGE
+	/* Bridged messages get the stamp they arrived with in handle__publish(). */
+	shard = stp__topic_shard(temp->topic);
+	temp->stamp.origin = db->stp_origin;
+	temp->stamp.seq = ((uint64_t)shard << STP_SEQ_SHARD_SHIFT) | db->stp_seq[shard]++;
+#endif
 	if(payloadlen){
 		UHPA_MOVE(temp->payload, *payload, payloadlen);
 	}else{
 		temp->payload.ptr = NULL;
 	}
+	temp->payload_frame = payload_frame;
 	if(message_expiry_interval > 0){
 		temp->message_expiry_time = time(NULL) + message_expiry_interval;
 	}else{
@@ -795,7 +917,11 @@ error:
 		mosquitto__free(temp);
 	}
 	mosquitto_property_free_all(&properties);
-	UHPA_FREE(*payload, payloadlen);
+	if(payload_frame){
+		packet__frame_deref(&payload_frame);
+	}else{
+		UHPA_FREE(*payload, payloadlen);
+	}
 	return rc;
 }
 
@@ -960,6 +1086,7 @@ int db__message_reconnect_reset(struct mosquitto_db *db, struct mosquitto *conte
 {
 	int rc;
 
+	loop__context_pending(db, context);
 	rc = db__message_reconnect_reset_outgoing(db, context);
 	if(rc) return rc;
 	return db__message_reconnect_reset_incoming(db, context);
@@ -1028,16 +1155,11 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 	uint16_t mid;
 	int retries;
 	int retain;
-	const char *topic;
 	int qos;
-	uint32_t payloadlen;
-	const void *payload;
 	int msg_count = 0;
-	mosquitto_property *cmsg_props = NULL, *store_props = NULL;
+	mosquitto_property *cmsg_props = NULL;
 	time_t now = 0;
 	uint32_t expiry_interval;
-    
-    char *src_id = NULL;
 
 	if(!context || context->sock == INVALID_SOCKET
 			|| (context->state == mosq_cs_connected && !context->id)){
@@ -1066,12 +1188,8 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 		mid = tail->mid;
 		retries = tail->dup;
 		retain = tail->retain;
-		topic = tail->store->topic;
 		qos = tail->qos;
-		payloadlen = tail->store->payloadlen;
-		payload = UHPA_ACCESS_PAYLOAD(tail->store);
 		cmsg_props = tail->properties;
-		store_props = tail->store->properties;
         
         switch(tail->state){
 			case mosq_ms_send_pubrec:
@@ -1124,24 +1242,13 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 		mid = tail->mid;
 		retries = tail->dup;
 		retain = tail->retain;
-		topic = tail->store->topic;
 		qos = tail->qos;
-		payloadlen = tail->store->payloadlen;
-		payload = UHPA_ACCESS_PAYLOAD(tail->store);
 		cmsg_props = tail->properties;
-		store_props = tail->store->properties;
-        
-        /* Source_id is 0 when the publish comes from a local client. */
-        src_id = tail->store->source_id;
 
 		switch(tail->state){
 			case mosq_ms_publish_qos0:
-#ifdef WITH_BROKER
-                rc = send__publish(db,context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval, src_id);
-#else
-                rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval, src_id);
-#endif
-				if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_OVERSIZE_PACKET){
+				rc = send__publish_store(db, context, tail->store, mid, qos, retain, retries, cmsg_props, expiry_interval);
+				if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_OVERSIZE_PACKET || rc == MOSQ_DROPPING_BRIDGE){
 					db__message_remove(db, &context->msgs_out, tail);
 				}else{
 					return rc;
@@ -1149,17 +1256,15 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 				break;
 
 			case mosq_ms_publish_qos1:
-#ifdef WITH_BROKER
-				rc = send__publish(db,context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval, src_id);
-#else
-                rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval, src_id);
-#endif
+				rc = send__publish_store(db, context, tail->store, mid, qos, retain, retries, cmsg_props, expiry_interval);
 				if(rc == MOSQ_ERR_SUCCESS){
 					tail->timestamp = mosquitto_time();
 					tail->dup = 1; /* Any retry attempts are a duplicate. */
 					tail->state = mosq_ms_wait_for_puback;
-				}else if(rc == MOSQ_ERR_OVERSIZE_PACKET){
+				}else if(rc == MOSQ_ERR_OVERSIZE_PACKET || rc == MOSQ_DROPPING_BRIDGE){
+					/* Never sent, so no ack will free its inflight slot. */
 					db__message_remove(db, &context->msgs_out, tail);
+					util__increment_send_quota(context);
 				}else{
 					return rc;
 				}
@@ -1167,17 +1272,15 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 
 			case mosq_ms_publish_qos2:
                 log__printf(NULL, MOSQ_LOG_DEBUG, "[MSG] send msg qos2");
-#ifdef WITH_BROKER
-                rc = send__publish(db,context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval, src_id);
-#else
-                rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval, src_id);
-#endif
+				rc = send__publish_store(db, context, tail->store, mid, qos, retain, retries, cmsg_props, expiry_interval);
 				if(rc == MOSQ_ERR_SUCCESS){
 					tail->timestamp = mosquitto_time();
 					tail->dup = 1; /* Any retry attempts are a duplicate. */
 					tail->state = mosq_ms_wait_for_pubrec;
-				}else if(rc == MOSQ_ERR_OVERSIZE_PACKET){
+				}else if(rc == MOSQ_ERR_OVERSIZE_PACKET || rc == MOSQ_DROPPING_BRIDGE){
+					/* Never sent, so no ack will free its inflight slot. */
 					db__message_remove(db, &context->msgs_out, tail);
+					util__increment_send_quota(context);
 				}else{
 					return rc;
 				}
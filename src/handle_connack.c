@@ -32,6 +32,7 @@ int handle__connack(struct mosquitto_db *db, struct mosquitto *context)
 	uint8_t connect_acknowledge;
 	uint8_t reason_code;
 	int i;
+	bool resume;
 	char *notification_topic;
 	int notification_topic_len;
 	char notification_payload;
@@ -44,14 +45,37 @@ int handle__connack(struct mosquitto_db *db, struct mosquitto *context)
 	if(packet__read_byte(&context->in_packet, &connect_acknowledge)) return 1;
 	if(packet__read_byte(&context->in_packet, &reason_code)) return 1;
 
-    for(i=0; i<db->bridge_count; i++){
-        if(!db->bridges[i]) continue;
-        if(strcmp(context->id, db->bridges[i]->bridge->local_clientid) == 0){
-            db->bridges[i]->bridge->is_connected = true;
-        }
-    }
-    
-    
+	if(context->bridge && context->bridge_main){
+		/* Extra link of a bundle: it only carries outgoing messages, the
+		 * bridge's own connection has done everything else. Stamped
+		 * PUBLISHes still need the peer to see a BPDU on it first. */
+		if(reason_code != CONNACK_ACCEPTED){
+			log__printf(NULL, MOSQ_LOG_ERR, "Connection Refused on bridge link %s (%d)", context->id, reason_code);
+			return 1;
+		}
+		if(context->bridge->publish_stamp){
+			send__pingreq(db, context);
+		}
+		bridge__compress_connected(db, context, connect_acknowledge & CONNACK_STP_COMPRESS);
+		context__set_state(context, mosq_cs_connected);
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(context->bridge){
+		context->bridge->bpdu_binary = connect_acknowledge & CONNACK_STP_BINARY;
+		context->bridge->publish_stamp = context->bridge->bpdu_binary && (connect_acknowledge & CONNACK_STP_STAMP);
+		bridge__interest_connected(db, context->bridge, connect_acknowledge & CONNACK_STP_INTEREST);
+		bridge__compress_connected(db, context, connect_acknowledge & CONNACK_STP_COMPRESS);
+		if(context->bridge->publish_stamp){
+			/* The peer must see the stamped BPDU before the first
+			 * stamped PUBLISH, so send it ahead of everything else. */
+			send__pingreq(db, context);
+		}
+		if(!context->bridge->is_connected){
+			context->bridge->is_connected = true;
+			db->stp_connected_count++;
+		}
+	}
+
 	if(context->protocol == mosq_p_mqtt5){
 		rc = property__read_all(CMD_CONNACK, &context->in_packet, &properties);
 		if(rc) return rc;
@@ -62,12 +86,20 @@ int handle__connack(struct mosquitto_db *db, struct mosquitto *context)
 	switch(reason_code){
 		case CONNACK_ACCEPTED:
 			if(context->bridge){
+				if(context->bridge->down_ms){
+					log__printf(NULL, MOSQ_LOG_NOTICE, "Bridge %s is back, it keeps its spanning tree role.", context->bridge->name);
+					context->bridge->down_ms = 0;
+				}
+				/* A peer that kept our session still has our subscriptions,
+				 * and it has had every retained message unless it may have
+				 * missed some. */
+				resume = connect_acknowledge & 0x01;
 				if(context->bridge->notifications){
 					notification_payload = '1';
 					if(context->bridge->notification_topic){
 						if(!context->bridge->notifications_local_only){
 							if(send__real_publish(context, mosquitto__mid_generate(context),
-									context->bridge->notification_topic, 1, &notification_payload, 1, true, 0, NULL, NULL, 0)){
+									context->bridge->notification_topic, 1, &notification_payload, 1, true, 0, NULL, NULL, 0, NULL)){
 
 								return 1;
 							}
@@ -82,7 +114,7 @@ int handle__connack(struct mosquitto_db *db, struct mosquitto *context)
 						notification_payload = '1';
 						if(!context->bridge->notifications_local_only){
 							if(send__real_publish(context, mosquitto__mid_generate(context),
-									notification_topic, 1, &notification_payload, 1, true, 0, NULL, NULL, 0)){
+									notification_topic, 1, &notification_payload, 1, true, 0, NULL, NULL, 0, NULL)){
 
 								mosquitto__free(notification_topic);
 								return 1;
@@ -92,7 +124,7 @@ int handle__connack(struct mosquitto_db *db, struct mosquitto *context)
 						mosquitto__free(notification_topic);
 					}
 				}
-				for(i=0; i<context->bridge->topic_count; i++){
+				for(i=0; i<context->bridge->topic_count && !resume; i++){
 					if(context->bridge->topics[i].direction == bd_in || context->bridge->topics[i].direction == bd_both){
 						if(send__subscribe(context, NULL, 1, &context->bridge->topics[i].remote_topic, context->bridge->topics[i].qos, NULL)){
 							return 1;
@@ -108,13 +140,18 @@ int handle__connack(struct mosquitto_db *db, struct mosquitto *context)
 						}
 					}
 				}
-				for(i=0; i<context->bridge->topic_count; i++){
-					if(context->bridge->topics[i].direction == bd_out || context->bridge->topics[i].direction == bd_both){
-						sub__retain_queue(db, context,
-								context->bridge->topics[i].local_topic,
-								context->bridge->topics[i].qos, 0);
+				if(resume && !context->bridge->peer_stale){
+					log__printf(NULL, MOSQ_LOG_INFO, "Bridge %s resumed its session.", context->id);
+				}else{
+					for(i=0; i<context->bridge->topic_count; i++){
+						if(context->bridge->topics[i].direction == bd_out || context->bridge->topics[i].direction == bd_both){
+							sub__retain_queue(db, context,
+									context->bridge->topics[i].local_topic,
+									context->bridge->topics[i].qos, 0);
+						}
 					}
 				}
+				context->bridge->peer_stale = false;
 			}
 			context__set_state(context, mosq_cs_connected);
 			return MOSQ_ERR_SUCCESS;
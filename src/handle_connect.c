@@ -268,6 +268,22 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 	}
 	free(auth_data_out);
 
+#ifdef WITH_BRIDGE
+	/* Tell a bridged broker it can switch to binary BPDUs and stamp its
+	 * PUBLISHes. It says it does in its first binary BPDU. It can also
+	 * send us interest updates. Any MQTT-ST broker can send us compressed
+	 * batches. */
+	context->stp_stamped = false;
+	if(context->stp_port){
+		connect_ack |= CONNACK_STP_BINARY | CONNACK_STP_STAMP | CONNACK_STP_INTEREST;
+	}
+#  ifdef WITH_ZLIB
+	if(context->stp_peer){
+		connect_ack |= CONNACK_STP_COMPRESS;
+	}
+#  endif
+#endif
+
 	context__set_state(context, mosq_cs_connected);
 	rc = send__connack(db, context, connect_ack, CONNACK_ACCEPTED, connack_props);
 	mosquitto_property_free_all(&connack_props);
@@ -370,7 +386,7 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
 	uint8_t username_flag, password_flag, stp_flag; /* STP flag checks whether the CONNECT is from a bridged broker or not */
 	char *username = NULL, *password = NULL;
 
-    struct mosquitto__bpdu__packet *recv_packet;
+    struct mosquitto__bpdu__packet recv_packet;
 
 	int rc;
 	int slen;
@@ -401,11 +417,6 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
 		goto handle_connect_error;
 	}
 
-    /* Check correct allocation of the STP temporary packet */
-    recv_packet = mosquitto__calloc(1, sizeof(struct mosquitto__bpdu__packet));
-    if(!recv_packet) return MOSQ_ERR_NOMEM;
-    
-    
 	/* Read protocol name as length then bytes rather than with read_string
 	 * because the length is fixed and we can check that. Removes the need
 	 * for another malloc as well. */
@@ -641,37 +652,8 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
 	}
     
     if(stp_flag){
-        /* Source properties */
-        if(packet__read_string(&context->in_packet, &recv_packet->origin_address, &slen)){
-            rc = 1;
-            goto handle_connect_error;
-        }
-        if(packet__read_string(&context->in_packet, &recv_packet->origin_port, &slen)){
-            rc = 1;
-            goto handle_connect_error;
-        }
-        
-        /* Root properties */
-        if(packet__read_string(&context->in_packet, &recv_packet->root_address, &slen)){
-            rc = 1;
-            goto handle_connect_error;
-        }
-        if(packet__read_string(&context->in_packet, &recv_packet->root_port, &slen)){
-            rc = 1;
-            goto handle_connect_error;
-        }
-        
-        /* Other */
-        if(packet__read_string(&context->in_packet, &recv_packet->distance, &slen)){
-            rc = 1;
-            goto handle_connect_error;
-        }
-        if(packet__read_string(&context->in_packet, &recv_packet->origin_pid, &slen)){
-            rc = 1;
-            goto handle_connect_error;
-        }
-        if(packet__read_string(&context->in_packet, &recv_packet->root_pid, &slen)){
-            rc = 1;
+        if(packet__read_bpdu(&context->in_packet, &recv_packet)){
+            rc = MOSQ_ERR_PROTOCOL;
             goto handle_connect_error;
         }
 
@@ -681,13 +663,18 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
             goto handle_connect_error;
         }
         
-        log__printf(NULL, MOSQ_LOG_DEBUG, "[CONNECT] [r(%s:%s, %s), d(%s), o(%s:%s, %s)]", recv_packet->root_address, recv_packet->root_port, recv_packet->root_pid, recv_packet->distance, recv_packet->root_address, recv_packet->root_port, recv_packet->origin_pid);
+        log__printf(NULL, MOSQ_LOG_DEBUG, "[CONNECT] [r(%s:%d, %d), d(%d), o(%s:%d, %d)]", recv_packet.root_address, recv_packet.root_port, recv_packet.root_id, recv_packet.distance, recv_packet.origin_address, recv_packet.origin_port, recv_packet.origin_id);
         
         /* Store packet fields */ //TODO move down in the connect correct
 #ifdef WITH_BRIDGE        
-        if(update__stp_properties(db, db->stp, db->config->bridges, recv_packet)){
+        context->stp_peer = true;
+        context->stp_port = stp__port_find(db, &recv_packet);
+        if(update__stp_properties(db, db->stp, context->stp_port, &recv_packet)){
             log__printf(NULL, MOSQ_LOG_ERR, "Impossible to update STP fields. Check conf file");
         }
+        if(context->stp_port){
+            stp__bpdu_request(db, context->stp_port);
+        }
 #endif
     }
 
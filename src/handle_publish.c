@@ -17,6 +17,7 @@ Contributors:
 #include "config.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -33,10 +34,22 @@ Contributors:
 #include "util_list.h"
 
 
+static void handle__publish_payload_free(mosquitto__payload_uhpa *payload, uint32_t payloadlen, struct mosquitto__frame **payload_frame)
+{
+	if(*payload_frame){
+		packet__frame_deref(payload_frame);
+		payload->ptr = NULL;
+	}else{
+		UHPA_FREE(*payload, payloadlen);
+	}
+}
+
+
 int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 {
 	char *topic;
 	mosquitto__payload_uhpa payload;
+	struct mosquitto__frame *payload_frame = NULL;
 	uint32_t payloadlen;
 	uint8_t dup, qos, retain;
 	uint16_t mid = 0;
@@ -57,9 +70,8 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 
 #ifdef WITH_BRIDGE
 	char *topic_temp;
-	int i;
-	struct mosquitto__bridge_topic *cur_topic;
-	bool match;
+	struct mosquitto__bridge *stp_port;
+	struct mosquitto__stp_stamp stamp;
 #endif
 
 	if(context->state != mosq_cs_connected){
@@ -192,51 +204,15 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 	}
 
 #ifdef WITH_BRIDGE
-	if(context->bridge && context->bridge->topics && context->bridge->topic_remapping){
-		for(i=0; i<context->bridge->topic_count; i++){
-			cur_topic = &context->bridge->topics[i];
-			log__printf(NULL, MOSQ_LOG_INFO, "[BRIDGING] Remote topic: %s, topic: %s.", cur_topic->remote_topic, topic);
-
-			if((cur_topic->direction == bd_both || cur_topic->direction == bd_in)
-					&& (cur_topic->remote_prefix || cur_topic->local_prefix)){
-
-				/* Topic mapping required on this topic if the message matches */
-				rc = mosquitto_topic_matches_sub(cur_topic->remote_topic, topic, &match);
-				if(rc){
-					mosquitto__free(topic);
-					return rc;
-				}
-				if(match){
-					if(cur_topic->remote_prefix){
-						/* This prefix needs removing. */
-						if(!strncmp(cur_topic->remote_prefix, topic, strlen(cur_topic->remote_prefix))){
-							topic_temp = mosquitto__strdup(topic+strlen(cur_topic->remote_prefix));
-							if(!topic_temp){
-								mosquitto__free(topic);
-								return MOSQ_ERR_NOMEM;
-							}
-							mosquitto__free(topic);
-							topic = topic_temp;
-						}
-					}
-
-					if(cur_topic->local_prefix){
-						/* This prefix needs adding. */
-						len = strlen(topic) + strlen(cur_topic->local_prefix)+1;
-						topic_temp = mosquitto__malloc(len+1);
-						if(!topic_temp){
-							mosquitto__free(topic);
-							return MOSQ_ERR_NOMEM;
-						}
-						snprintf(topic_temp, len, "%s%s", cur_topic->local_prefix, topic);
-						topic_temp[len] = '\0';
-
-						mosquitto__free(topic);
-						topic = topic_temp;
-					}
-					break;
-				}
-			}
+	if(context->bridge && context->bridge->topic_remapping){
+		rc = bridge__remap_topic(context->bridge, bd_in, topic, &topic_temp);
+		if(rc){
+			mosquitto__free(topic);
+			return rc;
+		}
+		if(topic_temp){
+			mosquitto__free(topic);
+			topic = topic_temp;
 		}
 	}
 #endif
@@ -246,8 +222,35 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 		return 1;
 	}
 
+#ifdef WITH_BRIDGE
+	if(context->stp_stamped){
+		if(packet__read_uint64(&context->in_packet, &stamp.origin)
+				|| packet__read_uint64(&context->in_packet, &stamp.seq)){
+
+			mosquitto__free(topic);
+			mosquitto_property_free_all(&msg_properties);
+			return MOSQ_ERR_PROTOCOL;
+		}
+	}
+#endif
 	payloadlen = context->in_packet.remaining_length - context->in_packet.pos;
 	G_PUB_BYTES_RECEIVED_INC(payloadlen);
+#ifdef WITH_BRIDGE
+	/* Interest updates are for us, they never reach the subscriptions. */
+	if(context->stp_port && qos == 0 && !strcmp(topic, STP_INTEREST_TOPIC)){
+		rc = bridge__interest_handle(db, context, &context->in_packet.payload[context->in_packet.pos], payloadlen);
+		mosquitto__free(topic);
+		mosquitto_property_free_all(&msg_properties);
+		return rc;
+	}
+#  ifdef WITH_ZLIB
+	if(context->stp_peer && qos == 0 && !strcmp(topic, STP_COMPRESS_TOPIC)){
+		mosquitto__free(topic);
+		mosquitto_property_free_all(&msg_properties);
+		return bridge__compress_handle(db, context, &context->in_packet.payload[context->in_packet.pos], payloadlen);
+	}
+#  endif
+#endif
 	if(context->listener && context->listener->mount_point){
 		len = strlen(context->listener->mount_point) + strlen(topic) + 1;
 		topic_mount = mosquitto__malloc(len+1);
@@ -263,23 +266,62 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 		topic = topic_mount;
 	}
 
+#ifdef WITH_BRIDGE
+	/* Drop messages arriving on a port that the spanning tree has not put
+	 * in forwarding state. $SYS traffic is never subject to the tree. */
+	if(strncmp(topic, "$SYS", 4)){
+		if(context->bridge){
+			stp_port = context->bridge;
+		}else{
+			stp_port = context->stp_port;
+		}
+		if(stp_port && !stp__port_forwarding(stp_port)){
+			stp_port->stats.msgs_blocked++;
+			goto process_bad_message;
+		}
+	}
+	/* Drop copies that looped back to us or reached us over two paths. */
+	if(context->stp_stamped && stp__dedup_seen(db, &stamp)){
+		log__printf(NULL, MOSQ_LOG_DEBUG, "Dropped duplicate PUBLISH from %s (origin %" PRIx64 ", seq %" PRIu64 ", '%s')", context->id, stamp.origin, stamp.seq, topic);
+		goto process_bad_message;
+	}
+#endif
+
 	if(payloadlen){
 		if(db->config->message_size_limit && payloadlen > db->config->message_size_limit){
 			log__printf(NULL, MOSQ_LOG_DEBUG, "Dropped too large PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
 			reason_code = MQTT_RC_IMPLEMENTATION_SPECIFIC;
 			goto process_bad_message;
 		}
-		if(UHPA_ALLOC(payload, payloadlen) == 0){
-			mosquitto__free(topic);
-			mosquitto_property_free_all(&msg_properties);
-			return MOSQ_ERR_NOMEM;
-		}
+		if(db->config->zero_copy_bytes && payloadlen >= (uint32_t)db->config->zero_copy_bytes
+				&& payloadlen > MOSQ_PAYLOAD_UNION_SIZE
+#if defined(WITH_BRIDGE) && defined(WITH_ZLIB)
+				&& !bridge__compress_in_batch()
+#endif
+				){
 
-		if(packet__read_bytes(&context->in_packet, UHPA_ACCESS(payload, payloadlen), payloadlen)){
-			mosquitto__free(topic);
-			UHPA_FREE(payload, payloadlen);
-			mosquitto_property_free_all(&msg_properties);
-			return 1;
+			/* Leave the payload where it was read, the stored message
+			 * takes the whole buffer. */
+			payload.ptr = &context->in_packet.payload[context->in_packet.pos];
+			payload_frame = packet__frame_adopt(&context->in_packet);
+			if(!payload_frame){
+				mosquitto__free(topic);
+				mosquitto_property_free_all(&msg_properties);
+				return MOSQ_ERR_NOMEM;
+			}
+		}else{
+			if(UHPA_ALLOC(payload, payloadlen) == 0){
+				mosquitto__free(topic);
+				mosquitto_property_free_all(&msg_properties);
+				return MOSQ_ERR_NOMEM;
+			}
+
+			if(packet__read_bytes(&context->in_packet, UHPA_ACCESS(payload, payloadlen), payloadlen)){
+				mosquitto__free(topic);
+				UHPA_FREE(payload, payloadlen);
+				mosquitto_property_free_all(&msg_properties);
+				return 1;
+			}
 		}
 	}
 
@@ -291,55 +333,35 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 		goto process_bad_message;
 	}else if(rc != MOSQ_ERR_SUCCESS){
 		mosquitto__free(topic);
-		UHPA_FREE(payload, payloadlen);
+		handle__publish_payload_free(&payload, payloadlen, &payload_frame);
 		mosquitto_property_free_all(&msg_properties);
 		return rc;
 	}
 
 	log__printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
     
-#ifdef WITH_BROKER
-    if(strstr(topic, "SYS") == NULL){
-        BROKER broker;
-        broker.address = "192.168.1.9"; //TODO!
-        broker.port = atoi(context->id);
-        if(broker.port>1){
-            if(db->blocked_ports){
-                
-                PORT_LIST* current = db->blocked_ports;
-                
-                if(in_list(current, broker)){
-                    log__printf(NULL, MOSQ_LOG_INFO, "[RECEIVE] receive port (%d) is blocked", broker.port);
-                    goto process_bad_message;
-                }
-                if(in_list(db->designated_ports, broker) ||  broker.port == db->king_port.port){
-                //if(in_list(db->designated_ports, broker) || (strcmp(broker.address, db->king_port.address) == 0 && broker.port == db->king_port.port)){
-                        //nothing to do
-                }else{
-                    log__printf(NULL, MOSQ_LOG_ERR, "[RECEIVE] receive port (%s:%d) is NOT mapped", broker.address, broker.port);
-                    goto process_bad_message;
-                }
-            }
-        }
-    }
-#endif
-    
 	if(qos > 0){
 		db__message_store_find(context, mid, &stored);
 	}
 	if(!stored){
 		dup = 0;
-		if(db__message_store(db, context, mid, topic, qos, payloadlen, &payload, retain, &stored, message_expiry_interval, msg_properties, 0, mosq_mo_client)){
+		if(db__message_store(db, context, mid, topic, qos, payloadlen, &payload, payload_frame, retain, &stored, message_expiry_interval, msg_properties, 0, mosq_mo_client)){
 			mosquitto_property_free_all(&msg_properties);
 			return 1;
 		}
 		msg_properties = NULL; /* Now belongs to db__message_store() */
+		payload_frame = NULL; /* Now belongs to the stored message */
+#ifdef WITH_BRIDGE
+		if(context->stp_stamped && stamp.origin){
+			stored->stamp = stamp;
+		}
+#endif
 	}else{
 		mosquitto__free(topic);
 		topic = stored->topic;
 		dup = 1;
 		mosquitto_property_free_all(&msg_properties);
-		UHPA_FREE(payload, payloadlen);
+		handle__publish_payload_free(&payload, payloadlen, &payload_frame);
 	}
 
 	switch(qos){
@@ -378,7 +400,8 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 	return rc;
 process_bad_message:
 	mosquitto__free(topic);
-	UHPA_FREE(payload, payloadlen);
+	handle__publish_payload_free(&payload, payloadlen, &payload_frame);
+	mosquitto_property_free_all(&msg_properties);
     
 	switch(qos){
 		case 0:
@@ -43,6 +43,7 @@ Contributors:
 #  include <sys/socket.h>
 #endif
 #include <time.h>
+#include <utlist.h>
 
 #ifdef WITH_WEBSOCKETS
 #  include <libwebsockets.h>
@@ -115,15 +116,19 @@ int mosquitto_restart_stp(struct mosquitto_db *db, struct bridge_address *failed
     if(db->config->bridges){
         /* Clean STP values */
         log__printf(NULL, MOSQ_LOG_DEBUG, "Clean STP config");
+        db->stp_reconvergences++;
+        if(db->king_port.port && !db->root_lost_ms){
+            db->root_lost_ms = mosquitto_time_ms();
+        }
+        db->alternate_port = NULL;
         my_pid = db->stp->my->res->pid;
-        db->stp = stp__init(db->stp, db->ip_address, db->config->listeners->port, my_pid);
+        db->stp = stp__init(db->stp, db->ip_address, db->config->listeners->port, my_pid, db->stp->my->res->priority);
         print_stp(db->stp);
         
         /* Clean ports */
-        db->designated_ports = empty_list(db->designated_ports);
-        db->blocked_ports = empty_list(db->blocked_ports);
-        db->king_port.address = "";
-        db->king_port.port = 0;
+        broker.address = "";
+        broker.port = 0;
+        stp__king_port_set(db, broker);
         
         for(i=0; i<db->bridge_count; i++){
             if(!db->bridges[i]) continue;
@@ -133,26 +138,303 @@ int mosquitto_restart_stp(struct mosquitto_db *db, struct bridge_address *failed
                 return MOSQ_ERR_STP;
             }
             log__printf(NULL, MOSQ_LOG_NOTICE, "address %s:%d", context->bridge->addresses[context->bridge->cur_address].address, context->bridge->addresses[context->bridge->cur_address].port);
-            log__printf(NULL, MOSQ_LOG_DEBUG, "BDPU CHECK r%s:%s-%s o%s:%s-%s", context->bridge->last_bpdu->root_address, context->bridge->last_bpdu->root_port, context->bridge->last_bpdu->root_pid, context->bridge->last_bpdu->origin_address, context->bridge->last_bpdu->origin_port, context->bridge->last_bpdu->origin_pid);
+            log__printf(NULL, MOSQ_LOG_DEBUG, "BDPU CHECK r%s:%d-%d o%s:%d-%d", context->bridge->last_bpdu->root_address, context->bridge->last_bpdu->root_port, context->bridge->last_bpdu->root_id, context->bridge->last_bpdu->origin_address, context->bridge->last_bpdu->origin_port, context->bridge->last_bpdu->origin_id);
             
-            broker.address = context->bridge->addresses->address;
-            broker.port = context->bridge->addresses->port;
-            db->designated_ports = add(db->designated_ports, broker);
+            stp__port_status_set(db, context->bridge, DESIGNATED_PORT);
         
             log__printf(NULL, MOSQ_LOG_NOTICE, "Sending ping request (STP) to address %s:%d", context->bridge->addresses[context->bridge->cur_address].address, context->bridge->addresses[context->bridge->cur_address].port);
             send__pingreq(db, context);
             
         }
-        log__printf(NULL, MOSQ_LOG_DEBUG, "\nList ROOT: %s:%d", db->king_port.address, db->king_port.port);
-        print_list(db->designated_ports, "DESIGNATED");
-        print_list(db->blocked_ports, "BLOCK");
-        log__printf(NULL, MOSQ_LOG_INFO, "--> %s", print_all_lists(db->designated_ports, db->blocked_ports, db->king_port));
+        stp__ports_log(db);
 
     }
     return MOSQ_ERR_SUCCESS;
 }
 #endif
 
+#ifdef WITH_BRIDGE
+/* Rapid mode: tell the other bridges straight away that the tree changed,
+ * rather than waiting for their next keepalive. */
+static void stp__topology_change(struct mosquitto_db *db, struct mosquitto__bridge *failed)
+{
+    int i;
+
+    for(i=0; i<db->bridge_count; i++){
+        if(!db->bridges[i] || db->bridges[i]->bridge == failed) continue;
+        if(db->bridges[i]->sock == INVALID_SOCKET) continue;
+        send__pingreq(db, db->bridges[i]);
+    }
+}
+
+/* A bridge connection went down. Classic STP re-elects from scratch, rapid
+ * mode only has work to do if it was the root port, and then falls back on
+ * the alternate port when there is one. */
+static void stp__bridge_down(struct mosquitto_db *db, struct mosquitto__bridge *bridge, int reason)
+{
+    bool was_root;
+
+    log__printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s:%d fails", bridge->addresses->address, bridge->addresses->port);
+    bridge->is_reached = false;
+    db->convergence = false;
+
+    if(!db->config->stp_rapid){
+        if(reason == MOSQ_ERR_CONN_LOST){
+            //start again as a root
+            mosquitto_restart_stp(db, bridge->addresses);
+        }
+        return;
+    }
+
+    was_root = (bridge->port_status == ROOT_PORT);
+    /* Forget what we heard on it, it comes back as a designated port. */
+    init__bpdu(db, bridge->last_bpdu);
+    stp__port_status_set(db, bridge, DESIGNATED_PORT);
+
+    if(!was_root){
+        if(bridge == db->alternate_port){
+            db->alternate_port = NULL;
+            stp__alternate_port_select(db);
+        }
+        return;
+    }
+
+    db->root_lost_ms = mosquitto_time_ms();
+    if(db->alternate_port == bridge){
+        db->alternate_port = NULL;
+    }
+    if(stp__alternate_promote(db) == MOSQ_ERR_SUCCESS){
+        stp__ports_log(db);
+        stp__topology_change(db, bridge);
+    }else{
+        mosquitto_restart_stp(db, bridge->addresses);
+    }
+}
+#endif
+
+#ifdef WITH_BRIDGE
+/* With stp_resume_timeout set, a bridge that drops keeps its role for that
+ * long. If it is back in time, the BPDUs exchanged on the new connection
+ * are all it takes and the rest of the tree never hears about it. */
+static void stp__bridge_lost(struct mosquitto_db *db, struct mosquitto__bridge *bridge, int reason)
+{
+    if(!bridge->resume_timeout){
+        stp__bridge_down(db, bridge, reason);
+        return;
+    }
+    if(!bridge->down_ms){
+        log__printf(NULL, MOSQ_LOG_NOTICE, "Bridge %s lost, keeping its spanning tree role for %d seconds.", bridge->name, bridge->resume_timeout);
+        bridge->down_ms = mosquitto_time_ms();
+        bridge->down_reason = reason;
+    }
+}
+
+static void stp__bridge_resume_check(struct mosquitto_db *db, struct mosquitto__bridge *bridge)
+{
+    if(bridge->down_ms && mosquitto_time_ms() - bridge->down_ms >= (uint64_t)bridge->resume_timeout*1000){
+        bridge->down_ms = 0;
+        stp__bridge_down(db, bridge, bridge->down_reason);
+    }
+}
+#endif
+
+/* Clients that need looking at next time round the loop: a packet was read
+ * from them or a message was queued for them. Only these are walked for
+ * messages to send, and with epoll only these and the bridges are looked at
+ * at all. Every client is looked at once a second as well, for keepalives,
+ * expiry and anything missed. */
+void loop__context_pending(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(context->pending) return;
+	context->pending = true;
+	DL_APPEND2(db->loop_pending, context, pending_prev, pending_next);
+}
+
+void loop__context_pending_remove(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(!context->pending) return;
+	context->pending = false;
+	DL_DELETE2(db->loop_pending, context, pending_prev, pending_next);
+}
+
+/* Keepalive, messages to send and the events wanted for one client. */
+#ifdef WITH_EPOLL
+static void loop__context_service(struct mosquitto_db *db, struct mosquitto *context, time_t now, bool sweep)
+#else
+static void loop__context_service(struct mosquitto_db *db, struct mosquitto *context, time_t now, bool sweep, struct pollfd *pollfds, int *pollfd_index)
+#endif
+{
+#ifdef WITH_EPOLL
+	struct epoll_event ev;
+#endif
+#ifdef WITH_BRIDGE
+	int rc;
+	int err;
+	socklen_t len;
+#endif
+	bool pending;
+
+	pending = context->pending;
+	loop__context_pending_remove(db, context);
+	context->pollfd_index = -1;
+
+	if(context->sock != INVALID_SOCKET){
+#ifdef WITH_BRIDGE
+		if(context->bridge){
+			mosquitto__check_keepalive(db, context);
+			if(!context->bridge_main
+					&& context->bridge->round_robin == false
+					&& context->bridge->cur_address != 0
+					&& context->bridge->primary_retry
+					&& now > context->bridge->primary_retry){
+
+				if(context->bridge->primary_retry_sock == INVALID_SOCKET){
+					rc = net__try_connect(context->bridge->addresses[0].address,
+							context->bridge->addresses[0].port,
+							&context->bridge->primary_retry_sock, NULL, false);
+
+					if(rc == 0){
+						COMPAT_CLOSE(context->bridge->primary_retry_sock);
+						context->bridge->primary_retry_sock = INVALID_SOCKET;
+						context->bridge->primary_retry = 0;
+						net__socket_close(db, context);
+						context->bridge->cur_address = 0;
+					}
+				}else{
+					len = sizeof(int);
+					if(!getsockopt(context->bridge->primary_retry_sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len)){
+						if(err == 0){
+							COMPAT_CLOSE(context->bridge->primary_retry_sock);
+							context->bridge->primary_retry_sock = INVALID_SOCKET;
+							context->bridge->primary_retry = 0;
+							net__socket_close(db, context);
+							context->bridge->cur_address = context->bridge->address_count-1;
+						}else{
+							COMPAT_CLOSE(context->bridge->primary_retry_sock);
+							context->bridge->primary_retry_sock = INVALID_SOCKET;
+							context->bridge->primary_retry = now+5;
+						}
+					}else{
+						COMPAT_CLOSE(context->bridge->primary_retry_sock);
+						context->bridge->primary_retry_sock = INVALID_SOCKET;
+						context->bridge->primary_retry = now+5;
+					}
+				}
+			}
+		}
+#endif
+
+		/* Local bridges never time out in this fashion. */
+		if(!(context->keepalive)
+				|| context->bridge
+				|| now - context->last_msg_in <= (time_t)(context->keepalive)*3/2){
+
+			if((!(pending || sweep) || db__message_write(db, context) == MOSQ_ERR_SUCCESS)
+					&& (!context->write_batch_pending || packet__write(context) == MOSQ_ERR_SUCCESS)){
+#ifdef WITH_EPOLL
+				if(context->current_out_packet || context->state == mosq_cs_connect_pending || context->ws_want_write){
+					if(!(context->events & EPOLLOUT)) {
+						ev.data.fd = context->sock;
+						ev.events = EPOLLIN | EPOLLOUT;
+						if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1) {
+							if((errno != EEXIST)||(epoll_ctl(db->epollfd, EPOLL_CTL_MOD, context->sock, &ev) == -1)) {
+									log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll re-registering to EPOLLOUT: %s", strerror(errno));
+							}
+						}
+						context->events = EPOLLIN | EPOLLOUT;
+					}
+					context->ws_want_write = false;
+				}
+				else{
+					if(context->events & EPOLLOUT) {
+						ev.data.fd = context->sock;
+						ev.events = EPOLLIN;
+						if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1) {
+							if((errno != EEXIST)||(epoll_ctl(db->epollfd, EPOLL_CTL_MOD, context->sock, &ev) == -1)) {
+									log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll re-registering to EPOLLIN: %s", strerror(errno));
+							}
+						}
+						context->events = EPOLLIN;
+					}
+				}
+#else
+				pollfds[*pollfd_index].fd = context->sock;
+				pollfds[*pollfd_index].events = POLLIN;
+				pollfds[*pollfd_index].revents = 0;
+				if(context->current_out_packet || context->state == mosq_cs_connect_pending || context->ws_want_write){
+					pollfds[*pollfd_index].events |= POLLOUT;
+					context->ws_want_write = false;
+				}
+				context->pollfd_index = *pollfd_index;
+				(*pollfd_index)++;
+#endif
+			}else{
+				do_disconnect(db, context, MOSQ_ERR_CONN_LOST);
+			}
+		}else{
+			/* Client has exceeded keepalive*1.5 */
+			do_disconnect(db, context, MOSQ_ERR_KEEPALIVE);
+		}
+	}
+}
+
+#ifdef WITH_EPOLL
+static void loop__pending_service(struct mosquitto_db *db, time_t now)
+{
+	struct mosquitto *context;
+	int count;
+#ifdef WITH_BRIDGE
+	struct mosquitto__bridge *bridge;
+	int i, j;
+
+	/* Bridges have timers and batched writes of their own. */
+	for(i=0; i<db->bridge_count; i++){
+		if(!db->bridges[i]) continue;
+		context = db->bridges[i];
+		bridge = context->bridge;
+		if(context->sock != INVALID_SOCKET){
+			loop__context_pending(db, context);
+		}
+		for(j=0; j<bridge->link_count-1; j++){
+			if(bridge->links[j].context && bridge->links[j].context->sock != INVALID_SOCKET){
+				loop__context_pending(db, bridge->links[j].context);
+			}
+		}
+	}
+#endif
+
+	/* A client looked at may queue messages for others, which are then
+	 * looked at straight away. Each pass takes one client off the list. */
+	count = HASH_CNT(hh_sock, db->contexts_by_sock);
+	while(db->loop_pending && count-- >= 0){
+		context = db->loop_pending;
+		loop__context_service(db, context, now, false);
+	}
+}
+#endif
+
+#ifndef WITH_EPOLL
+/* Make room for one pollfd per socket. The array only grows, and only the
+ * entries in use are written each time round the loop. */
+static int loop__pollfds_reserve(struct pollfd **pollfds, int *pollfd_max, int count)
+{
+	struct pollfd *new_pollfds;
+
+	if(count <= *pollfd_max){
+		return MOSQ_ERR_SUCCESS;
+	}
+	count *= 2;
+	new_pollfds = mosquitto__realloc(*pollfds, sizeof(struct pollfd)*count);
+	if(!new_pollfds){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	*pollfds = new_pollfds;
+	*pollfd_max = count;
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
 int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int listensock_count)
 {
 #ifdef WITH_SYS_TREE
@@ -175,12 +457,13 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 #else
 	struct pollfd *pollfds = NULL;
 	int pollfd_index;
-	int pollfd_max;
+	int pollfd_max = 0;
+	int pollfd_count;
 #endif
+	time_t last_sweep = 0;
+	bool sweep;
 #ifdef WITH_BRIDGE
 	int rc;
-	int err;
-	socklen_t len;
 #endif
 	time_t expiration_check_time = 0;
 	char *id;
@@ -194,20 +477,6 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 	sigaddset(&sigblock, SIGHUP);
 #endif
 
-#ifndef WITH_EPOLL
-#ifdef WIN32
-	pollfd_max = _getmaxstdio();
-#else
-	pollfd_max = sysconf(_SC_OPEN_MAX);
-#endif
-
-	pollfds = mosquitto__malloc(sizeof(struct pollfd)*pollfd_max);
-	if(!pollfds){
-		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-#endif
-
 	if(db->config->persistent_client_expiration > 0){
 		expiration_check_time = time(NULL) + 3600;
 	}
@@ -256,7 +525,15 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 #endif
 
 #ifndef WITH_EPOLL
-		memset(pollfds, -1, sizeof(struct pollfd)*pollfd_max);
+		pollfd_count = listensock_count + HASH_CNT(hh_sock, db->contexts_by_sock);
+#ifdef WITH_BRIDGE
+		/* Bridges that connect this time round aren't in contexts_by_sock yet. */
+		pollfd_count += db->bridge_count;
+#endif
+		if(loop__pollfds_reserve(&pollfds, &pollfd_max, pollfd_count)){
+			mosquitto__free(pollfds);
+			return MOSQ_ERR_NOMEM;
+		}
 
 		pollfd_index = 0;
 		for(i=0; i<listensock_count; i++){
@@ -267,113 +544,24 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 		}
 #endif
 
-		time_count = 0;
-		HASH_ITER(hh_sock, db->contexts_by_sock, context, ctxt_tmp){
-			if(time_count > 0){
-				time_count--;
-			}else{
-				time_count = 1000;
-				now = mosquitto_time();
-			}
-			context->pollfd_index = -1;
+		now = mosquitto_time();
+		sweep = (now != last_sweep);
+		last_sweep = now;
 
-			if(context->sock != INVALID_SOCKET){
-#ifdef WITH_BRIDGE
-				if(context->bridge){
-					mosquitto__check_keepalive(db, context);
-					if(context->bridge->round_robin == false
-							&& context->bridge->cur_address != 0
-							&& context->bridge->primary_retry
-							&& now > context->bridge->primary_retry){
-
-						if(context->bridge->primary_retry_sock == INVALID_SOCKET){
-							rc = net__try_connect(context->bridge->addresses[0].address,
-									context->bridge->addresses[0].port,
-									&context->bridge->primary_retry_sock, NULL, false);
-
-							if(rc == 0){
-								COMPAT_CLOSE(context->bridge->primary_retry_sock);
-								context->bridge->primary_retry_sock = INVALID_SOCKET;
-								context->bridge->primary_retry = 0;
-								net__socket_close(db, context);
-								context->bridge->cur_address = 0;
-							}
-						}else{
-							len = sizeof(int);
-							if(!getsockopt(context->bridge->primary_retry_sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len)){
-								if(err == 0){
-									COMPAT_CLOSE(context->bridge->primary_retry_sock);
-									context->bridge->primary_retry_sock = INVALID_SOCKET;
-									context->bridge->primary_retry = 0;
-									net__socket_close(db, context);
-									context->bridge->cur_address = context->bridge->address_count-1;
-								}else{
-									COMPAT_CLOSE(context->bridge->primary_retry_sock);
-									context->bridge->primary_retry_sock = INVALID_SOCKET;
-									context->bridge->primary_retry = now+5;
-								}
-							}else{
-								COMPAT_CLOSE(context->bridge->primary_retry_sock);
-								context->bridge->primary_retry_sock = INVALID_SOCKET;
-								context->bridge->primary_retry = now+5;
-							}
-						}
-					}
-				}
-#endif
-
-				/* Local bridges never time out in this fashion. */
-				if(!(context->keepalive)
-						|| context->bridge
-						|| now - context->last_msg_in <= (time_t)(context->keepalive)*3/2){
-
-					if(db__message_write(db, context) == MOSQ_ERR_SUCCESS){
 #ifdef WITH_EPOLL
-						if(context->current_out_packet || context->state == mosq_cs_connect_pending || context->ws_want_write){
-							if(!(context->events & EPOLLOUT)) {
-								ev.data.fd = context->sock;
-								ev.events = EPOLLIN | EPOLLOUT;
-								if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1) {
-									if((errno != EEXIST)||(epoll_ctl(db->epollfd, EPOLL_CTL_MOD, context->sock, &ev) == -1)) {
-											log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll re-registering to EPOLLOUT: %s", strerror(errno));
-									}
-								}
-								context->events = EPOLLIN | EPOLLOUT;
-							}
-							context->ws_want_write = false;
-						}
-						else{
-							if(context->events & EPOLLOUT) {
-								ev.data.fd = context->sock;
-								ev.events = EPOLLIN;
-								if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1) {
-									if((errno != EEXIST)||(epoll_ctl(db->epollfd, EPOLL_CTL_MOD, context->sock, &ev) == -1)) {
-											log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll re-registering to EPOLLIN: %s", strerror(errno));
-									}
-								}
-								context->events = EPOLLIN;
-							}
-						}
-#else
-						pollfds[pollfd_index].fd = context->sock;
-						pollfds[pollfd_index].events = POLLIN;
-						pollfds[pollfd_index].revents = 0;
-						if(context->current_out_packet || context->state == mosq_cs_connect_pending || context->ws_want_write){
-							pollfds[pollfd_index].events |= POLLOUT;
-							context->ws_want_write = false;
-						}
-						context->pollfd_index = pollfd_index;
-						pollfd_index++;
-#endif
-					}else{
-						do_disconnect(db, context, MOSQ_ERR_CONN_LOST);
-					}
-				}else{
-					/* Client has exceeded keepalive*1.5 */
-					do_disconnect(db, context, MOSQ_ERR_KEEPALIVE);
-				}
+		if(sweep){
+			HASH_ITER(hh_sock, db->contexts_by_sock, context, ctxt_tmp){
+				loop__context_service(db, context, now, sweep);
 			}
+		}else{
+			loop__pending_service(db, now);
 		}
+#else
+		HASH_ITER(hh_sock, db->contexts_by_sock, context, ctxt_tmp){
+			loop__context_service(db, context, now, sweep, pollfds, &pollfd_index);
+		}
+#endif
+		db__msg_store_frames_release(db);
 
 #ifdef WITH_BRIDGE
 		time_count = 0;
@@ -381,6 +569,7 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 			if(!db->bridges[i]) continue;
 
 			context = db->bridges[i];
+			stp__bridge_resume_check(db, context->bridge);
 
 			if(context->sock == INVALID_SOCKET){
 				if(time_count > 0){
@@ -507,8 +696,15 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 #endif
 					}
 				}
+			}else if(context->bridge->link_count > 1 && context->state == mosq_cs_connected){
+				bridge__links_check(db, context);
+			}
+			if(context->bridge->spool && context->state == mosq_cs_connected){
+				bridge__spool_drain(db, context);
 			}
 		}
+		stp__bpdu_flush(db);
+		bridge__interest_flush(db);
 #endif
 		now = time(NULL);
 		if(db->config->persistent_client_expiration > 0 && now > expiration_check_time){
@@ -707,6 +903,16 @@ void do_disconnect(struct mosquitto_db *db, struct mosquitto *context, int reaso
 	}else
 #endif
 	{
+#ifdef WITH_BRIDGE
+		if(context->bridge && !context->bridge_main){
+			if(context->state != mosq_cs_disconnecting && context->state != mosq_cs_disconnect_with_will){
+				stp__bridge_lost(db, context->bridge, reason);
+			}
+			if(context->bridge->link_count > 1){
+				bridge__links_disconnect(db, context);
+			}
+		}
+#endif
 		if(db->config->connection_messages == true){
 			if(context->id){
 				id = context->id;
@@ -722,18 +928,6 @@ void do_disconnect(struct mosquitto_db *db, struct mosquitto *context, int reaso
 						break;
 					case MOSQ_ERR_CONN_LOST:
 						log__printf(NULL, MOSQ_LOG_NOTICE, "Socket error on client %s, disconnecting.", id);
-                        if(context->is_bridge){
-                            for(int i=0; i<db->config->bridge_count; i++){
-                                if(strcmp(db->config->bridges[i].local_clientid, id) == 0){
-                                    log__printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s:%d fails", db->config->bridges[i].addresses->address, db->config->bridges[i].addresses->port);
-                                    //start again as a root
-                                    db->config->bridges[i].is_reached = false;
-                                    db->convergence = false;
-                                    mosquitto_restart_stp(db, db->config->bridges[i].addresses);
-
-                                }
-                            }
-                        }
 						break;
 					case MOSQ_ERR_AUTH:
 						log__printf(NULL, MOSQ_LOG_NOTICE, "Client %s disconnected, no longer authorised.", id);
@@ -781,6 +975,8 @@ static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pol
 	if(!context) {
 		return;
 	}
+	/* A finished write may mean it no longer wants EPOLLOUT. */
+	loop__context_pending(db, context);
 	for (i=0;i<1;i++) {
 #else
 	HASH_ITER(hh_sock, db->contexts_by_sock, context, ctxt_tmp){
@@ -885,6 +1081,8 @@ static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pol
 		if(pollfds[context->pollfd_index].revents & POLLIN){
 #endif
 #endif
+			/* Anything read may free inflight slots or need an answer. */
+			loop__context_pending(db, context);
 			do{
 				if(packet__read(db, context)){
 					do_disconnect(db, context, MOSQ_ERR_CONN_LOST);
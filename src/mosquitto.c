@@ -52,6 +52,7 @@ Contributors:
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
 #include "util_mosq.h"
+#include "util_list.h"
 #include "ip_addr.h"
 
 struct mosquitto_db int_db;
@@ -396,7 +397,19 @@ int main(int argc, char *argv[])
 #endif
 	session_expiry__remove_all(&int_db);
 
+#ifdef WITH_BRIDGE
+	/* Free the bridge links first, so that the loops below never hold one
+	 * as the next context while its bridge is being cleaned up. */
+	for(i=0; i<int_db.bridge_count; i++){
+		if(int_db.bridges[i] && int_db.bridges[i]->bridge){
+			bridge__links_cleanup(&int_db, int_db.bridges[i]);
+		}
+	}
+#endif
 	HASH_ITER(hh_id, int_db.contexts_by_id, ctxt, ctxt_tmp){
+#ifdef WITH_BRIDGE
+		if(ctxt->bridge_main) continue;
+#endif
 #ifdef WITH_WEBSOCKETS
 		if(!ctxt->wsi){
 			context__cleanup(&int_db, ctxt, true);
@@ -406,6 +419,9 @@ int main(int argc, char *argv[])
 #endif
 	}
 	HASH_ITER(hh_sock, int_db.contexts_by_sock, ctxt, ctxt_tmp){
+#ifdef WITH_BRIDGE
+		if(ctxt->bridge_main) continue;
+#endif
 		context__cleanup(&int_db, ctxt, true);
 	}
 #ifdef WITH_BRIDGE
@@ -415,6 +431,8 @@ int main(int argc, char *argv[])
 		}
 	}
 	mosquitto__free(int_db.bridges);
+	stp__ports_cleanup(&int_db);
+	stp__dedup_cleanup(&int_db);
 #endif
 	context__free_disused(&int_db);
 
@@ -70,6 +70,9 @@ Contributors:
 
 #define WEBSOCKET_CLIENT -2
 
+/* Upper limit for bridge_links, a link carries at least one STP_DEDUP_SHARDS */
+#define BRIDGE_LINKS_MAX STP_DEDUP_SHARDS
+
 /* ========================================
  * UHPA data types
  * ======================================== */
@@ -236,6 +239,8 @@ struct mosquitto__listener {
 	int client_count;
 	enum mosquitto_protocol protocol;
 	int socket_domain;
+	int listen_backlog; /* 0 for SOMAXCONN */
+	bool reuse_port; /* Other sockets may listen on the same port, see SO_REUSEPORT */
 	bool use_username_as_clientid;
 	uint8_t maximum_qos;
 	uint16_t max_topic_alias;
@@ -285,6 +290,7 @@ struct mosquitto__config {
 	char *log_timestamp_format;
 	char *log_file;
 	FILE *log_fptr;
+	int match_cache_bytes;
 	uint16_t max_inflight_messages;
 	uint16_t max_keepalive;
 	uint32_t max_packet_size;
@@ -302,6 +308,8 @@ struct mosquitto__config {
 	int sys_interval;
 	bool upgrade_outgoing_qos;
 	char *user;
+	int write_batch_bytes;
+	int zero_copy_bytes;
 #ifdef WITH_WEBSOCKETS
 	int websockets_log_level;
 	int websockets_headers_size;
@@ -310,6 +318,8 @@ struct mosquitto__config {
 #ifdef WITH_BRIDGE
 	struct mosquitto__bridge *bridges;
 	int bridge_count;
+	int stp_priority;
+	bool stp_rapid;
 #endif
 	struct mosquitto__security_options security_options;
 };
@@ -337,14 +347,32 @@ struct mosquitto__subshared {
 	struct mosquitto__subleaf *subs;
 };
 
+/* A node keeps its children in an array. Each entry carries the length
+ * and first bytes of the child's topic, so that looking up a level in a
+ * small set doesn't touch the children themselves. Past
+ * SUBHIER_INLINE_MAX children they are also hashed in child_index. */
+#define SUBHIER_INLINE_MAX 8
+
+struct mosquitto__subhier_child {
+	uint64_t key;
+	struct mosquitto__subhier *hier;
+};
+
 struct mosquitto__subhier {
 	UT_hash_handle hh;
 	struct mosquitto__subhier *parent;
-	struct mosquitto__subhier *children;
+	struct mosquitto__subhier_child *children;
+	struct mosquitto__subhier *child_index;
+	struct mosquitto__subhier *child_plus;
+	struct mosquitto__subhier *child_multi;
 	struct mosquitto__subleaf *subs;
 	struct mosquitto__subshared *shared;
 	struct mosquitto_msg_store *retained;
 	char *topic;
+	uint32_t child_count;
+	uint32_t child_max;
+	uint32_t parent_pos;
+	uint32_t generation; /* Bumped whenever a child is added or removed */
 	uint16_t topic_len;
 };
 
@@ -374,6 +402,11 @@ struct mosquitto_msg_store{
 	uint8_t qos;
 	bool retain;
 	uint8_t origin;
+	struct mosquitto__stp_stamp stamp;
+	struct mosquitto__frame *frames; /* Encodings being sent, see send__publish_store() */
+	struct mosquitto__frame *payload_frame; /* Received packet the payload is in, see zero_copy_bytes */
+	struct mosquitto_msg_store *frames_prev;
+	struct mosquitto_msg_store *frames_next;
 };
 
 struct mosquitto_client_msg{
@@ -420,27 +453,47 @@ typedef struct {
     int port;
 } BROKER;
 
-typedef struct port_list{
-    BROKER broker;
-    struct port_list* next;
-} PORT_LIST;
+/* Sequence numbers already seen from one origin broker. */
+struct stp__dedup{
+    uint64_t origin;
+    uint64_t top[STP_DEDUP_SHARDS]; /* Highest sequence number seen */
+    uint64_t window[STP_DEDUP_SHARDS]; /* Bit n is set if top-n has been seen */
+    UT_hash_handle hh;
+};
 
 struct mosquitto_db{
 	dbid_t last_db_id;
     char *ip_address;
 	struct mosquitto__subhier *subs;
+	struct sub__cache_entry *match_cache; /* Matches of recently published topics, by topic */
+	struct sub__cache_entry *match_cache_lru; /* The same entries, most recently used first */
+	size_t match_cache_used;
+	struct mosquitto_msg_store *frame_stores; /* Stores with frames, dropped once round the loop */
 	struct mosquitto__unpwd *unpwd;
 	struct mosquitto__unpwd *psk_id;
 	struct mosquitto *contexts_by_id;
 	struct mosquitto *contexts_by_sock;
 	struct mosquitto *contexts_for_free;
+	struct mosquitto *loop_pending; /* Clients to look at next time round the main loop */
 #ifdef WITH_BRIDGE
 	struct mosquitto **bridges;
     struct mosquitto__stp *stp;
     struct mosquitto__bpdu__packet *old_bpdu;
-    PORT_LIST *blocked_ports;
-    PORT_LIST *designated_ports;
+    struct mosquitto__bridge *stp_ports; /* Every bridge, by stp__port_id() */
+    unsigned int stp_generation; /* Bumped on any change of port role */
+    unsigned long stp_reconvergences; /* Times the tree was rebuilt or the root port replaced */
+    int stp_connected_count; /* Bridges that have been connected at least once */
+    uint64_t stp_origin; /* Our id in the stamps of the PUBLISHes we originate */
+    uint64_t stp_seq[STP_DEDUP_SHARDS]; /* Next sequence number for those stamps, by shard */
+    struct stp__dedup *stp_dedup;
+    int stp_dedup_count;
     BROKER king_port;
+    struct mosquitto__bridge *alternate_port; /* Ready to take over from the root port */
+    uint64_t root_lost_ms; /* When the root port was lost, 0 if it wasn't */
+    bool bpdu_pending; /* At least one bridge has a held back BPDU */
+    bool interest_dirty; /* Subscriptions or advertised interest have changed */
+    unsigned int interest_generation; /* stp_generation of the last interest update */
+    uint64_t interest_sent_ms; /* When interest updates were last sent */
     bool convergence;
     time_t start_time;
 #endif
@@ -489,6 +542,28 @@ struct mosquitto__bridge_topic{
 	char *remote_prefix;
 	char *local_topic; /* topic prefixed with local_prefix */
 	char *remote_topic; /* topic prefixed with remote_prefix */
+	size_t local_prefix_len;
+	size_t remote_prefix_len;
+};
+
+struct bridge__remap_node;
+
+/* Outgoing messages of a bridge that didn't fit in memory, see bridge_spool.c. */
+struct bridge__spool{
+	char *prefix; /* "<bridge_spool_location>/<connection name>." */
+	FILE *wfile; /* Segment wseg, being appended to */
+	FILE *rfile; /* Segment rseg, being read back */
+	unsigned int wseg;
+	unsigned int rseg;
+	uint64_t bytes; /* Spooled and not read back yet */
+	bool draining; /* Messages being read back go to the queue, not the spool */
+	bool dropping;
+};
+
+/* One subscription filter in a set of advertised interest. */
+struct bridge__filter{
+	UT_hash_handle hh;
+	char *filter;
 };
 
 struct bridge_address{
@@ -496,6 +571,19 @@ struct bridge_address{
 	int port;
 };
 
+/* Extra connection of a bridge with bridge_links > 1. */
+struct mosquitto__bridge_link{
+	struct mosquitto *context;
+	time_t restart_t;
+};
+
+/* Counters of a bridge, published under $SYS/broker/stp/bridges/<name>/. */
+struct bridge__stats{
+	unsigned long msgs_forwarded; /* PUBLISHes sent on the bridge */
+	unsigned long msgs_blocked; /* PUBLISHes dropped because the port isn't forwarding */
+	unsigned long role_changes;
+};
+
 struct mosquitto__bridge{
 	char *name;
 	struct bridge_address *addresses;
@@ -511,6 +599,8 @@ struct mosquitto__bridge{
 	struct mosquitto__bridge_topic *topics;
 	int topic_count;
 	bool topic_remapping;
+	struct bridge__remap_node *remap_in; /* Compiled from topics by bridge__remap_compile() */
+	struct bridge__remap_node *remap_out;
 	enum mosquitto__protocol protocol_version;
 	time_t restart_t;
 
@@ -520,6 +610,39 @@ struct mosquitto__bridge{
     struct mosquitto__bpdu__packet *last_bpdu;
     bool is_connected;
     bool is_reached;
+    bool bpdu_binary; /* Peer accepted binary BPDUs in its CONNACK */
+    bool publish_stamp; /* Peer accepted stamped PUBLISHes in its CONNACK */
+    int path_cost; /* Added to the root distance of BPDUs received from this bridge */
+    uint64_t ping_sent_ms; /* When the outstanding PINGREQ was sent, 0 if none */
+    int rtt; /* Smoothed PINGREQ round trip time, in ms */
+    uint64_t bpdu_sent_ms; /* When we last sent a BPDU on this bridge */
+    bool bpdu_pending; /* BPDU held back by the hold-down timer */
+    uint64_t bpdu_recv_ms; /* When we last handled a BPDU from the peer, 0 if never */
+    struct bridge__stats stats;
+    struct bridge__stats stats_published; /* As of the last $SYS update */
+    const char *role_published;
+    int rtt_published;
+    uint64_t stp_id; /* stp__port_id() of the broker at the far end */
+    UT_hash_handle hh_stp;
+	bool interest_adverts; /* Peer accepted interest updates in its CONNACK */
+	struct bridge__filter *advertised; /* Interest we have told the peer about */
+	bool interest_synced; /* The peer has had an update since the bridge connected */
+	struct bridge__filter *interest; /* Interest the peer has told us about */
+	struct bridge__remap_node *interest_tree; /* Compiled from interest */
+	struct mosquitto *interest_from; /* Incoming connection the peer sends interest on, NULL until it has */
+	char *spool_location; /* bridge_spool_location, NULL if the bridge has no spool */
+	int spool_memory; /* bridge_spool_memory */
+	unsigned long spool_max_size; /* bridge_spool_max_size, 0 for no limit */
+	struct bridge__spool *spool;
+	bool local_subscribed; /* The local subscriptions for the out topics are in place */
+	bool peer_stale; /* The peer may have missed messages: never connected yet, or one was dropped while the bridge was down */
+	int resume_timeout; /* stp_resume_timeout, in seconds */
+	uint64_t down_ms; /* When the bridge dropped, while it keeps its role for resume_timeout */
+	int down_reason;
+	bool compression; /* bridge_compression zlib */
+	int compress_level; /* bridge_compression_level */
+	int link_count; /* Connections to the peer, including the bridge's own */
+	struct mosquitto__bridge_link *links; /* The link_count-1 extra connections */
     
 	char *remote_clientid;
 	char *remote_username;
@@ -572,6 +695,8 @@ struct libws_mqtt_data {
  * ============================================================ */
 int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int listensock_count);
 struct mosquitto_db *mosquitto__get_db(void);
+void loop__context_pending(struct mosquitto_db *db, struct mosquitto *context);
+void loop__context_pending_remove(struct mosquitto_db *db, struct mosquitto *context);
 
 /* ============================================================
  * Config functions
@@ -635,13 +760,15 @@ void db__limits_set(unsigned long inflight_bytes, int queued, unsigned long queu
 int db__message_count(int *count);
 int db__message_delete_outgoing(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state expect_state, int qos);
 int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, mosquitto_property *properties);
+bool db__message_insert_ready(struct mosquitto_db *db, struct mosquitto *context, int qos);
 int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid);
 int db__message_update_outgoing(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state state, int qos);
 int db__message_write(struct mosquitto_db *db, struct mosquitto *context);
 void db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data);
 int db__messages_delete(struct mosquitto_db *db, struct mosquitto *context);
+void db__messages_delete_list(struct mosquitto_db *db, struct mosquitto_client_msg **head);
 int db__messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain, uint32_t message_expiry_interval, mosquitto_property **properties);
-int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, uint16_t source_mid, char *topic, int qos, uint32_t payloadlen, mosquitto__payload_uhpa *payload, int retain, struct mosquitto_msg_store **stored, uint32_t message_expiry_interval, mosquitto_property *properties, dbid_t store_id, enum mosquitto_msg_origin origin);
+int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, uint16_t source_mid, char *topic, int qos, uint32_t payloadlen, mosquitto__payload_uhpa *payload, struct mosquitto__frame *payload_frame, int retain, struct mosquitto_msg_store **stored, uint32_t message_expiry_interval, mosquitto_property *properties, dbid_t store_id, enum mosquitto_msg_origin origin);
 int db__message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_msg_store **stored);
 void db__msg_store_add(struct mosquitto_db *db, struct mosquitto_msg_store *store);
 void db__msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *store);
@@ -649,6 +776,8 @@ void db__msg_store_ref_inc(struct mosquitto_msg_store *store);
 void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store);
 void db__msg_store_clean(struct mosquitto_db *db);
 void db__msg_store_compact(struct mosquitto_db *db);
+void db__msg_store_frame_add(struct mosquitto_db *db, struct mosquitto_msg_store *store, struct mosquitto__frame *frame);
+void db__msg_store_frames_release(struct mosquitto_db *db);
 int db__message_reconnect_reset(struct mosquitto_db *db, struct mosquitto *context);
 void sys_tree__init(struct mosquitto_db *db);
 void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time);
@@ -665,8 +794,10 @@ struct broker__info *alloc__info(int port);
  * ============================================================ */
 int sub__add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, uint32_t identifier, int options, struct mosquitto__subhier **root);
 struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent, struct mosquitto__subhier **sibling, const char *topic, size_t len);
+struct mosquitto__subhier *sub__child_find(struct mosquitto__subhier *parent, const char *topic, uint16_t len);
 int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct mosquitto__subhier *root, uint8_t *reason);
 void sub__tree_print(struct mosquitto__subhier *root, int level);
+void sub__cache_clean(struct mosquitto_db *db);
 int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context);
 int sub__retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos, uint32_t subscription_identifier);
 int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store **stored);
@@ -703,6 +834,31 @@ int bridge__connect_step1(struct mosquitto_db *db, struct mosquitto *context);
 int bridge__connect_step2(struct mosquitto_db *db, struct mosquitto *context);
 int bridge__connect_step3(struct mosquitto_db *db, struct mosquitto *context);
 void bridge__packet_cleanup(struct mosquitto *context);
+int bridge__links_new(struct mosquitto_db *db, struct mosquitto *context);
+void bridge__links_check(struct mosquitto_db *db, struct mosquitto *context);
+void bridge__links_disconnect(struct mosquitto_db *db, struct mosquitto *context);
+void bridge__links_cleanup(struct mosquitto_db *db, struct mosquitto *context);
+struct mosquitto *bridge__link_select(struct mosquitto *context, const struct mosquitto__stp_stamp *stamp);
+int bridge__remap_compile(struct mosquitto__bridge *bridge);
+void bridge__remap_cleanup(struct mosquitto__bridge *bridge);
+int bridge__remap_topic(struct mosquitto__bridge *bridge, enum mosquitto__bridge_direction direction, const char *topic, char **mapped);
+int bridge__filter_tree_add(struct bridge__remap_node **root, const char *sub, int index);
+int bridge__filter_tree_match(struct bridge__remap_node *root, const char *topic);
+void bridge__filter_tree_free(struct bridge__remap_node *root);
+void bridge__interest_flush(struct mosquitto_db *db);
+int bridge__interest_handle(struct mosquitto_db *db, struct mosquitto *context, const uint8_t *payload, uint32_t payloadlen);
+bool bridge__interest_match(struct mosquitto__bridge *bridge, const char *topic);
+void bridge__interest_connected(struct mosquitto_db *db, struct mosquitto__bridge *bridge, bool adverts);
+void bridge__interest_disconnected(struct mosquitto_db *db, struct mosquitto *context);
+void bridge__interest_cleanup(struct mosquitto__bridge *bridge);
+int bridge__spool_open(struct mosquitto__bridge *bridge);
+void bridge__spool_close(struct mosquitto__bridge *bridge);
+int bridge__spool_write(struct mosquitto__bridge *bridge, struct mosquitto_msg_store *stored, int qos, bool retain);
+void bridge__spool_drain(struct mosquitto_db *db, struct mosquitto *context);
+void bridge__compress_connected(struct mosquitto_db *db, struct mosquitto *context, bool accepted);
+void bridge__compress_queue(struct mosquitto *context);
+int bridge__compress_handle(struct mosquitto_db *db, struct mosquitto *context, const uint8_t *payload, uint32_t payloadlen);
+bool bridge__compress_in_batch(void);
 #endif
 
 /* ============================================================
@@ -478,6 +478,16 @@ int net__socket_listen(struct mosquitto__listener *listener)
 		ss_opt = 1;
 		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &ss_opt, sizeof(ss_opt));
 #endif
+#ifdef SO_REUSEPORT
+		if(listener->reuse_port){
+			ss_opt = 1;
+			if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &ss_opt, sizeof(ss_opt))){
+				net__print_error(MOSQ_LOG_ERR, "Error: %s");
+				COMPAT_CLOSE(sock);
+				return 1;
+			}
+		}
+#endif
 #ifdef IPV6_V6ONLY
 		ss_opt = 1;
 		setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &ss_opt, sizeof(ss_opt));
@@ -507,7 +517,9 @@ int net__socket_listen(struct mosquitto__listener *listener)
 			return 1;
 		}
 
-		if(listen(sock, 100) == -1){
+		/* A short backlog drops SYNs when many clients reconnect at once,
+		 * and each of them then waits a second or more to retry. */
+		if(listen(sock, listener->listen_backlog ? listener->listen_backlog : SOMAXCONN) == -1){
 			net__print_error(MOSQ_LOG_ERR, "Error: %s");
 			COMPAT_CLOSE(sock);
 			return 1;
@@ -283,7 +283,7 @@ static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fp
 
 	rc = db__message_store(db, &chunk.source, chunk.F.source_mid,
 			chunk.topic, chunk.F.qos, chunk.F.payloadlen,
-			&chunk.payload, chunk.F.retain, &stored, message_expiry_interval,
+			&chunk.payload, NULL, chunk.F.retain, &stored, message_expiry_interval,
 			chunk.properties, chunk.F.store_id, mosq_mo_client);
 
 	mosquitto__free(chunk.source.id);
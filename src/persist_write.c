@@ -192,12 +192,12 @@ static int persist__client_save(struct mosquitto_db *db, FILE *db_fptr)
 
 static int persist__subs_retain_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto__subhier *node, const char *topic, int level)
 {
-	struct mosquitto__subhier *subhier, *subhier_tmp;
 	struct mosquitto__subleaf *sub;
 	struct P_retain retain_chunk;
 	struct P_sub sub_chunk;
 	char *thistopic;
 	size_t slen;
+	uint32_t i;
 	int rc;
 
 	memset(&retain_chunk, 0, sizeof(struct P_retain));
@@ -243,8 +243,8 @@ static int persist__subs_retain_save(struct mosquitto_db *db, FILE *db_fptr, str
 		}
 	}
 
-	HASH_ITER(hh, node->children, subhier, subhier_tmp){
-		persist__subs_retain_save(db, db_fptr, subhier, thistopic, level+1);
+	for(i=0; i<node->child_count; i++){
+		persist__subs_retain_save(db, db_fptr, node->children[i].hier, thistopic, level+1);
 	}
 	mosquitto__free(thistopic);
 	return MOSQ_ERR_SUCCESS;
@@ -253,10 +253,11 @@ static int persist__subs_retain_save(struct mosquitto_db *db, FILE *db_fptr, str
 static int persist__subs_retain_save_all(struct mosquitto_db *db, FILE *db_fptr)
 {
 	struct mosquitto__subhier *subhier, *subhier_tmp;
+	uint32_t i;
 
 	HASH_ITER(hh, db->subs, subhier, subhier_tmp){
-		if(subhier->children){
-			persist__subs_retain_save(db, db_fptr, subhier->children, "", 0);
+		for(i=0; i<subhier->child_count; i++){
+			persist__subs_retain_save(db, db_fptr, subhier->children[i].hier, "", 0);
 		}
 	}
 	
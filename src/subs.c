@@ -64,6 +64,52 @@ struct sub__token {
 	uint16_t topic_len;
 };
 
+/* A topic level as a slice of the topic it came from, for matching a
+ * PUBLISH without copying its topic apart. */
+struct sub__slice {
+	const char *topic;
+	uint16_t topic_len;
+};
+
+/* Topics up to this many levels are sliced on the stack. */
+#define SUB_SLICE_MAX 32
+
+/* Match cache.
+ *
+ * With match_cache_bytes set, the nodes a PUBLISH topic matched are kept
+ * for the next PUBLISH on the same topic, so it can skip sub__search().
+ * Only the shape of the tree decides which nodes a topic matches, not the
+ * subscriptions on them, so an entry also records every node the search
+ * looked at with its generation, in the order it looked at them. Adding or
+ * removing a child bumps the generation of the parent, so an entry is
+ * still good if none of those generations has changed. As a node is only
+ * freed after being removed from its parent, which comes earlier in the
+ * entry, the check never reaches a freed node. Retained PUBLISHes, which
+ * may change the tree themselves, don't use the cache.
+ */
+#define SUB_CACHE_STEPS_MAX 64
+
+struct sub__cache_step {
+	struct mosquitto__subhier *hier;
+	uint32_t generation;
+	bool match; /* Deliver to this node, rather than only check it */
+};
+
+struct sub__cache_record {
+	struct sub__cache_step steps[SUB_CACHE_STEPS_MAX];
+	int step_count;
+	bool overflow;
+};
+
+struct sub__cache_entry {
+	UT_hash_handle hh;
+	struct sub__cache_entry *prev, *next;
+	struct sub__cache_step *steps;
+	char *topic;
+	size_t size;
+	int step_count;
+};
+
 
 static int subs__send(struct mosquitto_db *db, struct mosquitto__subleaf *leaf, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
 {
@@ -73,6 +119,20 @@ static int subs__send(struct mosquitto_db *db, struct mosquitto__subleaf *leaf,
 	mosquitto_property *properties = NULL;
 	int rc2;
 
+#ifdef WITH_BRIDGE
+	/* Don't queue anything for a bridge whose port is not forwarding, or
+	 * whose peer has told us it has no use for the message. */
+	if(leaf->context->bridge){
+		if(!stp__port_forwarding(leaf->context->bridge)){
+			leaf->context->bridge->stats.msgs_blocked++;
+			return MOSQ_ERR_SUCCESS;
+		}
+		if(!bridge__interest_match(leaf->context->bridge, topic)){
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+#endif
+
 	/* Check for ACL topic access. */
 	rc2 = mosquitto_acl_check(db, leaf->context, topic, stored->payloadlen, UHPA_ACCESS(stored->payload, stored->payloadlen), stored->qos, stored->retain, MOSQ_ACL_READ);
 	if(rc2 == MOSQ_ERR_ACL_DENIED){
@@ -276,6 +336,38 @@ cleanup:
 	return 1;
 }
 
+/* Split topic into the same levels sub__topic_tokenise() would, but as
+ * slices pointing into topic. Returns the number of levels, which is at
+ * most max, or -1 if topic has more levels than that. */
+static int sub__topic_slice(const char *topic, struct sub__slice *slices, int max)
+{
+	const char *start;
+	int count = 0;
+
+	assert(topic);
+
+	if(topic[0] != '$'){
+		if(max == 0) return -1;
+		slices[count].topic = topic;
+		slices[count].topic_len = 0;
+		count++;
+	}
+
+	start = topic;
+	while(1){
+		if(*topic == '/' || *topic == '\0'){
+			if(count == max) return -1;
+			slices[count].topic = start;
+			slices[count].topic_len = topic - start;
+			count++;
+			if(*topic == '\0') break;
+			start = topic+1;
+		}
+		topic++;
+	}
+	return count;
+}
+
 static void sub__topic_tokens_free(struct sub__token *tokens)
 {
 	struct sub__token *tail;
@@ -455,16 +547,124 @@ static int sub__add_normal(struct mosquitto_db *db, struct mosquitto *context, i
 }
 
 
+static uint64_t sub__child_key(const char *topic, uint16_t len)
+{
+	uint8_t buf[8];
+	uint64_t key;
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = len & 0xFF;
+	buf[1] = (len >> 8) & 0xFF;
+	memcpy(&buf[2], topic, len < 6 ? len : 6);
+	memcpy(&key, buf, sizeof(key));
+	return key;
+}
+
+
+struct mosquitto__subhier *sub__child_find(struct mosquitto__subhier *parent, const char *topic, uint16_t len)
+{
+	struct mosquitto__subhier *child;
+	uint64_t key;
+	uint32_t i;
+
+	if(parent->child_index){
+		HASH_FIND(hh, parent->child_index, topic, len, child);
+		return child;
+	}
+
+	/* The key holds all of topics up to 6 bytes long, so only longer
+	 * ones need comparing past it. */
+	key = sub__child_key(topic, len);
+	for(i=0; i<parent->child_count; i++){
+		if(parent->children[i].key == key
+				&& (len <= 6 || !memcmp(&parent->children[i].hier->topic[6], &topic[6], len-6))){
+
+			return parent->children[i].hier;
+		}
+	}
+	return NULL;
+}
+
+
+static int sub__child_add(struct mosquitto__subhier *parent, struct mosquitto__subhier *child)
+{
+	struct mosquitto__subhier_child *children;
+	uint32_t max, i;
+
+	if(parent->child_count == parent->child_max){
+		max = parent->child_max ? parent->child_max*2 : 1;
+		children = mosquitto__realloc(parent->children, max*sizeof(struct mosquitto__subhier_child));
+		if(!children) return MOSQ_ERR_NOMEM;
+		parent->children = children;
+		parent->child_max = max;
+	}
+	child->parent_pos = parent->child_count;
+	parent->children[parent->child_count].key = sub__child_key(child->topic, child->topic_len);
+	parent->children[parent->child_count].hier = child;
+	parent->child_count++;
+	parent->generation++;
+
+	if(parent->child_index){
+		HASH_ADD_KEYPTR(hh, parent->child_index, child->topic, child->topic_len, child);
+	}else if(parent->child_count > SUBHIER_INLINE_MAX){
+		for(i=0; i<parent->child_count; i++){
+			child = parent->children[i].hier;
+			HASH_ADD_KEYPTR(hh, parent->child_index, child->topic, child->topic_len, child);
+		}
+		child = parent->children[parent->child_count-1].hier;
+	}
+
+	if(child->topic_len == 1){
+		if(child->topic[0] == '+'){
+			parent->child_plus = child;
+		}else if(child->topic[0] == '#'){
+			parent->child_multi = child;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void sub__child_remove(struct mosquitto__subhier *parent, struct mosquitto__subhier *child)
+{
+	uint32_t pos = child->parent_pos;
+
+	if(parent->child_plus == child) parent->child_plus = NULL;
+	if(parent->child_multi == child) parent->child_multi = NULL;
+
+	if(parent->child_index){
+		if(parent->child_count-1 > SUBHIER_INLINE_MAX/2){
+			HASH_DELETE(hh, parent->child_index, child);
+		}else{
+			/* Few enough left to go back to scanning the array. */
+			HASH_CLEAR(hh, parent->child_index);
+		}
+	}
+
+	parent->child_count--;
+	parent->generation++;
+	if(pos != parent->child_count){
+		parent->children[pos] = parent->children[parent->child_count];
+		parent->children[pos].hier->parent_pos = pos;
+	}
+	if(parent->child_count == 0){
+		mosquitto__free(parent->children);
+		parent->children = NULL;
+		parent->child_max = 0;
+	}
+}
+
+
 static int sub__add_context(struct mosquitto_db *db, struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, struct sub__token *tokens, char *sharename)
 {
 	struct mosquitto__subhier *branch;
 
 	/* Find leaf node */
 	while(tokens){
-		HASH_FIND(hh, subhier->children, tokens->topic, tokens->topic_len, branch);
+		branch = sub__child_find(subhier, tokens->topic, tokens->topic_len);
 		if(!branch){
 			/* Not found */
-			branch = sub__add_hier_entry(subhier, &subhier->children, tokens->topic, tokens->topic_len);
+			branch = sub__add_hier_entry(subhier, NULL, tokens->topic, tokens->topic_len);
 			if(!branch) return MOSQ_ERR_NOMEM;
 		}
 		subhier = branch;
@@ -580,37 +780,52 @@ static int sub__remove_recurse(struct mosquitto_db *db, struct mosquitto *contex
 		}
 	}
 
-	HASH_FIND(hh, subhier->children, tokens->topic, tokens->topic_len, branch);
+	branch = sub__child_find(subhier, tokens->topic, tokens->topic_len);
 	if(branch){
 		sub__remove_recurse(db, context, branch, tokens->next, reason, sharename);
-		if(!branch->children && !branch->subs && !branch->retained && !branch->shared){
-			HASH_DELETE(hh, subhier->children, branch);
-			mosquitto__free(branch->topic);
+		if(!branch->child_count && !branch->subs && !branch->retained && !branch->shared){
+			sub__child_remove(subhier, branch);
 			mosquitto__free(branch);
 		}
 	}
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhier, struct sub__token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
+static void sub__cache_step(struct sub__cache_record *rec, struct mosquitto__subhier *hier, bool match)
+{
+	if(rec->step_count == SUB_CACHE_STEPS_MAX){
+		rec->overflow = true;
+		return;
+	}
+	rec->steps[rec->step_count].hier = hier;
+	rec->steps[rec->step_count].generation = hier->generation;
+	rec->steps[rec->step_count].match = match;
+	rec->step_count++;
+}
+
+
+static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhier, const struct sub__slice *slices, int count, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain, struct sub__cache_record *rec)
 {
 	/* FIXME - need to take into account source_id if the client is a bridge */
 	struct mosquitto__subhier *branch;
 	int rc;
 	bool have_subscribers = false;
 
-	if(tokens){
+	if(rec) sub__cache_step(rec, subhier, false);
+
+	if(count > 0){
 		/* Check for literal match */
-		HASH_FIND(hh, subhier->children, tokens->topic, tokens->topic_len, branch);
+		branch = sub__child_find(subhier, slices[0].topic, slices[0].topic_len);
 
 		if(branch){
-			rc = sub__search(db, branch, tokens->next, source_id, topic, qos, retain, stored, set_retain);
+			rc = sub__search(db, branch, slices+1, count-1, source_id, topic, qos, retain, stored, set_retain, rec);
 			if(rc == MOSQ_ERR_SUCCESS){
 				have_subscribers = true;
 			}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
 				return rc;
 			}
-			if(!tokens->next){
+			if(count == 1){
+				if(rec) sub__cache_step(rec, branch, true);
 				rc = subs__process(db, branch, source_id, topic, qos, retain, stored, set_retain);
 				if(rc == MOSQ_ERR_SUCCESS){
 					have_subscribers = true;
@@ -621,16 +836,17 @@ static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhi
 		}
 
 		/* Check for + match */
-		HASH_FIND(hh, subhier->children, "+", 1, branch);
+		branch = subhier->child_plus;
 
 		if(branch){
-			rc = sub__search(db, branch, tokens->next, source_id, topic, qos, retain, stored, false);
+			rc = sub__search(db, branch, slices+1, count-1, source_id, topic, qos, retain, stored, false, rec);
 			if(rc == MOSQ_ERR_SUCCESS){
 				have_subscribers = true;
 			}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
 				return rc;
 			}
-			if(!tokens->next){
+			if(count == 1){
+				if(rec) sub__cache_step(rec, branch, true);
 				rc = subs__process(db, branch, source_id, topic, qos, retain, stored, false);
 				if(rc == MOSQ_ERR_SUCCESS){
 					have_subscribers = true;
@@ -642,12 +858,14 @@ static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhi
 	}
 
 	/* Check for # match */
-	HASH_FIND(hh, subhier->children, "#", 1, branch);
-	if(branch && !branch->children){
+	branch = subhier->child_multi;
+	if(branch && rec) sub__cache_step(rec, branch, false);
+	if(branch && !branch->child_count){
 		/* The topic matches due to a # wildcard - process the
 		 * subscriptions but *don't* return. Although this branch has ended
 		 * there may still be other subscriptions to deal with.
 		 */
+		if(rec) sub__cache_step(rec, branch, true);
 		rc = subs__process(db, branch, source_id, topic, qos, retain, stored, false);
 		if(rc == MOSQ_ERR_SUCCESS){
 			have_subscribers = true;
@@ -664,31 +882,34 @@ static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhi
 }
 
 
+/* Add a node for topic below parent or, for the top of the tree, to the
+ * sibling hash. The topic is stored in the same allocation as the node. */
 struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent, struct mosquitto__subhier **sibling, const char *topic, size_t len)
 {
 	struct mosquitto__subhier *child;
 
-	assert(sibling);
+	assert(parent || sibling);
 
-	child = mosquitto__calloc(1, sizeof(struct mosquitto__subhier));
+	child = mosquitto__calloc(1, sizeof(struct mosquitto__subhier) + len + 1);
 	if(!child){
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return NULL;
 	}
 	child->parent = parent;
 	child->topic_len = len;
-	child->topic = malloc(len+1);
-	if(!child->topic){
-		child->topic_len = 0;
-		mosquitto__free(child);
-		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return NULL;
+	child->topic = (char *)&child[1];
+	memcpy(child->topic, topic, len);
+
+	if(parent){
+		if(sub__child_add(parent, child)){
+			mosquitto__free(child);
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return NULL;
+		}
 	}else{
-		strncpy(child->topic, topic, child->topic_len+1);
+		HASH_ADD_KEYPTR(hh, *sibling, child->topic, child->topic_len, child);
 	}
 
-	HASH_ADD_KEYPTR(hh, *sibling, child->topic, child->topic_len, child);
-
 	return child;
 }
 
@@ -740,6 +961,9 @@ int sub__add(struct mosquitto_db *db, struct mosquitto *context, const char *sub
 	rc = sub__add_context(db, context, qos, identifier, options, subhier, tokens, sharename);
 
 	sub__topic_tokens_free(tokens);
+#ifdef WITH_BRIDGE
+	db->interest_dirty = true;
+#endif
 
 	return rc;
 }
@@ -784,20 +1008,157 @@ int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *
 	}
 
 	sub__topic_tokens_free(tokens);
+#ifdef WITH_BRIDGE
+	db->interest_dirty = true;
+#endif
 
 	return rc;
 }
 
+static void sub__cache_remove(struct mosquitto_db *db, struct sub__cache_entry *entry)
+{
+	HASH_DELETE(hh, db->match_cache, entry);
+	DL_DELETE(db->match_cache_lru, entry);
+	db->match_cache_used -= entry->size;
+	mosquitto__free(entry);
+}
+
+
+void sub__cache_clean(struct mosquitto_db *db)
+{
+	while(db->match_cache_lru){
+		sub__cache_remove(db, db->match_cache_lru);
+	}
+}
+
+
+/* Fill matches with the nodes topic matched last time, if that is still
+ * true. Returns how many there are, or -1 if there is no good entry. */
+static int sub__cache_find(struct mosquitto_db *db, const char *topic, struct mosquitto__subhier **matches)
+{
+	struct sub__cache_entry *entry;
+	int i, count = 0;
+
+	HASH_FIND(hh, db->match_cache, topic, strlen(topic), entry);
+	if(!entry) return -1;
+
+	for(i=0; i<entry->step_count; i++){
+		if(entry->steps[i].hier->generation != entry->steps[i].generation){
+			sub__cache_remove(db, entry);
+			return -1;
+		}
+		if(entry->steps[i].match){
+			matches[count++] = entry->steps[i].hier;
+		}
+	}
+
+	if(db->match_cache_lru != entry){
+		DL_DELETE(db->match_cache_lru, entry);
+		DL_PREPEND(db->match_cache_lru, entry);
+	}
+	return count;
+}
+
+
+static void sub__cache_add(struct mosquitto_db *db, const char *topic, const struct sub__cache_record *rec)
+{
+	struct sub__cache_entry *entry;
+	size_t len = strlen(topic);
+	size_t size;
+
+	size = sizeof(struct sub__cache_entry) + rec->step_count*sizeof(struct sub__cache_step) + len + 1;
+	if(size > (size_t)db->config->match_cache_bytes) return;
+
+	/* A PUBLISH made while delivering this one may have got here first. */
+	HASH_FIND(hh, db->match_cache, topic, len, entry);
+	if(entry){
+		sub__cache_remove(db, entry);
+	}
+	while(db->match_cache_lru && db->match_cache_used + size > (size_t)db->config->match_cache_bytes){
+		sub__cache_remove(db, db->match_cache_lru->prev);
+	}
+
+	entry = mosquitto__malloc(size);
+	if(!entry) return;
+	entry->steps = (struct sub__cache_step *)&entry[1];
+	memcpy(entry->steps, rec->steps, rec->step_count*sizeof(struct sub__cache_step));
+	entry->step_count = rec->step_count;
+	entry->topic = (char *)&entry->steps[rec->step_count];
+	memcpy(entry->topic, topic, len+1);
+	entry->size = size;
+
+	HASH_ADD_KEYPTR(hh, db->match_cache, entry->topic, len, entry);
+	DL_PREPEND(db->match_cache_lru, entry);
+	db->match_cache_used += size;
+}
+
+
+/* Deliver to the nodes found in the cache, as sub__search() would. */
+static int sub__cache_deliver(struct mosquitto_db *db, struct mosquitto__subhier **matches, int count, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{
+	int i, rc;
+	bool have_subscribers = false;
+
+	for(i=0; i<count; i++){
+		rc = subs__process(db, matches[i], source_id, topic, qos, retain, stored, false);
+		if(rc == MOSQ_ERR_SUCCESS){
+			have_subscribers = true;
+		}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
+			return rc;
+		}
+	}
+
+	if(have_subscribers){
+		return MOSQ_ERR_SUCCESS;
+	}else{
+		return MOSQ_ERR_NO_SUBSCRIBERS;
+	}
+}
+
+
 int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store **stored)
 {
 	int rc = 0;
 	struct mosquitto__subhier *subhier;
 	struct sub__token *tokens = NULL;
+	struct sub__slice slice_buf[SUB_SLICE_MAX];
+	struct sub__slice *slices = slice_buf;
+	struct sub__cache_record record, *rec = NULL;
+	struct mosquitto__subhier *matches[SUB_CACHE_STEPS_MAX];
+	const char *c;
+	int count;
 
 	assert(db);
 	assert(topic);
-    
-	if(sub__topic_tokenise(topic, &tokens)) return 1;
+
+	if(!db->config->match_cache_bytes){
+		if(db->match_cache) sub__cache_clean(db);
+	}else if(!retain){
+		count = sub__cache_find(db, topic, matches);
+		if(count >= 0){
+			/* Protected for the same reason as below. */
+			db__msg_store_ref_inc(*stored);
+			rc = sub__cache_deliver(db, matches, count, source_id, topic, qos, retain, *stored);
+			db__msg_store_ref_dec(db, stored);
+			return rc;
+		}
+		record.step_count = 0;
+		record.overflow = false;
+		rec = &record;
+	}
+
+	count = sub__topic_slice(topic, slices, SUB_SLICE_MAX);
+	if(count < 0){
+		/* Unusually deep topic, the levels can't be more than the '/'s plus
+		 * the leading empty level plus one. */
+		count = 2;
+		for(c=topic; *c; c++){
+			if(*c == '/') count++;
+		}
+		slices = mosquitto__malloc(count*sizeof(struct sub__slice));
+		if(!slices) return 1;
+		count = sub__topic_slice(topic, slices, count);
+	}
 
 	/* Protect this message until we have sent it to all
 	clients - this is required because websockets client calls
@@ -805,17 +1166,25 @@ int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const ch
 	*/
 	db__msg_store_ref_inc(*stored);
 
-	HASH_FIND(hh, db->subs, tokens->topic, tokens->topic_len, subhier);
+	HASH_FIND(hh, db->subs, slices[0].topic, slices[0].topic_len, subhier);
 	if(subhier){
 		if(retain){
 			/* We have a message that needs to be retained, so ensure that the subscription
 			 * tree for its topic exists.
 			 */
-			sub__add_context(db, NULL, 0, 0, 0, subhier, tokens, NULL);
+			if(sub__topic_tokenise(topic, &tokens) == MOSQ_ERR_SUCCESS){
+				sub__add_context(db, NULL, 0, 0, 0, subhier, tokens, NULL);
+				sub__topic_tokens_free(tokens);
+			}
+		}
+		rc = sub__search(db, subhier, slices, count, source_id, topic, qos, retain, *stored, true, rec);
+		if(rec && !rec->overflow && (rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_NO_SUBSCRIBERS)){
+			sub__cache_add(db, topic, rec);
 		}
-		rc = sub__search(db, subhier, tokens, source_id, topic, qos, retain, *stored, true);
 	}
-	sub__topic_tokens_free(tokens);
+	if(slices != slice_buf){
+		mosquitto__free(slices);
+	}
 
 	/* Remove our reference and free if needed. */
 	db__msg_store_ref_dec(db, stored);
@@ -833,17 +1202,16 @@ static struct mosquitto__subhier *tmp_remove_subs(struct mosquitto__subhier *sub
 		return NULL;
 	}
 
-	if(sub->children || sub->subs || sub->retained){
+	if(sub->child_count || sub->subs || sub->retained){
 		return NULL;
 	}
 
 	parent = sub->parent;
-	HASH_DELETE(hh, parent->children, sub);
-	mosquitto__free(sub->topic);
+	sub__child_remove(parent, sub);
 	mosquitto__free(sub);
 
 	if(parent->subs == NULL
-			&& parent->children == NULL
+			&& parent->child_count == 0
 			&& parent->retained == NULL
 			&& parent->shared == NULL
 			&& parent->parent){
@@ -877,7 +1245,7 @@ static int sub__clean_session_shared(struct mosquitto_db *db, struct mosquitto *
 			leaf = leaf->next;
 		}
 		if(context->shared_subs[i]->hier->subs == NULL
-				&& context->shared_subs[i]->hier->children == NULL
+				&& context->shared_subs[i]->hier->child_count == 0
 				&& context->shared_subs[i]->hier->retained == NULL
 				&& context->shared_subs[i]->hier->shared == NULL
 				&& context->shared_subs[i]->hier->parent){
@@ -922,7 +1290,7 @@ int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context)
 			leaf = leaf->next;
 		}
 		if(context->subs[i]->subs == NULL
-				&& context->subs[i]->children == NULL
+				&& context->subs[i]->child_count == 0
 				&& context->subs[i]->retained == NULL
 				&& context->subs[i]->shared == NULL
 				&& context->subs[i]->parent){
@@ -934,6 +1302,11 @@ int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context)
 			}while(hier);
 		}
 	}
+#ifdef WITH_BRIDGE
+	if(context->sub_count){
+		db->interest_dirty = true;
+	}
+#endif
 	mosquitto__free(context->subs);
 	context->subs = NULL;
 	context->sub_count = 0;
@@ -941,13 +1314,12 @@ int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context)
 	return sub__clean_session_shared(db, context);
 }
 
-void sub__tree_print(struct mosquitto__subhier *root, int level)
+static void sub__tree_print_branch(struct mosquitto__subhier *branch, int level)
 {
 	int i;
-	struct mosquitto__subhier *branch, *branch_tmp;
+	uint32_t j;
 	struct mosquitto__subleaf *leaf;
 
-	HASH_ITER(hh, root, branch, branch_tmp){
 	if(level > -1){
 		for(i=0; i<(level+2)*2; i++){
 			printf(" ");
@@ -968,7 +1340,17 @@ void sub__tree_print(struct mosquitto__subhier *root, int level)
 		printf("\n");
 	}
 
-		sub__tree_print(branch->children, level+1);
+	for(j=0; j<branch->child_count; j++){
+		sub__tree_print_branch(branch->children[j].hier, level+1);
+	}
+}
+
+void sub__tree_print(struct mosquitto__subhier *root, int level)
+{
+	struct mosquitto__subhier *branch, *branch_tmp;
+
+	HASH_ITER(hh, root, branch, branch_tmp){
+		sub__tree_print_branch(branch, level);
 	}
 }
 
@@ -1039,11 +1421,13 @@ static int retain__process(struct mosquitto_db *db, struct mosquitto__subhier *b
 
 static int retain__search(struct mosquitto_db *db, struct mosquitto__subhier *subhier, struct sub__token *tokens, struct mosquitto *context, const char *sub, int sub_qos, uint32_t subscription_identifier, time_t now, int level)
 {
-	struct mosquitto__subhier *branch, *branch_tmp;
+	struct mosquitto__subhier *branch;
+	uint32_t i;
 	int flag = 0;
 
 	if(!strcmp(tokens->topic, "#") && !tokens->next){
-		HASH_ITER(hh, subhier->children, branch, branch_tmp){
+		for(i=0; i<subhier->child_count; i++){
+			branch = subhier->children[i].hier;
 			/* Set flag to indicate that we should check for retained messages
 			 * on "foo" when we are subscribing to e.g. "foo/#" and then exit
 			 * this function and return to an earlier retain__search().
@@ -1052,13 +1436,14 @@ static int retain__search(struct mosquitto_db *db, struct mosquitto__subhier *su
 			if(branch->retained){
 				retain__process(db, branch, context, sub_qos, subscription_identifier, now);
 			}
-			if(branch->children){
+			if(branch->child_count){
 				retain__search(db, branch, tokens, context, sub, sub_qos, subscription_identifier, now, level+1);
 			}
 		}
 	}else{
 		if(!strcmp(tokens->topic, "+")){
-			HASH_ITER(hh, subhier->children, branch, branch_tmp){
+			for(i=0; i<subhier->child_count; i++){
+				branch = subhier->children[i].hier;
 				if(tokens->next){
 					if(retain__search(db, branch, tokens->next, context, sub, sub_qos, subscription_identifier, now, level+1) == -1
 							|| (tokens->next && !strcmp(tokens->next->topic, "#") && level>0)){
@@ -1074,7 +1459,7 @@ static int retain__search(struct mosquitto_db *db, struct mosquitto__subhier *su
 				}
 			}
 		}else{
-			HASH_FIND(hh, subhier->children, tokens->topic, tokens->topic_len, branch);
+			branch = sub__child_find(subhier, tokens->topic, tokens->topic_len);
 			if(branch){
 				if(tokens->next){
 					if(retain__search(db, branch, tokens->next, context, sub, sub_qos, subscription_identifier, now, level+1) == -1
@@ -22,6 +22,7 @@ Contributors:
 #include <stdio.h>
 
 #include "mosquitto_broker_internal.h"
+#include "stp_mosq.h"
 #include "memory_mosq.h"
 #include "time_mosq.h"
 
@@ -128,6 +129,105 @@ static void sys_tree__update_memory(struct mosquitto_db *db, char *buf)
 }
 #endif
 
+#ifdef WITH_BRIDGE
+static void sys_tree__bridge_queue(struct mosquitto_db *db, struct mosquitto__bridge *bridge, const char *leaf, const char *buf)
+{
+	char topic[256];
+	int len;
+
+	len = snprintf(topic, sizeof(topic), "$SYS/broker/stp/bridges/%s/%s", bridge->name, leaf);
+	if(len < 0 || len >= (int)sizeof(topic)) return;
+	db__messages_easy_queue(db, NULL, topic, SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+}
+
+static const char *sys_tree__port_role(struct mosquitto_db *db, struct mosquitto__bridge *bridge)
+{
+	switch(bridge->port_status){
+		case ROOT_PORT:
+			return "root";
+		case DESIGNATED_PORT:
+			return "designated";
+		default:
+			return bridge == db->alternate_port ? "alternate" : "blocked";
+	}
+}
+
+/* Spanning tree state and per bridge counters. Everything but the BPDU
+ * age is only published when it has changed, and nothing is allocated
+ * other than the messages themselves. */
+static void sys_tree__update_stp(struct mosquitto_db *db, char *buf, bool initial)
+{
+	static int root_id = -1;
+	static int root_port = -1;
+	static int distance = -1;
+	static unsigned long reconvergences = -1;
+	struct mosquitto__bridge *bridge;
+	struct bridge__stats *stats, *published;
+	const char *role;
+	uint64_t now;
+	int i;
+
+	if(!db->stp) return;
+
+	if(initial || stp__bridge_id(db->stp->my_root->res) != root_id || db->stp->my_root->port != root_port){
+		root_id = stp__bridge_id(db->stp->my_root->res);
+		root_port = db->stp->my_root->port;
+		snprintf(buf, BUFLEN, "%s:%d", db->stp->my_root->address, root_port);
+		db__messages_easy_queue(db, NULL, "$SYS/broker/stp/root", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+		snprintf(buf, BUFLEN, "%d", root_id);
+		db__messages_easy_queue(db, NULL, "$SYS/broker/stp/root_id", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+	}
+	if(initial || db->stp->distance != distance){
+		distance = db->stp->distance;
+		snprintf(buf, BUFLEN, "%d", distance);
+		db__messages_easy_queue(db, NULL, "$SYS/broker/stp/distance", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+	}
+	if(initial || db->stp_reconvergences != reconvergences){
+		reconvergences = db->stp_reconvergences;
+		snprintf(buf, BUFLEN, "%lu", reconvergences);
+		db__messages_easy_queue(db, NULL, "$SYS/broker/stp/reconvergences", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+	}
+
+	now = mosquitto_time_ms();
+	for(i=0; i<db->bridge_count; i++){
+		if(!db->bridges[i]) continue;
+		bridge = db->bridges[i]->bridge;
+		stats = &bridge->stats;
+		published = &bridge->stats_published;
+
+		role = sys_tree__port_role(db, bridge);
+		if(initial || role != bridge->role_published){
+			bridge->role_published = role;
+			sys_tree__bridge_queue(db, bridge, "role", role);
+		}
+		if(initial || bridge->rtt != bridge->rtt_published){
+			bridge->rtt_published = bridge->rtt;
+			snprintf(buf, BUFLEN, "%d", bridge->rtt);
+			sys_tree__bridge_queue(db, bridge, "rtt", buf);
+		}
+		if(bridge->bpdu_recv_ms){
+			snprintf(buf, BUFLEN, "%lu", (unsigned long)((now - bridge->bpdu_recv_ms)/1000));
+			sys_tree__bridge_queue(db, bridge, "bpdu_age", buf);
+		}
+		if(initial || stats->msgs_forwarded != published->msgs_forwarded){
+			published->msgs_forwarded = stats->msgs_forwarded;
+			snprintf(buf, BUFLEN, "%lu", stats->msgs_forwarded);
+			sys_tree__bridge_queue(db, bridge, "messages/forwarded", buf);
+		}
+		if(initial || stats->msgs_blocked != published->msgs_blocked){
+			published->msgs_blocked = stats->msgs_blocked;
+			snprintf(buf, BUFLEN, "%lu", stats->msgs_blocked);
+			sys_tree__bridge_queue(db, bridge, "messages/blocked", buf);
+		}
+		if(initial || stats->role_changes != published->role_changes){
+			published->role_changes = stats->role_changes;
+			snprintf(buf, BUFLEN, "%lu", stats->role_changes);
+			sys_tree__bridge_queue(db, bridge, "role_changes", buf);
+		}
+	}
+}
+#endif
+
 static void calc_load(struct mosquitto_db *db, char *buf, const char *topic, bool initial, double exponent, double interval, double *current)
 {
 	double new_value;
@@ -320,6 +420,10 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
 		sys_tree__update_memory(db, buf);
 #endif
 
+#ifdef WITH_BRIDGE
+		sys_tree__update_stp(db, buf, initial_publish);
+#endif
+
 		if(msgs_received != g_msgs_received){
 			msgs_received = g_msgs_received;
 			snprintf(buf, BUFLEN, "%lu", msgs_received);
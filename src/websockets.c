@@ -412,6 +412,7 @@ static int callback_mqtt(struct libwebsocket_context *context,
 					G_PUB_MSGS_RECEIVED_INC(1);
 				}
 #endif
+				loop__context_pending(db, mosq);
 				rc = handle__packet(db, mosq);
 
 				/* Free data and reset values */